@@ -24,12 +24,20 @@
 #include "logger.h"
 #include "notifier.h"
 
+// Polling of the irq counter by waitApexIRQ, in unit second: step when the switch is
+// imminent, step otherwise, minimum wake up margin and gain of the period estimate.
+#define APEX_WAIT_FINE   50.0e-06
+#define APEX_WAIT_COARSE 1.0e-03
+#define APEX_WAIT_MARGIN 2.0e-03
+#define APEX_WAIT_GAIN   0.125
+
 struct {
     int last_irq;
     int current_irq;
     unsigned long offset;
     unsigned char* ping_buf;
     unsigned char* pong_buf;
+    apex_wait_t wait;
 } apex_tools_ctl = 
 {
     0,
@@ -40,6 +48,12 @@ struct {
 };
 
 
+static int apex_read_irq(void* arg, int* irq)
+{
+    return ioctl(*(int*)arg, IOCTL_APEX_GET_IRQ, irq);
+}
+
+
 unsigned char* get_ping()
 {
     return apex_tools_ctl.ping_buf;
@@ -89,7 +103,6 @@ int joinApex(int* pfd)
 int initApex(int *pfd)
 {
 	int ret,set,count,irq;	
-	time_t start_time, stop_time; // time counter
 	
 	apex_reg_t apex_reg;
 	
@@ -240,68 +253,51 @@ int initApex(int *pfd)
 	// to a DMA buffer, it will increase irq by 1 
 	// now we wait for irq to become >0 
 	//
-	time(&start_time); //mark wait start time	
-	while(1){
-		if (ret = ioctl(*pfd, IOCTL_APEX_GET_IRQ, &irq)) {
-			notify(ERROR, "Failed to get DMA transfer IRQ.");
-			return(-1);
-		}else if (irq==0){
-			//
-			//check DMA wait time out
-			//the wait time is 100 second
-			//
-			time(&stop_time); //mark wait stop time
-			if ((stop_time - start_time)>TRIGGER_WAIT_TIME) {
-				notify(ERROR, "Failed to trigger DMA transfer: time out.");
-				return(-1);
-			}
-			
-		}else if (irq>0){
-			notify(DEBUG, "DMA transfer started. irq=%d", irq);
-			break;	// We have data in DMA buffer :)
-		}else {
-			notify(ERROR, "Unexpected DMA transfer IRQ value %d.",irq);
-			return(-1);
-		}
-		usleep(10000);
+	memset(&apex_tools_ctl.wait, 0, sizeof(apex_wait_t));
+	irq = waitApexIRQ(&apex_tools_ctl.wait, apex_read_irq, pfd, 0, TRIGGER_WAIT_TIME);
+	if (irq == APEX_WAIT_TIMEOUT) {
+		notify(ERROR, "Failed to trigger DMA transfer: time out.");
+		return(-1);
+	}else if (irq < 0){
+		return(-1);
 	}
+	notify(DEBUG, "DMA transfer started. irq=%d", irq);	// We have data in DMA buffer :)
 	return 0;
 }
 		
 ///////////////////////////////////////////////////////////
-//getApexRawData(): read a block of data from DMA buffer
+//mapApexRawData(): locate the next block of data in the
+//		    DMA buffer, without copying it
 //
 //note:
-//	two integer meta data are appended to the end of 
-//	the out buffer
+//	the returned pointer is in the mmapped ping/pong 
+//	buffer. It is only valid until the irq counter moves
+//	on by one, after which the DMA starts overwriting it.
 //
 //parameters: 
-//char *pdata - pointer to the out buff (meta data
-//		 will be appended to its tail)
-//int data_length - the out put buffer length 
-//		    (not including the meta data tail)
+//int data_length - the block length 
+//int *irq_count - the irq of the block (output)
+//int *buffer_offset - the offset of the block (output)
 //int *pfd - pointer to the filedevice initApex opened
 ///////////////////////////////////////////////////////////	
-int getApexRawData(unsigned char *pData, int data_length,int *irq_count,int *buffer_offset, int *pfd) {
+unsigned char* mapApexRawData(int data_length,int *irq_count,int *buffer_offset, int *pfd) {
 	int ret, irq;
-	int i, count;
+	unsigned char* pBuf;
 
-	time_t start_time, stop_time; // time counter
-	
-	if ((data_length > DMA_SIZE) || (data_length < 0) || (DMA_SIZE % data_length != 0))	{
+	if ((data_length > DMA_SIZE) || (data_length <= 0) || (DMA_SIZE % data_length != 0))	{
 		notify(ERROR, "Invalid data_length!");
-		return(-1);
+		return(NULL);
 	}
 
 	// select DMA buffer 
 	if (ret = ioctl(*pfd, IOCTL_APEX_GET_IRQ, &irq)) {
 		notify(ERROR, "Failed to get DMA transfer IRQ.");
-		return(-1);
+		return(NULL);
 	}else if (irq>0){
 		notify(DEBUG, "irq=%d,last_irq = %d, offset = %ld", irq, apex_tools_ctl.last_irq, apex_tools_ctl.offset);
 	}else {
 		notify(ERROR, "Unexpected DMA transfer IRQ value %d.",irq);
-		return(-1);
+		return(NULL);
 	}
 	
 	//
@@ -334,51 +330,34 @@ int getApexRawData(unsigned char *pData, int data_length,int *irq_count,int *buf
 			//
 			//this happens when data processing is faster than data aquisition
 			//
-			time(&start_time); //mark wait start time	
 			notify(DEBUG, "irq=%d: Waiting for next DMA buffer to be ready ...", irq);
 
-			while (1) {
-
-				//
-				//need a timer to break out the wait loop
-				//because the next DMA buffer might never happen
-				//
-		
-				if (ret = ioctl(*pfd, IOCTL_APEX_GET_IRQ, &irq)) {
-					notify(ERROR, "Failed to get DMA transfer IRQ.");
-					return(-1);
-				}
-		
-				if (apex_tools_ctl.last_irq != irq) { // next buffer is ready 
-					apex_tools_ctl.offset = 0;
-					break;
-				}
-				//
-				//check DMA wait time out
-				//the wait time is 2 second
-				//
-				time(&stop_time); //mark wait stop time	
-				if ((stop_time - start_time)>2) {
-					notify(ERROR, "Fatal error, DMA wait time out.");
-					notify(ERROR, "Please check if the DMA LED on the Apex card is still on.");
-					return(-1);
-				}
-				usleep(1000);
+			//
+			//the wait times out since the next DMA buffer might never happen
+			//
+			irq = waitApexIRQ(&apex_tools_ctl.wait, apex_read_irq, pfd, irq, APEX_DMA_TIMEOUT);
+			if (irq == APEX_WAIT_TIMEOUT) {
+				notify(ERROR, "Fatal error, DMA wait time out.");
+				notify(ERROR, "Please check if the DMA LED on the Apex card is still on.");
+				return(NULL);
+			}else if (irq < 0){
+				return(NULL);
 			}
+			apex_tools_ctl.offset = 0; // next buffer is ready
 		}
 	}else {
 		//
 		//this should never happen!
 		//
 		notify(ERROR, "Fatal error. Unexpected DMA transfer IRQ value %d. (last_irq=%d)", irq, apex_tools_ctl.last_irq);
-		return(-1);
+		return(NULL);
 	}
 	
 	//
 	//read data from DMA buffer that correspond to the current_irq 
 	//
 
-	notify(DEBUG, "DMA transfer irq= %d, last_irq=%d, offset=%d", irq, apex_tools_ctl.last_irq, apex_tools_ctl.offset);
+	notify(DEBUG, "DMA transfer irq= %d, last_irq=%d, offset=%lu", irq, apex_tools_ctl.last_irq, apex_tools_ctl.offset);
 	if ((irq)%2 == 0){ // pong
 		//
 		//which DMA buffer is available?
@@ -386,9 +365,9 @@ int getApexRawData(unsigned char *pData, int data_length,int *irq_count,int *buf
 	 	//ping buffer irq start as 1, then always be odd 	
 	 	//pong buffer irq start as 2, then always even
 	 	//
-		memcpy(pData,(apex_tools_ctl.pong_buf+apex_tools_ctl.offset),sizeof(unsigned char)*data_length);
+		pBuf = apex_tools_ctl.pong_buf+apex_tools_ctl.offset;
 	}else{	// ping
-		memcpy(pData,(apex_tools_ctl.ping_buf+apex_tools_ctl.offset),sizeof(unsigned char)*data_length);
+		pBuf = apex_tools_ctl.ping_buf+apex_tools_ctl.offset;
 	}
 	*irq_count=irq;
 	*buffer_offset=(int)apex_tools_ctl.offset;
@@ -421,6 +400,27 @@ int getApexRawData(unsigned char *pData, int data_length,int *irq_count,int *buf
 	apex_tools_ctl.last_irq=irq;
 	apex_tools_ctl.offset += data_length;
 
+	return pBuf;
+}
+
+
+///////////////////////////////////////////////////////////
+//getApexRawData(): read a block of data from DMA buffer
+//
+//parameters: 
+//char *pdata - pointer to the out buff
+//int data_length - the out put buffer length 
+//int *irq_count - the irq of the block (output)
+//int *buffer_offset - the offset of the block (output)
+//int *pfd - pointer to the filedevice initApex opened
+///////////////////////////////////////////////////////////	
+int getApexRawData(unsigned char *pData, int data_length,int *irq_count,int *buffer_offset, int *pfd) {
+	unsigned char* pBuf = mapApexRawData(data_length, irq_count, buffer_offset, pfd);
+	if (pBuf == NULL)
+		return(-1);
+
+	memcpy(pData, pBuf, sizeof(unsigned char)*data_length);
+
 	return 0;
 }
 
@@ -469,6 +469,10 @@ int closeApex(int *pfd)
 		return(-1);
 	}
 
+	notify(DEBUG, "DMA waits: %.1f polls per wait, period=%.6f s.",
+	    (double)apex_tools_ctl.wait.n_poll/(apex_tools_ctl.wait.n_wait > 0 ? apex_tools_ctl.wait.n_wait : 1),
+	    apex_tools_ctl.wait.period);
+
 	close(*pfd);
 	return 0;
 }
@@ -482,31 +486,37 @@ int synchroniseWithApex(int* pfd)
 //
 //=====================================================================
 {
-    int ret;
-    int irq_count = apex_tools_ctl.current_irq;
+    int irq_count;
 
-    while (apex_tools_ctl.current_irq == irq_count)
+    if (apex_read_irq(pfd, &irq_count))
     {
-        if (ret = ioctl(*pfd, IOCTL_APEX_GET_IRQ, &irq_count))
-        {
-            notify(ERROR, "Failed to get DMA transfer IRQ.");
+        notify(ERROR, "Failed to get DMA transfer IRQ.");
+        return(-1);
+    }
+
+    // Check irq number
+    //===
+    if (irq_count < 0)
+    {
+        notify(ERROR, "Wrong irq count: irq_count=%d.", irq_count);
+        return(-1);
+    }
+    else if (irq_count == 0)
+    {
+        notify(ERROR, "DMA not started yet." );
+        return( -1 );
+    }
+
+
+    // Wait for the next switch, sleeping until shortly before it is due.
+    if (irq_count == apex_tools_ctl.current_irq)
+    {
+        double timeout = APEX_DMA_TIMEOUT+apex_tools_ctl.wait.period;
+        irq_count = waitApexIRQ(&apex_tools_ctl.wait, apex_read_irq, pfd, irq_count, timeout);
+        if (irq_count == APEX_WAIT_TIMEOUT)
+            notify(ERROR, "Fatal error, DMA wait time out.");
+        if (irq_count < 0)
             return(-1);
-        }
-        else 
-        {
-            // Check irq number
-            //===
-            if (irq_count < 0)
-            {
-                notify(ERROR, "Wrong irq count: irq_count=%d.", irq_count);
-                return(-1);
-            }
-            else if (irq_count == 0)
-            {
-                notify(ERROR, "DMA not started yet." );
-                return( -1 );
-            }
-        }
     }
 
     apex_tools_ctl.current_irq = irq_count;
@@ -544,3 +554,116 @@ int getApexIRQ(int* pfd)
 
     return apex_tools_ctl.current_irq;
 }
+
+
+static double apex_clock()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+1.0e-9*t.tv_nsec;
+}
+
+
+//=====================================================================
+int waitApexIRQ(apex_wait_t* wait, apex_irq_reader read, void* arg, int irq, double timeout)
+//=====================================================================
+//
+//  Wait for the irq counter to move on from irq, within timeout
+//  seconds. Returns the new irq, APEX_WAIT_ERROR if the counter can't
+//  be read or went back, or APEX_WAIT_TIMEOUT.
+//
+//  The buffer period is learned from the switches seen as they
+//  happened, i.e. polled at most APEX_WAIT_COARSE apart. The wait
+//  then sleeps until a margin before the predicted switch and polls
+//  finely around it. When a switch comes before the wake up the
+//  margin is doubled, and the wait polls coarsely until the next
+//  switch seen as it happened, which corrects the period.
+//
+//=====================================================================
+{
+    double start = apex_clock();
+    double slept = 0.0;
+    int n_read   = 0;
+    int new_irq;
+
+    if (wait->margin == 0.0)
+        wait->margin = APEX_WAIT_MARGIN;
+    wait->n_wait++;
+
+    while (1)
+    {
+        if (read(arg, &new_irq))
+        {
+            notify(ERROR, "Failed to get DMA transfer IRQ.");
+            return(APEX_WAIT_ERROR);
+        }
+        wait->n_poll++;
+        n_read++;
+        double now = apex_clock();
+
+        if (new_irq < irq)
+        {
+            notify(ERROR, "Unexpected DMA transfer IRQ value %d (waiting from %d).", new_irq, irq);
+            return(APEX_WAIT_ERROR);
+        }
+        else if (new_irq > irq)
+        {
+            if ((n_read > 1) && (slept <= APEX_WAIT_COARSE))
+            {
+                // Seen as it happened: update the period, unless the DMA paused.
+                // Persistent outliers replace it.
+                if ((wait->last > 0.0) && (new_irq > wait->last_irq))
+                {
+                    double sample = (now-wait->last)/(new_irq-wait->last_irq);
+                    if ((sample > 0.5*wait->period) && (sample < 2.0*wait->period))
+                    {
+                        wait->period  += APEX_WAIT_GAIN*(sample-wait->period);
+                        wait->n_reject = 0;
+                    }
+                    else if ((wait->period == 0.0) || (++wait->n_reject >= 3))
+                    {
+                        wait->period   = sample;
+                        wait->n_reject = 0;
+                    }
+                }
+                wait->last     = now;
+                wait->last_irq = new_irq;
+                wait->resync   = 0;
+                if (wait->margin > APEX_WAIT_MARGIN)
+                    wait->margin *= 0.95;
+            }
+            else if (n_read > 1)
+            {
+                // Woke up late.
+                wait->margin *= 2.0;
+                if (wait->margin > 0.25*wait->period)
+                    wait->margin = 0.25*wait->period;
+                if (wait->margin < APEX_WAIT_MARGIN)
+                    wait->margin = APEX_WAIT_MARGIN;
+                wait->resync = 1;
+            }
+
+            return new_irq;
+        }
+
+        if (now-start > timeout)
+            return(APEX_WAIT_TIMEOUT);
+
+
+        // Sleep until the margin before the predicted switch, then poll finely around it.
+        slept = APEX_WAIT_COARSE;
+        if ((wait->period > 0.0) && (wait->last > 0.0) && !wait->resync)
+        {
+            double next = wait->last+wait->period*(irq+1-wait->last_irq);
+            if (now < next-wait->margin)
+                slept = next-wait->margin-now;
+            else if (now < next+wait->margin)
+                slept = APEX_WAIT_FINE;
+        }
+        if (slept > start+timeout-now)
+            slept = start+timeout-now+APEX_WAIT_FINE;
+
+        struct timespec ts = {(time_t)slept, (long)(1.0e+09*(slept-(time_t)slept))};
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+    }
+}
@@ -41,6 +41,29 @@ typedef struct {
 // Wait time for triggering the Apex card, in unit second.
 #define TRIGGER_WAIT_TIME 120
 
+// Wait time for the next DMA buffer, in unit second.
+#define APEX_DMA_TIMEOUT 2
+
+// Return codes of waitApexIRQ, besides the new irq.
+#define APEX_WAIT_ERROR   -1
+#define APEX_WAIT_TIMEOUT -2
+
+
+// Read the irq counter of a DMA, returning 0 on success.
+typedef int (*apex_irq_reader)(void* arg, int* irq);
+
+// State of the adaptive wait for the DMA buffer switches, see waitApexIRQ.
+typedef struct {
+        double period;   /* learned buffer period, in unit second, 0 if unknown */
+        double margin;   /* wake up margin before the predicted switch */
+        double last;     /* time of the last switch seen as it happened */
+        int last_irq;    /* irq of that switch */
+        int n_reject;    /* consecutive period samples rejected */
+        int resync;      /* no prediction until a switch is seen as it happened */
+        long n_wait;
+        long n_poll;
+} apex_wait_t;
+
 /*
  *  Interface functions to Apex.
  */
@@ -52,7 +75,9 @@ int initApex(int *pfd);
 int synchroniseWithApex(int* pfd);
 unsigned char* iddleApexBuffer();
 int getApexIRQ(int* pfd);
+unsigned char* mapApexRawData(int data_length, int *irq_count, int *offset, int *pfd);
 int getApexRawData(unsigned char *pData, int data_length,int *irq_count, int *offset, int *pfd);
 int closeApex(int *pfd);
+int waitApexIRQ(apex_wait_t* wait, apex_irq_reader read, void* arg, int irq, double timeout);
 
 #endif
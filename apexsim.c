@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "apexsim.h"
+#include "logger.h"
+#include "work_memory.h"
+
+//========================================================================================
+//
+//  Emulation of the Apex card DMA. A background thread fills the ping and pong buffers in
+//  turn, at the ADC sample rate or as fast as possible if the rate is 0, and increments
+//  the irq counter each time a buffer is complete: ping for odd irq, pong for even ones.
+//  The buffer of irq n is overwritten as soon as the irq counter reaches n+1, as on the
+//  card, so that slow consumers overrun.
+//
+//  The samples are taken from a recording, <data_dir>/<hostname>.sim, mapped in memory
+//  and replayed in a loop, or from any other source given to apexsim_start.
+//
+//  The consumers are woken up at the buffer switches, or poll the irq counter with the
+//  adaptive wait of the Apex card, waitApexIRQ, if polled.
+//
+//========================================================================================
+
+// Amount of data written at once by the DMA thread.
+#define APEXSIM_CHUNK (1024*1024)
+
+
+struct {
+    double           rate;
+    int              polled;
+    apex_wait_t      wait;
+    unsigned char*   buffer[2];
+    unsigned char*   recording;
+    long             recording_size;
+    apexsim_source   source;
+
+    pthread_t        thread;
+    pthread_mutex_t  mutex;
+    pthread_cond_t   switched;
+    volatile int     running;
+    volatile int     irq;               // updated by the DMA thread
+
+    int              current_irq;       // irq of the last synchronisation
+    int              last_irq;          // irq of the last block mapped
+    int              offset;            // offset of the last block mapped
+    int              position;          // end of the last block mapped
+} apexsim_ctl = {
+    APEXSIM_DEFAULT_RATE,
+    0,
+    {0.0},
+    {NULL, NULL},
+    NULL,
+    0,
+    NULL,
+    0,
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER
+};
+
+
+double* apexsim_rate()
+{
+    return &apexsim_ctl.rate;
+}
+
+
+int* apexsim_polled()
+{
+    return &apexsim_ctl.polled;
+}
+
+
+static int apexsim_replay(unsigned char* data, long n, long long position)
+{
+    // Copy from the recording, wrapping around at its end.
+    long i = position % apexsim_ctl.recording_size;
+    while (n > 0)
+    {
+        long m = apexsim_ctl.recording_size-i;
+        if (m > n)
+            m = n;
+        memcpy(data, apexsim_ctl.recording+i, m);
+        data += m;
+        n    -= m;
+        i     = 0;
+    }
+
+    return 0;
+}
+
+
+static void* apexsim_dma(void* arg)
+{
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long long position = 0;
+
+    while (apexsim_ctl.running)
+    {
+        // Fill the buffer of the next irq.
+        unsigned char* buffer = apexsim_ctl.buffer[(apexsim_ctl.irq+1)%2];
+        for (long i = 0; (i < APEXSIM_SIZE) && apexsim_ctl.running; i += APEXSIM_CHUNK)
+        {
+            long n = (APEXSIM_SIZE-i < APEXSIM_CHUNK) ? APEXSIM_SIZE-i : APEXSIM_CHUNK;
+            if (apexsim_ctl.source(buffer+i, n, position) < 0)
+            {
+                apexsim_ctl.running = 0;
+                break;
+            }
+            position += n;
+
+            // Pace on the wall clock.
+            if (apexsim_ctl.rate > 0.0)
+            {
+                double t = position/apexsim_ctl.rate;
+                struct timespec deadline = t0;
+                deadline.tv_sec  += (time_t)t;
+                deadline.tv_nsec += (long)((t-(time_t)t)*1.0e+09);
+                if (deadline.tv_nsec >= 1000000000L)
+                {
+                    deadline.tv_sec  += 1;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+            }
+        }
+        if (!apexsim_ctl.running)
+            break;
+
+
+        // Raise the interrupt.
+        pthread_mutex_lock(&apexsim_ctl.mutex);
+        apexsim_ctl.irq++;
+        pthread_cond_broadcast(&apexsim_ctl.switched);
+        pthread_mutex_unlock(&apexsim_ctl.mutex);
+    }
+
+    // Wake up the consumers.
+    pthread_mutex_lock(&apexsim_ctl.mutex);
+    pthread_cond_broadcast(&apexsim_ctl.switched);
+    pthread_mutex_unlock(&apexsim_ctl.mutex);
+
+    return NULL;
+}
+
+
+static int apexsim_read_irq(void* arg, int* irq)
+{
+    // The ioctl of the emulated card: fails once the DMA is stopped.
+    *irq = apexsim_ctl.irq;
+    return apexsim_ctl.running ? 0 : -1;
+}
+
+
+static int apexsim_wait(int irq, double timeout)
+{
+    // Wait for the irq counter to move past irq.
+    if (apexsim_ctl.polled)
+    {
+        int new_irq = waitApexIRQ(&apexsim_ctl.wait, apexsim_read_irq, NULL, irq, (time_t)timeout+1);
+        if (new_irq == APEX_WAIT_TIMEOUT)
+            notify(ERROR, "Emulated DMA stopped or timed out (irq=%d).", irq);
+        return (new_irq < 0) ? -1 : new_irq;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)timeout+1;
+
+    pthread_mutex_lock(&apexsim_ctl.mutex);
+    while ((apexsim_ctl.irq == irq) && apexsim_ctl.running)
+    {
+        if (pthread_cond_timedwait(&apexsim_ctl.switched, &apexsim_ctl.mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    int new_irq = apexsim_ctl.irq;
+    pthread_mutex_unlock(&apexsim_ctl.mutex);
+
+    if (new_irq == irq)
+    {
+        notify(ERROR, "Emulated DMA stopped or timed out (irq=%d).", irq);
+        return(-1);
+    }
+
+    return new_irq;
+}
+
+
+static double apexsim_period()
+{
+    return (apexsim_ctl.rate > 0.0) ? APEXSIM_SIZE/apexsim_ctl.rate : 0.0;
+}
+
+
+int apexsim_init(char* data_dir)
+{
+    char hostname[8] = "u000";
+    gethostname(hostname, sizeof(hostname));
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.sim", data_dir, hostname);
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) < 0) || (st.st_size == 0))
+    {
+        notify(ERROR, "In apexsim_init: couldn't access data file %s", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    apexsim_ctl.recording = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (apexsim_ctl.recording == MAP_FAILED)
+    {
+        apexsim_ctl.recording = NULL;
+        notify(ERROR, "In apexsim_init: couldn't map data file %s", path);
+        return -1;
+    }
+    apexsim_ctl.recording_size = st.st_size;
+    madvise(apexsim_ctl.recording, st.st_size, MADV_SEQUENTIAL);
+
+    return apexsim_start(apexsim_replay);
+}
+
+
+int apexsim_start(apexsim_source source)
+{
+    // Map the ping and pong buffers, on huge pages local to this node for faster scans.
+    for (int i = 0; i < 2; i++)
+    {
+        apexsim_ctl.buffer[i] = wm_alloc(APEXSIM_SIZE, WM_HUGE | WM_LOCAL);
+        if (apexsim_ctl.buffer[i] == NULL)
+        {
+            notify(ERROR, "In apexsim_start: couldn't map the DMA buffers.");
+            apexsim_close();
+            return -1;
+        }
+    }
+
+
+    // Start the DMA and wait for the first buffer, as initApex does for the trigger.
+    apexsim_ctl.source      = source;
+    apexsim_ctl.irq         = 0;
+    apexsim_ctl.current_irq = 0;
+    apexsim_ctl.last_irq    = 0;
+    apexsim_ctl.offset      = 0;
+    apexsim_ctl.position    = 0;
+    apexsim_ctl.running     = 1;
+    memset(&apexsim_ctl.wait, 0x0, sizeof(apex_wait_t));
+    if (pthread_create(&apexsim_ctl.thread, NULL, apexsim_dma, NULL) != 0)
+    {
+        apexsim_ctl.running = 0;
+        notify(ERROR, "In apexsim_start: couldn't start the DMA thread.");
+        apexsim_close();
+        return -1;
+    }
+
+    if (apexsim_wait(0, 2.0*apexsim_period()) < 0)
+    {
+        apexsim_close();
+        return -1;
+    }
+    notify(DEBUG, "Emulated DMA transfer started at %.1f MS/s.", apexsim_ctl.rate*1.0e-06);
+
+    return 0;
+}
+
+
+int apexsim_synchronise()
+{
+    // Wait for the next buffer switch, as synchroniseWithApex.
+    int irq = apexsim_wait(apexsim_ctl.irq, 2.0*apexsim_period());
+    if (irq < 0)
+        return -1;
+    apexsim_ctl.current_irq = irq;
+
+    return 0;
+}
+
+
+int apexsim_counter()
+{
+    return apexsim_ctl.irq;
+}
+
+
+unsigned char* apexsim_data()
+{
+    return apexsim_ctl.buffer[apexsim_ctl.current_irq%2];
+}
+
+
+unsigned char* apexsim_map_data(int length)
+{
+    if ((length > APEXSIM_SIZE) || (length <= 0) || (APEXSIM_SIZE % length != 0))
+    {
+        notify(ERROR, "In apexsim_map_data: invalid length %d.", length);
+        return NULL;
+    }
+
+    // Same buffer selection as mapApexRawData: start a new buffer if the irq moved on,
+    // otherwise continue in the current one and wait for the next irq at its end.
+    int irq = apexsim_ctl.irq;
+    if (irq > apexsim_ctl.last_irq)
+        apexsim_ctl.position = 0;
+    else if (apexsim_ctl.position == APEXSIM_SIZE)
+    {
+        irq = apexsim_wait(irq, 2.0*apexsim_period());
+        if (irq < 0)
+            return NULL;
+        apexsim_ctl.position = 0;
+    }
+
+    unsigned char* data   = apexsim_ctl.buffer[irq%2]+apexsim_ctl.position;
+    apexsim_ctl.last_irq  = irq;
+    apexsim_ctl.offset    = apexsim_ctl.position;
+    apexsim_ctl.position += length;
+
+    return data;
+}
+
+
+int apexsim_copy_data(unsigned char* data, int length)
+{
+    unsigned char* p = apexsim_map_data(length);
+    if (p == NULL)
+        return -1;
+
+    memcpy(data, p, length);
+
+    return 0;
+}
+
+
+int apexsim_close()
+{
+    if (apexsim_ctl.running)
+    {
+        apexsim_ctl.running = 0;
+        pthread_join(apexsim_ctl.thread, NULL);
+        notify(DEBUG, "Emulated DMA stopped at irq=%d.", apexsim_ctl.irq);
+        if (apexsim_ctl.polled)
+            notify(DEBUG, "Emulated DMA waits: %.1f polls per wait, period=%.6f s.",
+                (double)apexsim_ctl.wait.n_poll/((apexsim_ctl.wait.n_wait > 0) ? apexsim_ctl.wait.n_wait : 1),
+                apexsim_ctl.wait.period);
+    }
+
+    for (int i = 0; i < 2; i++) if (apexsim_ctl.buffer[i] != NULL)
+    {
+        wm_free(apexsim_ctl.buffer[i]);
+        apexsim_ctl.buffer[i] = NULL;
+    }
+
+    if (apexsim_ctl.recording != NULL)
+    {
+        munmap(apexsim_ctl.recording, apexsim_ctl.recording_size);
+        apexsim_ctl.recording = NULL;
+    }
+
+    return(0);
+}
+
+
+int apexsim_irq()
+{
+    return apexsim_ctl.last_irq;
+}
+
+
+int apexsim_offset()
+{
+    return apexsim_ctl.offset;
+}
@@ -0,0 +1,33 @@
+#ifndef APEXSIM_H
+#define APEXSIM_H 1
+
+#include "apex_tools.h"
+
+
+// Size of the emulated ping and pong buffers.
+#define APEXSIM_SIZE DMA_SIZE
+
+// Default sample rate of the emulated ADC, in samples per second.
+#define APEXSIM_DEFAULT_RATE 200.0e+06
+
+
+// Source of the emulated DMA: fill n bytes at the given stream position.
+typedef int (*apexsim_source)(unsigned char* data, long n, long long position);
+
+
+int apexsim_init(char* data_dir);
+int apexsim_start(apexsim_source source);
+int apexsim_synchronise();
+int apexsim_counter();
+unsigned char* apexsim_data();
+int apexsim_copy_data(unsigned char* data, int length);
+unsigned char* apexsim_map_data(int length);
+int apexsim_close();
+
+int apexsim_irq();
+int apexsim_offset();
+
+double* apexsim_rate();
+int* apexsim_polled();
+
+#endif
@@ -17,7 +17,10 @@
 #include "ipps.h"
 #include "daq_i.h"
 #include "data_writer.h"
+#include "event_format.h"
+#include "selector.h"
 #include "logger.h"
+#include "work_memory.h"
 
 #define data_length (1024) //the data size for each record 
 #define DataSampleLength data_length
@@ -44,6 +47,7 @@ int main(int argsc, char **argsv)
 	int last_irq_count=0;
 	char timefilename[] = "BACK_time.bin";
 	char datafilename[] = "BACK_data.bin";
+	char eventfilename[] = "BACK_event.bin";
 	char hostname[65];
 	int parameters[4];
 	int time_interval = (5); //time interval between each data sample
@@ -55,9 +59,10 @@ int main(int argsc, char **argsv)
         if (parse_inputs(argsc, argsv, &N, &time_interval, &runnumber) < 0)
             return 0;
 
-	pdata = malloc(data_length*N);
-	Ipp32f *pDataSample=ippsMalloc_32f(data_length*N);
-	if ( ( pDataSample == NULL ) || ( pdata == NULL )  )
+	pdata = wm_alloc(data_length*N, WM_DEFAULT);
+	Ipp32f *pDataSample=wm_alloc(data_length*N*sizeof(Ipp32f), WM_DEFAULT);
+	int *pinfo = malloc(N*EVT_INFO_SIZE*sizeof(int));
+	if ( ( pDataSample == NULL ) || ( pdata == NULL ) || ( pinfo == NULL ) )
 	{
 	  notify(ERROR, "Couldn't allocate enough memory. Aborting" );
           return 0;
@@ -74,9 +79,15 @@ int main(int argsc, char **argsv)
 	int ihost = atoi(hostname+1);
 
         dw_initialise(irun, ihost);
-        dw_clear(datafilename);
         dw_clear(timefilename);
 
+        // With --compress the records are packed into an event file instead of the raw dump.
+        int packed = *dw_compress();
+        if (packed)
+            dw_event_open(eventfilename, ihost-ANTENNA_ID_OFFSET, 0.0, 0, 1.0/CONSTANT_TS);
+        else
+            dw_clear(datafilename);
+
         // Start the DAQ.
 	if (daq_start() < 0)
             return 0;
@@ -111,7 +122,17 @@ int main(int argsc, char **argsv)
 			parameters[2]=(int)DataSampleMean;
 			parameters[3]=(int)DataSampleMax;
 			
-                        dw_dump(datafilename, N*data_length, pdata);
+                        if (packed) {
+                                for(i=0;i<N;i++){
+                                        pinfo[i*EVT_INFO_SIZE+0]=t;
+                                        pinfo[i*EVT_INFO_SIZE+1]=daq_irq();
+                                        pinfo[i*EVT_INFO_SIZE+2]=daq_offset()/data_length+i;
+                                        pinfo[i*EVT_INFO_SIZE+3]=0;
+                                }
+                                dw_event_write(eventfilename, N, pinfo, pdata);
+                        }
+                        else
+                                dw_dump(datafilename, N*data_length, pdata);
                         dw_dump(timefilename, 4, parameters);
 
 			notify(INFO, "loop=%d, t=%d, 10*std=%3d, mean=%3d, max=%3d", 
@@ -123,10 +144,14 @@ int main(int argsc, char **argsv)
 		}
 
 	}
-	free( pdata );
-	ippsFree( pDataSample );
+	wm_free( pdata );
+	wm_free( pDataSample );
+	free( pinfo );
 	
+        if (packed)
+            dw_event_close(eventfilename);
         daq_close();
+        dw_close();
 
 	return 0;
 }
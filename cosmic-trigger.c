@@ -31,6 +31,9 @@
 #include "logger.h"
 #include "data_writer.h"
 #include "notifier.h"
+#include "wire_protocol.h"
+#include "stats.h"
+#include "work_memory.h"
 
 #define work_data_length (128*1024*1024)
 #define spike_data_length (1024)
@@ -47,11 +50,19 @@ static void sig_int(int);
 
 // Parse the input arguments.
 int parse_inputs(int argsc, char** argsv, float* threshold, 
-char** runid, int* multiplicity);
+char** runid, int* multiplicity, int* zerocopy, int* waitsome);
 
 // Show help text on usage.
 void print_usage(char* process);
 
+// Mark the coincident spikes, setting their time to -1.
+static int coincidence_filter(int channel_count, int spike_counts[], 
+unsigned long spike_times[][spike_count_max], int threshold);
+
+// Decode the spike message of a channel.
+static void decode_spikes(int n, unsigned char* message, int message_size, wp_header_t* header,
+int* spike_count, unsigned long spike_times[spike_count_max], int* buffer);
+
 
 int halt=0; //main loop stop flag
 
@@ -63,19 +74,21 @@ int main(int argsc, char **argsv)
 	int count;
 	int channel_count = MAX_CHANNEL_COUNT;
 	int coincident_count_threshold;
+	int zerocopy = 0; //scan the DMA buffer in place instead of copying it
+	int waitsome = 0; //exchange with point to point messages instead of collectives
 	
-        static unsigned char work_data[(long)work_data_length]; //chunck of data read from DMA buffer
-	static unsigned char spike_data[spike_count_max*spike_data_length]; //chunck of data with spike
-	static unsigned char spike_data_save[spike_count_max*spike_data_length]; //chunck of data with spike
+        unsigned char* work_data = NULL; //chunck of data read from DMA buffer
+	unsigned char* spike_data = NULL; //chunck of data with spike
+	unsigned char* spike_data_save = NULL; //chunck of data with spike
 	static int  spike_info[spike_count_max*4]; //spike data time info
 	static int  spike_info_save[spike_count_max*4]; //spike data time info
-	static long spike_time[spike_count_max]; //spike position relative to the start of work_data
+	static int  spike_time[spike_count_max]; //spike position relative to the start of work_data
+	static char spike_decision[spike_count_max]; //server decision on each spike
+	static unsigned char message[WP_TIMES_SIZE(spike_count_max)]; //encoded spike times or decisions
 
-	memset(spike_data,0,spike_count_max*spike_data_length*sizeof(unsigned char));
-	memset(spike_data_save,0,spike_count_max*spike_data_length*sizeof(unsigned char));
 	memset(spike_info,0,spike_count_max*4*sizeof(int));
 	memset(spike_info_save,0,spike_count_max*4*sizeof(int));
-	memset(spike_time,0,spike_count_max*sizeof(long));
+	memset(spike_time,0,sizeof(spike_time));
 	
         int irq_count=0;
 	int last_irq_count=0;
@@ -89,7 +102,7 @@ int main(int argsc, char **argsv)
         gethostname(hostname,sizeof(hostname));
 
         // Parse the input arguments.
-        if (parse_inputs(argsc, argsv, &N, &runnumber, &coincident_count_threshold) < 0)
+        if (parse_inputs(argsc, argsv, &N, &runnumber, &coincident_count_threshold, &zerocopy, &waitsome) < 0)
             exit(0);
         
 	Ipp32f *pDataSample=ippsMalloc_32f(spike_data_length);
@@ -108,6 +121,7 @@ int main(int argsc, char **argsv)
         dw_clear(datafilename);
         dw_clear(timefilename);
         dw_clear(logfilename);
+        stats_open("cosmic-trigger", ihost);
 
         // Redirect SIGINT interupt.
 	signal(SIGINT,sig_int);
@@ -123,7 +137,7 @@ int main(int argsc, char **argsv)
         MPI_Comm_rank(MPI_COMM_WORLD,&myMPIRank); //Get the current process id
         MPI_Comm_size(MPI_COMM_WORLD,&mpi_process_count);//Get the number of process
         MPI_Get_processor_name(node_name,&node_name_length);//Get the processor's name
-        MPI_Errhandler_set(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
+        MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
 
         notify(DEBUG, "MPI rank is %d / %d", myMPIRank, mpi_process_count);
 
@@ -137,107 +151,96 @@ int main(int argsc, char **argsv)
 	int channel_mpi_ranks[channel_count];
 	MPI_Status mpi_receive_statuses[channel_count];
 	int spike_counts[channel_count];
-	long time_lower=0, time_upper=0, time_middle=0; 
-	int time_slice_count=0;
+	wp_header_t headers[channel_count];
 	for(i=0; i<channel_count; i++){
 		channel_mpi_ranks[i]=i;
 	}
 
+	//intercommunicator between the server and the acquisition processes, for the collective
+	//exchange: the server is the root of the gathers and scatters and has no data of its own.
+	//The acquisition process n is rank n of the remote group of the server.
+	MPI_Comm local_comm, trigger_comm;
+	int is_server = (myMPIRank == server_mpi_rank);
+	MPI_Comm_split(MPI_COMM_WORLD, is_server, myMPIRank, &local_comm);
+	MPI_Intercomm_create(local_comm, 0, MPI_COMM_WORLD, is_server ? 0 : server_mpi_rank, 2, &trigger_comm);
+
 
         int loop_count=0;
         //////////////////////////////////////////////////
         // Server process
         /////////////////////////////////////////////////
         if(myMPIRank == server_mpi_rank){
+	unsigned char* messages=malloc((size_t)channel_count*WP_TIMES_SIZE(spike_count_max)); //spike messages of all channels
+	int message_sizes[channel_count];
+	int displacements[channel_count];
+	MPI_Request requests[channel_count];
+	int indices[channel_count];
+	if (messages == NULL) {
+		notify(ERROR, "Could not allocate the message buffers.");
+		halt = 1;
+	}
+
 	while (halt==0)
 	{
 		if (loop_count >=999999)
 		break;
 
-		int coincident_count=0;	
-
 		//receive spike_times from all channel
-		for(n=0; n<channel_count; n++){
-			MPI_Recv(&spike_times[n][0], spike_count_max,
-					MPI_LONG,channel_mpi_ranks[n],1,
-					MPI_COMM_WORLD, &mpi_receive_statuses[n]);
-			MPI_Get_count(&mpi_receive_statuses[n],MPI_LONG,&spike_counts[n]);
-			notify(DEBUG, "loop=%d, n=%d, spike_count=%d", loop_count, n, spike_counts[n]);
-		}
-
-		//coincident filter
-		time_lower=0;
-		time_middle=time_lower + time_slice_size/2;
-		time_upper=time_middle + time_slice_size/2;
-		time_slice_count=0;
-		int last_spike_indexes[channel_count]; //hold the spike postion last proessed
-		for(n=0; n<channel_count; n++){ //n is the channel index
-			last_spike_indexes[n]=0;
-		}
-		while(time_upper< (long)work_data_length){
-			//get the coincident_count for this time slice:
-			//for each channel, determine if there is any spike within the time slice
-			coincident_count=0;
-			for(n=0; n<channel_count; n++){ //n is the channel index
-				//determin current spike_indexes for each channel and coincident_count
-				for(i=last_spike_indexes[n];i<spike_counts[n];i++){
-					if ( spike_times[n][i] < time_lower) {
-						//if the spike is not within the time slice, move to next spike
-						continue;
-					}else if (spike_times[n][i] > time_upper) {
-						break;
-					}else {
-						//if the spike is within the time slice, add one coincident_count for this channel
-						//then move to the next channel
-					        notify(DEBUG, "time_slice_count=%d, spike_times[%d][%d]=%ld, time_lower=%ld",
-                                                time_slice_count, n, i, spike_times[n][i], time_lower);
-						coincident_count++;
-						break;
-					}
+		if (waitsome) {
+			//point to point, decoding the messages in arrival order
+			for(n=0; n<channel_count; n++)
+				MPI_Irecv(&messages[n*WP_TIMES_SIZE(spike_count_max)], WP_TIMES_SIZE(spike_count_max),
+						MPI_BYTE,channel_mpi_ranks[n],1,
+						MPI_COMM_WORLD, &requests[n]);
+			int n_left = channel_count;
+			while (n_left > 0) {
+				int n_done;
+				MPI_Waitsome(channel_count, requests, &n_done, indices, mpi_receive_statuses);
+				for(i=0; i<n_done; i++){
+					n = indices[i];
+					MPI_Get_count(&mpi_receive_statuses[i],MPI_BYTE,&message_sizes[n]);
+					decode_spikes(n, &messages[n*WP_TIMES_SIZE(spike_count_max)], message_sizes[n],
+						&headers[n], &spike_counts[n], spike_times[n], spike_time);
 				}
-				last_spike_indexes[n] = i;
-			}  	
-				
-			if(coincident_count>=coincident_count_threshold){
-				//this slice is "good" mark all the spikes in the slice (set spike_time=-1)
-#if 1
-				//mark spikes that is within the time slice  
-				for(n=0; n<channel_count; n++){ //n is the channel index
-					for(i=last_spike_indexes[n];i<spike_counts[n];i++){ //start from the last spike position
-						if (spike_times[n][i] < time_lower) {
-							//this never happens 
-							continue;
-						}else if (spike_times[n][i] > time_upper) {
-							break;
-						}else { //spike is inside the time slice
-							//mark spike
-							spike_times[n][i]=-1;
-							continue;
-						}
-					}
-					//remember the last spike position
-					last_spike_indexes[n]=i;
-				}	
-#endif
-
+				n_left -= n_done;
 			}
+		} else {
+			//collective, the sizes first
+			MPI_Gather(NULL, 0, MPI_INT, message_sizes, 1, MPI_INT, MPI_ROOT, trigger_comm);
+			for(n=0; n<channel_count; n++)
+				displacements[n] = (n == 0) ? 0 : displacements[n-1]+message_sizes[n-1];
+			MPI_Gatherv(NULL, 0, MPI_BYTE, messages, message_sizes, displacements, MPI_BYTE, MPI_ROOT, trigger_comm);
+			for(n=0; n<channel_count; n++)
+				decode_spikes(n, &messages[displacements[n]], message_sizes[n],
+					&headers[n], &spike_counts[n], spike_times[n], spike_time);
+		}
+		for(n=0; n<channel_count; n++)
+			notify(DEBUG, "loop=%d, n=%d, seq=%d, spike_count=%d", loop_count, n, headers[n].seq, spike_counts[n]);
 
-			//stepping 1/2 of the slice to ensure proper coverage
-			time_lower=time_middle;
-			time_middle=time_upper + time_slice_size/2;
-			time_upper=time_middle+time_slice_size/2;
-			time_slice_count++;
-		}//end coincident filter
+		//coincident filter
+		if (coincidence_filter(channel_count, spike_counts, spike_times, coincident_count_threshold) < 0)
+			break;
 
-		//send filtered spike_time to node,
+		//send the selected spikes to node, as a bitmap
 		for(n=0; n<channel_count; n++){ //n is the channel index
-			MPI_Send(&spike_times[n][0],spike_counts[n],MPI_LONG,channel_mpi_ranks[n],1,MPI_COMM_WORLD);
+			for(i=0; i<spike_counts[n]; i++)
+				spike_decision[i] = (spike_times[n][i] == (unsigned long)-1);
+			displacements[n] = (n == 0) ? 0 : displacements[n-1]+message_sizes[n-1];
+			message_sizes[n] = wp_encode_decisions(&headers[n], spike_decision, &messages[displacements[n]]);
 		} 
+		if (waitsome) {
+			for(n=0; n<channel_count; n++)
+				MPI_Isend(&messages[displacements[n]],message_sizes[n],MPI_BYTE,channel_mpi_ranks[n],1,MPI_COMM_WORLD,&requests[n]);
+			MPI_Waitall(channel_count, requests, MPI_STATUSES_IGNORE);
+		} else {
+			MPI_Scatter(message_sizes, 1, MPI_INT, NULL, 0, MPI_INT, MPI_ROOT, trigger_comm);
+			MPI_Scatterv(messages, message_sizes, displacements, MPI_BYTE, NULL, 0, MPI_BYTE, MPI_ROOT, trigger_comm);
+		}
 
 		loop_count++;
-		MPI_Barrier(MPI_COMM_WORLD);
 		
 	}
+	free(messages);
 	}//end server process
 	
 	/////////////////////////////////////////////////
@@ -258,11 +261,24 @@ int main(int argsc, char **argsv)
 		int i, j, k, m, n=0;
 		MPI_Status mpi_status;
 
+		//allocate the working sets on huge pages, locked and local to this node.
+		//In zero copy mode the DMA buffer is scanned in place.
+		if (!zerocopy)
+			work_data = wm_alloc(work_data_length, WM_DEFAULT);
+		spike_data      = wm_alloc(spike_count_max*spike_data_length, WM_DEFAULT);
+		spike_data_save = wm_alloc(spike_count_max*spike_data_length, WM_DEFAULT);
+		if (((work_data == NULL) && !zerocopy) || (spike_data == NULL) || (spike_data_save == NULL)) {
+			notify(ERROR, "Could not allocate the work buffers.");
+			return -1;
+		}
+
 		// Initialise the DAQ. 
-                *(notifier_host()) = "u183";
+                if (*(notifier_host()) == NULL)
+                    *(notifier_host()) = "u183";
 
 		if (daq_start() < 0)
 		    return -1;
+		notifier_event(NOTIFIER_STARTED, "run=%d antenna=%d", irun, ihost);
 
 		// get data from DMA buffer
 		notify(INFO, "Fetching data from DAQ ...");	
@@ -272,19 +288,29 @@ int main(int argsc, char **argsv)
 			break;
 
                         // Get the time at loop start.
-                        struct timeval tstart, tcopy, tsend, trecv, tstop;
+                        struct timeval tstart;
                         gettimeofday(&tstart, NULL);
+                        uint64_t t_loop = stats_clock();
+                        uint64_t t_lap  = t_loop;
 			
-			// Get work_data from DMA buffer, so that we dont worry about read the same region of DMA again, or data be overwriten by DMA
-			ret = daq_copy_data(work_data, work_data_length);
+			// Get work_data from DMA buffer, so that we dont worry about read the same region of DMA again, or data be overwriten by DMA.
+			// In zero copy mode the DMA buffer is scanned in place and only the spike windows are copied out.
+			unsigned char* data = work_data;
+			if (zerocopy) {
+				data = daq_map_data(work_data_length);
+				ret  = (data == NULL) ? -1 : 0;
+			}
+			else
+				ret = daq_copy_data(work_data, work_data_length);
                         irq_count     = daq_irq();
                         buffer_offset = daq_offset();
 
                         // Get the time after data copy.
-                        gettimeofday(&tcopy, NULL);
+                        double dtc = 1.0e-9*stats_lap(STATS_COPY, &t_lap);
  
 			if (0>ret){
 				notify(ERROR, "Failed to get data from DAQ.");
+				notifier_event(NOTIFIER_DMA_STALL, "irq=%d", irq_count);
 				break;
 			}
 
@@ -292,14 +318,19 @@ int main(int argsc, char **argsv)
 			if(irq_count>last_irq_count){
 				if(irq_count-last_irq_count>1){
 					notify(WARNING, "Buffer number (irq_count=%d) is out of sequence.", irq_count);
+					if (last_irq_count>0) {
+						stats_count(STATS_LOST, irq_count-last_irq_count-1);
+						notifier_event(NOTIFIER_BUFFER_LOST, "irq=%d lost=%d", irq_count, irq_count-last_irq_count-1);
+					}
 				}
+				stats_count(STATS_BUFFERS, 1);
 				last_irq_count=irq_count;
 			}
 
 			//get DataSampleStdev at the beginning of every work_data, use large sample
 			i=0;
 			for(i=0;i<DataSampleLargeLength;i++){
-				*(pDataSampleLarge+i)=(Ipp32f)work_data[i];
+				*(pDataSampleLarge+i)=(Ipp32f)data[i];
 			}
 			ippsStdDev_32f(pDataSampleLarge,DataSampleLargeLength,&DataSampleStdev,ippAlgHintFast);
 
@@ -309,7 +340,7 @@ int main(int argsc, char **argsv)
 				//read sample_data (ipp32f) from work_data
 				i=0;
 				for(i=0;i<spike_data_length;i++){
-					*(pDataSample+i)=(Ipp32f)work_data[i+m*spike_data_length];
+					*(pDataSample+i)=(Ipp32f)data[i+m*spike_data_length];
 				}
 
 
@@ -324,17 +355,18 @@ int main(int argsc, char **argsv)
 
 					if(spike_count>=spike_count_max) {
 						notify(WARNING, "spike_count exceeded spike_count_max.");
+						notifier_event(NOTIFIER_RATE_ALARM, "irq=%d spikes=%d", irq_count, spike_count);
 						break;
 					}
 					
 					//get spike_data from work_data
 					if(m==0){
-						memcpy(&spike_data[spike_count*spike_data_length], &work_data[0], spike_data_length*sizeof(unsigned char));
+						memcpy(&spike_data[spike_count*spike_data_length], &data[0], spike_data_length*sizeof(unsigned char));
 					}else if(m==(long)work_data_length/spike_data_length-1){
-						memcpy(&spike_data[spike_count*spike_data_length], &work_data[(m-1)*spike_data_length], spike_data_length*sizeof(unsigned char));
+						memcpy(&spike_data[spike_count*spike_data_length], &data[(m-1)*spike_data_length], spike_data_length*sizeof(unsigned char));
 					}else{
 						//center the spike 
-						memcpy(&spike_data[spike_count*spike_data_length], &work_data[m*spike_data_length + DataSampleMaxIndex - spike_data_length/2 ], spike_data_length*sizeof(unsigned char));
+						memcpy(&spike_data[spike_count*spike_data_length], &data[m*spike_data_length + DataSampleMaxIndex - spike_data_length/2 ], spike_data_length*sizeof(unsigned char));
 					}
 					
 					//save spike_time for the server
@@ -351,21 +383,52 @@ int main(int argsc, char **argsv)
 				}//end spike test
 			}//end work_data
 
+			//in zero copy mode the spike windows are only valid if the DMA did not come back to this buffer meanwhile,
+			//i.e. if the irq counter did not move past the irq the block was mapped under
+			int overrun = 0;
+			if (zerocopy && (daq_counter() > irq_count)) {
+				notify(WARNING, "DMA buffer overwritten during zero copy scan (irq_count=%d), dropping spikes.", irq_count);
+				notifier_event(NOTIFIER_BUFFER_LOST, "irq=%d overwritten=1", irq_count);
+				overrun = 1;
+			}
+
                         // Time before sending spike times.
-                        gettimeofday(&tsend, NULL);
+                        double dta = 1.0e-9*stats_lap(STATS_SEARCH, &t_lap);
 
 			//send spike_positions to server	
-			MPI_Send(&spike_time[0],spike_count,MPI_LONG,server_mpi_rank,1,MPI_COMM_WORLD);
+			wp_header_t header = {loop_count, irq_count, myMPIRank, spike_count};
+			int message_size = wp_encode_times(&header, spike_time, message);
+			if (waitsome)
+				MPI_Send(message,message_size,MPI_BYTE,server_mpi_rank,1,MPI_COMM_WORLD);
+			else {
+				MPI_Gather(&message_size, 1, MPI_INT, NULL, 0, MPI_INT, 0, trigger_comm);
+				MPI_Gatherv(message, message_size, MPI_BYTE, NULL, NULL, NULL, MPI_BYTE, 0, trigger_comm);
+			}
+			double dtd = 1.0e-9*stats_lap(STATS_SEND, &t_lap);
 
 			//recv server filtering result 
-			MPI_Recv(&spike_time[0], spike_count,MPI_LONG,server_mpi_rank,1,MPI_COMM_WORLD, &mpi_status);	
+			wp_header_t reply;
+			if (waitsome) {
+				MPI_Recv(message, WP_DECISIONS_SIZE(spike_count_max),MPI_BYTE,server_mpi_rank,1,MPI_COMM_WORLD, &mpi_status);	
+				MPI_Get_count(&mpi_status,MPI_BYTE,&message_size);
+			} else {
+				MPI_Scatter(NULL, 0, MPI_INT, &message_size, 1, MPI_INT, 0, trigger_comm);
+				MPI_Scatterv(NULL, NULL, NULL, MPI_BYTE, message, message_size, MPI_BYTE, 0, trigger_comm);
+			}
+			if ((wp_decode_decisions(message, message_size, &reply, spike_decision, spike_count_max) < 0) ||
+			    (reply.seq != header.seq) || (reply.count != spike_count)) {
+				notify(WARNING, "Unexpected decision from the server (loop=%d), dropping spikes.", loop_count);
+				overrun = 1;
+			}
 			
                         // Time after receiving master decision.
-                        gettimeofday(&trecv, NULL);
+                        dtd += 1.0e-9*stats_lap(STATS_DECISION, &t_lap);
+			if (overrun)
+				stats_count(STATS_INVALID, 1);
 
                         int j=0; //count saved spikes
-			for(i=0;i<spike_count;i++){ 
-				if (spike_time[i] ==-1) {
+			for(i=0;(i<spike_count)&&(overrun==0);i++){ 
+				if (spike_decision[i]) {
 					//copy spikes to save to file 
 					memcpy(&spike_data_save[j*spike_data_length], &spike_data[i*spike_data_length], spike_data_length*sizeof(unsigned char));
 					memcpy(&spike_info_save[j*4],&spike_info[i*4],4*sizeof(int));
@@ -378,7 +441,7 @@ int main(int argsc, char **argsv)
 
                         //clear buffer for debugging purpose
                         memset(spike_data,0,spike_count_max*spike_data_length*sizeof(unsigned char));
-                        memset(spike_time,0,spike_count_max*4*sizeof(int));
+                        memset(spike_time,0,sizeof(spike_time));
 
 			//do statistics
                         total_spike    += spike_count;
@@ -396,11 +459,7 @@ int main(int argsc, char **argsv)
                         );
 
                         // Get this iteration duration.
-                        gettimeofday(&tstop, NULL);
-                        double dtc = (tcopy.tv_sec-tstart.tv_sec)+1.0e-6*(tcopy.tv_usec-tstart.tv_usec);
-                        double dta = (tsend.tv_sec-tcopy.tv_sec)+1.0e-6*(tsend.tv_usec-tcopy.tv_usec);
-                        double dtd = (trecv.tv_sec-tsend.tv_sec)+1.0e-6*(trecv.tv_usec-tsend.tv_usec);
-                        double dtw = (tstop.tv_sec-trecv.tv_sec)+1.0e-6*(tstop.tv_usec-trecv.tv_usec);
+                        double dtw = 1.0e-9*stats_lap(STATS_WRITE, &t_lap);
                         double t0 = tstart.tv_sec+1.0e-6*tstart.tv_usec;
 
 			//log
@@ -409,15 +468,27 @@ int main(int argsc, char **argsv)
                             "%.3lf %.3lf %.3lf %.3lf %.3lf %d %d %d %d %3.1f",
                             t0, dtc, dta, dtd, dtw, loop_count, irq_count, spike_count, recorded_spike_count, DataSampleStdev
                         );
+                        stats_count(STATS_LOOPS, 1);
+                        stats_count(STATS_SPIKES, spike_count);
+                        stats_count(STATS_SAVES, recorded_spike_count);
+                        stats_lap(STATS_LOOP, &t_loop);
 
 			loop_count++;
-			MPI_Barrier(MPI_COMM_WORLD);
 		}
 	
 		//close apex card
 		daq_close();
+		dw_close();
+		stats_close();
+		wm_free(work_data);
+		wm_free(spike_data);
+		wm_free(spike_data_save);
+		notifier_event(NOTIFIER_STOPPED, "run=%d loops=%d", irun, loop_count);
+		notifier_close();
 		
 	}//end aquisition process
+	MPI_Comm_free(&trigger_comm);
+	MPI_Comm_free(&local_comm);
 	MPI_Finalize();
 	return 0;
 }
@@ -431,9 +502,170 @@ static void sig_int(int signo)
 }
 
 
+//================================================================
+static void decode_spikes(int n, unsigned char* message, int message_size, wp_header_t* header,
+int* spike_count, unsigned long spike_times[spike_count_max], int* buffer)
+//================================================================
+//
+//  Decode the spike message of channel n, using buffer for the
+//  int times. A malformed message gives no spikes.
+//
+//================================================================
+{
+	memset(header,0,sizeof(wp_header_t));
+	if (wp_decode_times(message, message_size, header, buffer, spike_count_max) < 0) {
+		notify(WARNING, "Malformed spike message from channel %d (%d bytes).", n, message_size);
+		header->count = 0;
+	}
+	*spike_count = header->count;
+	for(int i=0; i<header->count; i++)
+		spike_times[i] = buffer[i];
+}
+
+
+//================================================================
+static int coincidence_filter(int channel_count, int spike_counts[], 
+unsigned long spike_times[][spike_count_max], int threshold)
+//================================================================
+//
+//  Slide a time window over the work data and, whenever enough
+//  channels have a spike in it, mark these spikes by setting their
+//  time to -1. Marked spikes do not count for the following
+//  slices. The first slice is [0, time_slice_size], the following
+//  ones are 1.5 time_slice_size wide and start every
+//  time_slice_size from time_slice_size/2.
+//
+//  The spikes of all channels, time ordered per channel, are merged
+//  and only the slices holding spikes are visited, the per channel
+//  counts of the window being updated as it slides. The cost hence
+//  scales with the number of spikes rather than with the buffer
+//  length times the number of channels.
+//
+//================================================================
+{
+	static long* key[2] = {NULL, NULL};
+	static int   n_key = 0;
+	const long size = time_slice_size;
+	const long half = time_slice_size/2;
+
+	if (channel_count > MAX_CHANNEL_COUNT) {
+		notify(ERROR, "Too many channels (%d).", channel_count);
+		return -1;
+	}
+
+	int n_spike = 0;
+	for (int n = 0; n < channel_count; n++)
+		n_spike += spike_counts[n];
+	if (n_spike > n_key) {
+		for (int k = 0; k < 2; k++) {
+			long* p = realloc(key[k], n_spike*sizeof(long));
+			if (p == NULL) {
+				notify(ERROR, "Couldn't allocate memory for %d spikes.", n_spike);
+				return -1;
+			}
+			key[k] = p;
+		}
+		n_key = n_spike;
+	}
+
+	#define KEY_TIME(k)    ((k) >> 21)
+	#define KEY_CHANNEL(k) (((k) >> 14) & 0x7f)
+	#define KEY_INDEX(k)   ((k) & 0x3fff)
+
+
+	// Merge the channels pairwise. Keys hold the time, the channel and the index.
+	int start[MAX_CHANNEL_COUNT+1];
+	int n_run = 0;
+	int k = 0;
+	long* in  = key[0];
+	long* out = key[1];
+	for (int n = 0; n < channel_count; n++) {
+		start[n_run++] = k;
+		for (int i = 0; i < spike_counts[n]; i++)
+			in[k++] = ((long)spike_times[n][i] << 21) | (n << 14) | i;
+	}
+	start[n_run] = k;
+
+	while (n_run > 1) {
+		int m = 0;
+		for (int r = 0; r < n_run; r += 2) {
+			int i = start[r], ie = start[r+1];
+			int j = ie, je = (r+2 <= n_run) ? start[r+2] : ie;
+			int o = i;
+			start[m++] = i;
+			while ((i < ie) && (j < je)) {
+				int c = in[j] < in[i];
+				out[o++] = c ? in[j] : in[i];
+				i += 1-c;
+				j += c;
+			}
+			while (i < ie)
+				out[o++] = in[i++];
+			while (j < je)
+				out[o++] = in[j++];
+		}
+		start[m] = n_spike;
+		n_run = m;
+
+		long* swap = in;
+		in  = out;
+		out = swap;
+	}
+
+
+	// Sweep the slices holding spikes. The window is [a, b[ in the merged list
+	// and counts[n] the number of unmarked spikes of channel n in it.
+	int counts[MAX_CHANNEL_COUNT];
+	memset(counts, 0x0, sizeof(counts));
+	int n_channel = 0;
+	int a = 0, b = 0;
+	long slice = 0;
+	while (a < n_spike) {
+		// Jump to the first slice covering the next spike.
+		long t = KEY_TIME(in[a]);
+		long first = (t <= size) ? 0 : (t - size - 1)/size;
+		if (first > slice)
+			slice = first;
+		long lower = (slice == 0) ? 0 : half + (slice-1)*size;
+		long upper = (slice == 0) ? size : lower + size + half;
+		if (upper >= (long)work_data_length)
+			break;
+
+		// Slide the window.
+		for (; (b < n_spike) && (KEY_TIME(in[b]) <= upper); b++) {
+			int n = KEY_CHANNEL(in[b]);
+			if ((spike_times[n][KEY_INDEX(in[b])] != (unsigned long)-1) && (counts[n]++ == 0))
+				n_channel++;
+		}
+		for (; (a < b) && (KEY_TIME(in[a]) < lower); a++) {
+			int n = KEY_CHANNEL(in[a]);
+			if ((spike_times[n][KEY_INDEX(in[a])] != (unsigned long)-1) && (--counts[n] == 0))
+				n_channel--;
+		}
+
+		// Mark the spikes of a coincident slice.
+		if ((n_channel > 0) && (n_channel >= threshold)) {
+			for (int j = a; j < b; j++) {
+				int n = KEY_CHANNEL(in[j]);
+				spike_times[n][KEY_INDEX(in[j])] = -1;
+				counts[n] = 0;
+			}
+			n_channel = 0;
+		}
+		slice++;
+	}
+
+	#undef KEY_TIME
+	#undef KEY_CHANNEL
+	#undef KEY_INDEX
+
+	return 0;
+}
+
+
 //================================================================
 int parse_inputs(int argsc, char** argsv, float* threshold, 
-char** runid, int* multiplicity)
+char** runid, int* multiplicity, int* zerocopy, int* waitsome)
 //================================================================
 //
 //  Parse the inputs arguments.
@@ -456,14 +688,17 @@ char** runid, int* multiplicity)
             {"threshold",     required_argument, 0, 't'},
             {"runid",         required_argument, 0, 'r'},
             {"multiplicity",  required_argument, 0, 'm'},
+            {"zerocopy",      no_argument,       0, 'z'},
+            {"waitsome",      no_argument,       0, 'w'},
             DAQ_LONG_OPTIONS,
 	    DW_LONG_OPTIONS,
-	    LOGGER_LONG_OPTIONS
+	    LOGGER_LONG_OPTIONS,
+	    NOTIFIER_LONG_OPTIONS
         };
 
         int option_index = 0;
         c = getopt_long(argsc, argsv, 
-	    "ht:r:m:" DAQ_GETOPT_DESCRIPTOR DW_GETOPT_DESCRIPTOR LOGGER_GETOPT_DESCRIPTOR,
+	    "ht:r:m:zw" DAQ_GETOPT_DESCRIPTOR DW_GETOPT_DESCRIPTOR LOGGER_GETOPT_DESCRIPTOR NOTIFIER_GETOPT_DESCRIPTOR,
 	    long_options, &option_index
 	);
 
@@ -480,8 +715,17 @@ char** runid, int* multiplicity)
             *runid = optarg;
         else if (c == 'm')
             *multiplicity = strtod(optarg, NULL);
+        else if (c == 'z')
+            *zerocopy = 1;
+        else if (c == 'w')
+            *waitsome = 1;
         else
+        {
            daq_parse_option(c, optarg);
+           dw_parse_option(c, optarg);
+           logger_parse_option(c, optarg);
+           notifier_parse_option(c, optarg);
+        }
     }
 
     // Check if mandatory arguments where provided.
@@ -503,13 +747,17 @@ void print_usage(char* proccess)
 //================================================================
 {
     printf(
-        "Usage: %s --threshold=[int] --runid=[int] --multiplicity=[int] %s %s %s\n"
+        "Usage: %s --threshold=[int] --runid=[int] --multiplicity=[int] (--zerocopy) (--waitsome) %s %s %s %s\n"
         "* threshold:       the trigger threshold as multiple of standard deviation.\n"
         "* runid:           the runnumber for the data file name.\n"
-        "* multiplicity:    the minimum number of coincident events required for recording.\n",
-        proccess, daq_usage_text(), dw_usage_text(), logger_usage_text()
+        "* multiplicity:    the minimum number of coincident events required for recording.\n"
+        "* zerocopy:        scan the DMA buffer in place, copying out only the spike windows.\n"
+        "* waitsome:        exchange with the server by point to point messages, processed in\n"
+        "                   arrival order, instead of collectives.\n",
+        proccess, daq_usage_text(), dw_usage_text(), logger_usage_text(), notifier_usage_text()
     );
     printf(daq_help_text());
     printf(dw_help_text());
     printf(logger_help_text());
+    printf(notifier_help_text());
 }
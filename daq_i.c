@@ -1,21 +1,28 @@
 #include <getopt.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include "daq_i.h"
 #include "apex_tools.h"
 #include "simdaq.h"
+#include "apexsim.h"
+#include "synthdaq.h"
 #include "logger.h"
 
 struct {
     int type;
     int mode;
     char* simopts;
+    char* synthopts;
+    int antenna;
 }
 daq_ctl = {
     DEFAULT_DAQ_TYPE,
     DEFAULT_DAQ_MODE,
-    "/data/simdaq"
+    "/data/simdaq",
+    "",
+    -1
 };
  
 
@@ -66,6 +73,10 @@ int daq_join()
         return joinApex(&apex_ctl.fd);
    else if (daq_ctl.type == Sim)
         return simdaq_init(daq_ctl.simopts);
+   else if (daq_ctl.type == ApexSim)
+        return apexsim_init(daq_ctl.simopts);
+   else if (daq_ctl.type == Synth)
+        return synthdaq_init(daq_ctl.simopts, daq_ctl.synthopts, daq_ctl.antenna);
    else
         return -1; 
 }
@@ -77,6 +88,10 @@ int daq_init()
         return initApex(&apex_ctl.fd);
     else if (daq_ctl.type == Sim)
         return simdaq_init(daq_ctl.simopts);
+    else if (daq_ctl.type == ApexSim)
+        return apexsim_init(daq_ctl.simopts);
+    else if (daq_ctl.type == Synth)
+        return synthdaq_init(daq_ctl.simopts, daq_ctl.synthopts, daq_ctl.antenna);
     else
         return -1;
 }
@@ -88,6 +103,8 @@ int daq_synchronise()
         return synchroniseWithApex(&apex_ctl.fd);
     else if (daq_ctl.type == Sim)
         return simdaq_synchronise();
+    else if ((daq_ctl.type == ApexSim) || (daq_ctl.type == Synth))
+        return apexsim_synchronise();
     else
         return -1;
 }
@@ -99,6 +116,8 @@ int daq_counter()
         return getApexIRQ(&apex_ctl.fd);
     else if (daq_ctl.type == Sim)
         return simdaq_counter();
+    else if ((daq_ctl.type == ApexSim) || (daq_ctl.type == Synth))
+        return apexsim_counter();
     else
         return -1;
 }
@@ -110,6 +129,8 @@ unsigned char* daq_data()
         return iddleApexBuffer();
     else if (daq_ctl.type == Sim)
         return simdaq_data();
+    else if ((daq_ctl.type == ApexSim) || (daq_ctl.type == Synth))
+        return apexsim_data();
     else
         return NULL;
 }
@@ -121,11 +142,26 @@ int daq_copy_data(unsigned char* data, int length)
         return getApexRawData(data, length, &apex_ctl.irq, &apex_ctl.offset, &apex_ctl.fd);
     else if (daq_ctl.type == Sim)
         return simdaq_copy_data(data, length);
+    else if ((daq_ctl.type == ApexSim) || (daq_ctl.type == Synth))
+        return apexsim_copy_data(data, length);
     else
         return -1;
 }
 
 
+unsigned char* daq_map_data(int length)
+{
+    if (daq_ctl.type == Apex)
+        return mapApexRawData(length, &apex_ctl.irq, &apex_ctl.offset, &apex_ctl.fd);
+    else if (daq_ctl.type == Sim)
+        return simdaq_map_data(length);
+    else if ((daq_ctl.type == ApexSim) || (daq_ctl.type == Synth))
+        return apexsim_map_data(length);
+    else
+        return NULL;
+}
+
+
 int daq_close()
 {
     if (daq_ctl.type == Apex)
@@ -140,6 +176,10 @@ int daq_close()
     }
     else if (daq_ctl.type == Sim)
         return simdaq_close();
+    else if (daq_ctl.type == ApexSim)
+        return apexsim_close();
+    else if (daq_ctl.type == Synth)
+        return synthdaq_close();
     else
         return -1;
 }
@@ -151,6 +191,8 @@ int daq_irq()
         return apex_ctl.irq;
     else if (daq_ctl.type == Sim)
         return simdaq_irq();
+    else if ((daq_ctl.type == ApexSim) || (daq_ctl.type == Synth))
+        return apexsim_irq();
     else
         return 0;
 }
@@ -162,6 +204,8 @@ int daq_offset()
         return apex_ctl.offset;
     else if (daq_ctl.type == Sim)
         return simdaq_offset();
+    else if ((daq_ctl.type == ApexSim) || (daq_ctl.type == Synth))
+        return apexsim_offset();
     else
         return 0;
 }
@@ -185,12 +229,20 @@ char** daq_simopts()
 }
 
 
+int* daq_antenna()
+{
+    return(&daq_ctl.antenna);
+}
+
+
 int daq_buffer_size()
 {
     if (daq_ctl.type == Apex)
         return DMA_SIZE;
     else if (daq_ctl.type == Sim)
         return SIMDAQ_SIZE;
+    else if ((daq_ctl.type == ApexSim) || (daq_ctl.type == Synth))
+        return APEXSIM_SIZE;
     else
         return 0;
 }
@@ -218,6 +270,10 @@ int daq_parse_option(char c, char* optarg)
                 daq_ctl.type = Apex;
             else if (strcmp(optarg, "Sim") == 0)
                 daq_ctl.type = Sim;
+            else if (strcmp(optarg, "ApexSim") == 0)
+                daq_ctl.type = ApexSim;
+            else if (strcmp(optarg, "Synth") == 0)
+                daq_ctl.type = Synth;
             else
                 notify(ERROR, "Unknown daq type %s", optarg);
         }
@@ -227,6 +283,17 @@ int daq_parse_option(char c, char* optarg)
         if (strlen(optarg) > 0)
            daq_ctl.simopts = optarg;
     }
+    else if (c == 'R')
+    {
+        *apexsim_rate() = atof(optarg);
+    }
+    else if (c == 'G')
+    {
+        if (strlen(optarg) > 0)
+           daq_ctl.synthopts = optarg;
+    }
+    else if (c == 'W')
+        *apexsim_polled() = 1;
 
     return 0;
 }
@@ -234,8 +301,16 @@ int daq_parse_option(char c, char* optarg)
 
 char daqhelp[] = 
     "* daqmode:         'Master' or 'Slave' mode for the daq.\n"
-    "* daqtype:         'Apex' or 'Sim' for running in harware or emulated mode.\n"
-    "* simopts:         the folder from where to take simulated data.\n";
+    "* daqtype:         'Apex', 'Sim', 'ApexSim' or 'Synth' for running in harware,\n"
+    "                   emulated, emulated DMA or synthetic data mode.\n"
+    "* simopts:         the folder from where to take simulated data, or where to write\n"
+    "                   the truth of synthetic data.\n"
+    "* simrate:         sample rate of the emulated DMA, in samples/s (0: unthrottled).\n"
+    "* synthopts:       comma separated key=value parameters of the synthetic data:\n"
+    "                   baseline, sigma, rate (pulses/s), amin, amax, width (samples),\n"
+    "                   showers (plane waves/s), rfi (Hz), rfiamp and seed.\n"
+    "* simpoll:         wait for the emulated DMA by polling its irq counter, as for the\n"
+    "                   Apex card, instead of being woken up.\n";
 
 char* daq_help_text()
 {
@@ -243,7 +318,7 @@ char* daq_help_text()
 }
 
 
-char daqusage[] = "(--daqmode=[char*]) (--daqtype=[char*]) (--simopts=[char*])";
+char daqusage[] = "(--daqmode=[char*]) (--daqtype=[char*]) (--simopts=[char*]) (--simrate=[double]) (--synthopts=[char*]) (--simpoll)";
 
 char* daq_usage_text()
 {
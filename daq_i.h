@@ -7,11 +7,14 @@
 #define DAQ_LONG_OPTIONS \
     {"daqmode", required_argument, 0, 'M'},\
     {"daqtype", required_argument, 0, 'D'},\
-    {"simopts", required_argument, 0, 'O'}
+    {"simopts", required_argument, 0, 'O'},\
+    {"simrate", required_argument, 0, 'R'},\
+    {"synthopts", required_argument, 0, 'G'},\
+    {"simpoll", no_argument, 0, 'W'}
 
-#define DAQ_GETOPT_DESCRIPTOR "M:D:O:" 
+#define DAQ_GETOPT_DESCRIPTOR "M:D:O:R:G:W" 
 
-enum DaqType {Apex, Sim};
+enum DaqType {Apex, Sim, ApexSim, Synth};
 enum DaqMode {Master, Slave};
 
 int daq_start();
@@ -21,6 +24,7 @@ int daq_synchronise();
 int daq_counter();
 unsigned char* daq_data();
 int daq_copy_data(unsigned char* data, int length);
+unsigned char* daq_map_data(int length);
 int daq_close();
 
 int daq_irq();
@@ -29,6 +33,7 @@ int daq_offset();
 int* daq_type();
 int* daq_mode();
 char** daq_simopts();
+int* daq_antenna();
 
 int daq_parse_option(char c, char* optarg);
 char* daq_help_text();
@@ -1,33 +1,133 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include "data_writer.h"
+#include "event_format.h"
+#include "event_codec.h"
 #include "logger.h"
 
 
-#define DW_COMMAND_OFFSET 6
+#define DW_RING_SLOTS   64
+#define DW_SLOT_SIZE    (256*1024)
+#define DW_MAX_FILE     8
+#define DW_MAX_IOV      16
+#define DW_DIRECT_ALIGN 4096
+#define DW_STAGE_SIZE   (1024*1024)
 
 
 struct {
     char* location;
     char  run[8];
     char  host[8];
-    char  command[256];
+    char  fullname[256];
+    int   dirfd;
+    int   async;
+    float sync_period;
+    int   direct;
+    int   compress;
 } dw_ctl = {
     "/data/current",
     "R000000",
     "A0000",
-    "rm -f "
+    "",
+    -1,
+    0,
+    0.0,
+    0,
+    0
 };
 
 
+// Open files, keyed by filetag.
+typedef struct {
+    char           tag[32];
+    int            fd;
+    unsigned char* stage;
+    int            n_stage;
+    dw_stats_t     stats;
+} dw_file_t;
+
+struct {
+    pthread_mutex_t mutex;
+    int             n_file;
+    dw_file_t       file[DW_MAX_FILE];
+} dw_files = {
+    PTHREAD_MUTEX_INITIALIZER,
+    0
+};
+
+
+// Chunk of data waiting in the ring.
+typedef struct {
+    int            file;
+    int            n;
+    unsigned char* data;
+} dw_slot_t;
+
+
+// Ring of preallocated buffers consumed by the I/O thread.
+struct {
+    int             running;
+    int             stop;
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    pthread_cond_t  drained;
+    long            head;
+    long            tail;
+    int             busy;
+    unsigned char*  memory;
+    dw_slot_t       slot[DW_RING_SLOTS];
+} dw_ring = {
+    0
+};
+
+
+// Event file being written, see dw_event_open.
+struct {
+    char           tag[32];
+    evt_header_t   header;
+    int64_t        offset;
+    int            n_chunk;
+    int            max_chunk;
+    evt_index_t*   index;
+    int            max_offset;
+    int64_t*       offsets;
+    unsigned char* record;
+    int            max_record;
+} dw_event = {
+    ""
+};
+
+
+static int dw_start_async();
+
+
 char* dw_fullname(char* filetag)
 {
-    sprintf(dw_ctl.command+DW_COMMAND_OFFSET, "%s/%s/%s_%s_%s",
+    return dw_fullname_r(filetag, dw_ctl.fullname, sizeof(dw_ctl.fullname));
+}
+
+
+// Reentrant version of dw_fullname, for the I/O thread.
+char* dw_fullname_r(char* filetag, char* name, int n)
+{
+    snprintf(name, n, "%s/%s/%s_%s_%s",
     dw_ctl.location, dw_ctl.run, dw_ctl.run, dw_ctl.host, filetag);
 
-    return(dw_ctl.command+DW_COMMAND_OFFSET);
+    return(name);
 }
 
 
@@ -37,6 +137,36 @@ char** dw_location()
 }
 
 
+int* dw_compress()
+{
+    return &dw_ctl.compress;
+}
+
+
+static int dw_mkdirs(char* path)
+{
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", path);
+
+    for (char* p = buffer+1; ; p++)
+    {
+        if ((*p != '/') && (*p != '\0'))
+            continue;
+
+        char c = *p;
+        *p = '\0';
+        if ((mkdir(buffer, 0755) < 0) && (errno != EEXIST))
+            return(-1);
+        *p = c;
+
+        if (c == '\0')
+            break;
+    }
+
+    return(0);
+}
+
+
 int dw_initialise(int runid, int host)
 {
     // Set tags.
@@ -44,44 +174,191 @@ int dw_initialise(int runid, int host)
     sprintf(dw_ctl.host, "A%04d", host);
 
 
-    // Make run directory.
-    char buffer[256];
-    sprintf(buffer, "mkdir -p %s/%s", dw_ctl.location,  dw_ctl.run);
-    system(buffer);
+    // Make run directory and keep a handle on it.
+    if (dw_mkdirs(dw_ctl.location) < 0)
+    {
+        notify(ERROR, "Couldn't create directory %s [%s]", dw_ctl.location, strerror(errno));
+        return(-1);
+    }
+
+    int locfd = open(dw_ctl.location, O_RDONLY | O_DIRECTORY);
+    if (locfd < 0)
+    {
+        notify(ERROR, "Couldn't open directory %s [%s]", dw_ctl.location, strerror(errno));
+        return(-1);
+    }
+
+    if ((mkdirat(locfd, dw_ctl.run, 0755) < 0) && (errno != EEXIST))
+    {
+        notify(ERROR, "Couldn't create directory %s/%s [%s]", dw_ctl.location, dw_ctl.run, strerror(errno));
+        close(locfd);
+        return(-1);
+    }
+
+    if (dw_ctl.dirfd >= 0)
+        close(dw_ctl.dirfd);
+    dw_ctl.dirfd = openat(locfd, dw_ctl.run, O_RDONLY | O_DIRECTORY);
+    close(locfd);
+    if (dw_ctl.dirfd < 0)
+    {
+        notify(ERROR, "Couldn't open directory %s/%s [%s]", dw_ctl.location, dw_ctl.run, strerror(errno));
+        return(-1);
+    }
+
+
+    // Start the I/O thread if requested.
+    if (dw_ctl.async && !dw_ring.running && (dw_start_async() < 0))
+    {
+        notify(WARNING, "Couldn't start the asynchronous writer, using synchronous I/Os.");
+        dw_ctl.async = 0;
+    }
 
     return(0);
 }
 
 
-int dw_clear(char* filetag)
+static char* dw_basename(char* name, int n, char* filetag)
 {
-    dw_fullname(filetag); 
-    system(dw_ctl.command);
+    snprintf(name, n, "%s_%s_%s", dw_ctl.run, dw_ctl.host, filetag);
 
-    return(0);
+    return name;
 }
 
 
-int dw_log(char* filetag, char* line, ...)
+static int dw_open_file(dw_file_t* file, int truncate)
 {
-    char* file = dw_fullname(filetag);
+    char name[64], path[256];
+    dw_basename(name, sizeof(name), file->tag);
+
+    int flags = O_WRONLY | O_CREAT;
+    if (truncate)
+        flags |= O_TRUNC;
+
+    file->fd = -1;
+    if (dw_ring.running && dw_ctl.direct)
+    {
+        file->fd = openat(dw_ctl.dirfd, name, flags | O_DIRECT, 0644);
+        if (file->fd < 0)
+            notify(WARNING, "O_DIRECT not supported for %s.", dw_fullname_r(file->tag, path, sizeof(path)));
+        else if ((posix_memalign((void**)&file->stage, DW_DIRECT_ALIGN, DW_STAGE_SIZE) != 0) ||
+                 (lseek(file->fd, 0, SEEK_END) % DW_DIRECT_ALIGN != 0))
+        {
+            free(file->stage);
+            file->stage = NULL;
+            close(file->fd);
+            file->fd = -1;
+        }
+    }
+    if (file->fd < 0)
+        file->fd = openat(dw_ctl.dirfd, name, flags | O_APPEND, 0644);
 
-    FILE* fid = fopen(file, "ab+");
-    if (fid == NULL)
+    if (file->fd < 0)
     {
-        notify(ERROR, "Couldn't open file %s", file);
+        notify(ERROR, "Couldn't open file %s [%s]", dw_fullname_r(file->tag, path, sizeof(path)), strerror(errno));
         return(-1);
     }
+    file->n_stage = 0;
+
+    return(0);
+}
+
+
+static void dw_close_file(dw_file_t* file);
+
+
+static dw_file_t* dw_get_file(char* filetag, int truncate)
+{
+    pthread_mutex_lock(&dw_files.mutex);
+
+    int i;
+    for (i = 0; i < dw_files.n_file; i++)
+        if (strcmp(dw_files.file[i].tag, filetag) == 0)
+            break;
+
+    dw_file_t* file = &dw_files.file[i];
+    if (i == dw_files.n_file)
+    {
+        if (i == DW_MAX_FILE)
+        {
+            pthread_mutex_unlock(&dw_files.mutex);
+            notify(ERROR, "Too many open data files (%s).", filetag);
+            return NULL;
+        }
+        memset(file, 0x0, sizeof(dw_file_t));
+        snprintf(file->tag, sizeof(file->tag), "%s", filetag);
+        file->fd = -1;
+        dw_files.n_file++;
+    }
+    else if (truncate)
+        dw_close_file(file);
+
+    if ((file->fd < 0) && (dw_open_file(file, truncate) < 0))
+        file = NULL;
+
+    pthread_mutex_unlock(&dw_files.mutex);
+
+    return file;
+}
+
+
+static void dw_account(dw_file_t* file, int n, struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double dt = (t1.tv_sec-t0->tv_sec)+1.0e-9*(t1.tv_nsec-t0->tv_nsec);
+
+    pthread_mutex_lock(&dw_files.mutex);
+    file->stats.bytes   += n;
+    file->stats.calls   += 1;
+    file->stats.latency += dt;
+    if (dt > file->stats.max_latency)
+        file->stats.max_latency = dt;
+    pthread_mutex_unlock(&dw_files.mutex);
+}
+
+
+int dw_stats(char* filetag, dw_stats_t* stats)
+{
+    int ret = -1;
+    memset(stats, 0x0, sizeof(dw_stats_t));
+
+    pthread_mutex_lock(&dw_files.mutex);
+    for (int i = 0; i < dw_files.n_file; i++) if (strcmp(dw_files.file[i].tag, filetag) == 0)
+    {
+        *stats = dw_files.file[i].stats;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&dw_files.mutex);
+
+    return(ret);
+}
+
+
+int dw_clear(char* filetag)
+{
+    // Pending data for this file must not land after the truncation.
+    dw_flush();
+
+    if (dw_get_file(filetag, 1) == NULL)
+        return(-1);
+
+    return(0);
+}
+
 
+int dw_log(char* filetag, char* line, ...)
+{
+    char buffer[1024];
     va_list args;
     va_start(args, line);
-    vfprintf(fid, line, args);
+    int n = vsnprintf(buffer, sizeof(buffer)-1, line, args);
     va_end(args);
 
-    fputs("\n", fid);
-    fclose(fid);
+    if (n > (int)sizeof(buffer)-2)
+        n = sizeof(buffer)-2;
+    buffer[n++] = '\n';
 
-    return 0;
+    return dw_raw_dump(filetag, n, buffer);
 }
 
 
@@ -92,22 +369,32 @@ int dw_raw_dump(char* filetag, int n, void* data)
         return(0);
 
 
+    // Hand over to the I/O thread, if any.
+    if (dw_ring.running)
+        return dw_enqueue(filetag, n, data);
+
+
     // Append the data to file.
-    char* file = dw_fullname(filetag);
+    dw_file_t* file = dw_get_file(filetag, 0);
+    if (file == NULL)
+        return(-1);
 
-    FILE* fid = fopen(file, "ab+");
-    if (fid == NULL)
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    int nwt = 0;
+    while (nwt < n)
     {
-        notify(ERROR, "Couldn't open file %s", file);
-        return(-1);
+        ssize_t m = write(file->fd, (char*)data+nwt, n-nwt);
+        if (m <= 0)
+            break;
+        nwt += m;
     }
-
-    int nwt = fwrite(data, sizeof(char), n, fid);
-    fclose(fid);    
+    dw_account(file, nwt, &t0);
 
     if (nwt != n)
     {
-        notify(WARNING, "Incomplete dump to file %s (%d / %d).", file, nwt, n);
+        notify(WARNING, "Incomplete dump to file %s (%d / %d).", dw_fullname(filetag), nwt, n);
         return(-1);
     }
   
@@ -115,6 +402,520 @@ int dw_raw_dump(char* filetag, int n, void* data)
 }
 
 
+//========================================================================================
+//
+//  Asynchronous writer.
+//
+//  The data are copied to a ring of preallocated buffers and written by a background
+//  thread, which coalesces consecutive chunks for the same file into a single writev.
+//  Optionally the files are opened with O_DIRECT, in which case the data go through an
+//  aligned stage and the last partial block is written at close, and fdatasync is called
+//  periodically.
+//
+//========================================================================================
+
+static int dw_write_all(int fd, struct iovec* iov, int n_iov)
+{
+    while (n_iov > 0)
+    {
+        ssize_t n = writev(fd, iov, n_iov);
+        if (n < 0)
+            return(-1);
+
+        while ((n_iov > 0) && (n >= (ssize_t)iov->iov_len))
+        {
+            n -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base+n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return(0);
+}
+
+
+static int dw_write_direct(dw_file_t* file, struct iovec* iov, int n_iov, int last)
+{
+    for (int i = 0; i < n_iov; i++)
+    {
+        unsigned char* p = iov[i].iov_base;
+        int n = iov[i].iov_len;
+        while (n > 0)
+        {
+            int m = DW_STAGE_SIZE-file->n_stage;
+            if (m > n)
+                m = n;
+            memcpy(file->stage+file->n_stage, p, m);
+            file->n_stage += m;
+            p += m;
+            n -= m;
+
+            if (file->n_stage == DW_STAGE_SIZE)
+            {
+                if (write(file->fd, file->stage, DW_STAGE_SIZE) != DW_STAGE_SIZE)
+                    return(-1);
+                file->n_stage = 0;
+            }
+        }
+    }
+
+    if (!last || (file->n_stage == 0))
+        return(0);
+
+
+    // Write the aligned part, then the tail without O_DIRECT.
+    int n_aligned = file->n_stage - (file->n_stage % DW_DIRECT_ALIGN);
+    if ((n_aligned > 0) && (write(file->fd, file->stage, n_aligned) != n_aligned))
+        return(-1);
+
+    int n_tail = file->n_stage-n_aligned;
+    fcntl(file->fd, F_SETFL, fcntl(file->fd, F_GETFL) & ~O_DIRECT);
+    if ((n_tail > 0) && (write(file->fd, file->stage+n_aligned, n_tail) != n_tail))
+        return(-1);
+    file->n_stage = 0;
+
+    return(0);
+}
+
+
+static void dw_sync_files()
+{
+    pthread_mutex_lock(&dw_files.mutex);
+    for (int i = 0; i < dw_files.n_file; i++) if (dw_files.file[i].fd >= 0)
+        fdatasync(dw_files.file[i].fd);
+    pthread_mutex_unlock(&dw_files.mutex);
+}
+
+
+static void dw_close_file(dw_file_t* file)
+{
+    if (file->fd < 0)
+        return;
+
+    char path[256];
+    if ((file->stage != NULL) && (dw_write_direct(file, NULL, 0, 1) < 0))
+        notify(WARNING, "Incomplete dump to file %s.", dw_fullname_r(file->tag, path, sizeof(path)));
+    if (dw_ctl.sync_period > 0.0)
+        fdatasync(file->fd);
+
+    close(file->fd);
+    free(file->stage);
+    file->fd    = -1;
+    file->stage = NULL;
+}
+
+
+static void* dw_writer(void* arg)
+{
+    struct iovec   iov[DW_MAX_IOV];
+    struct timeval tsync, tnow;
+    gettimeofday(&tsync, NULL);
+
+    pthread_mutex_lock(&dw_ring.mutex);
+    while (1)
+    {
+        // Wait for data, waking up periodically for the sync.
+        while ((dw_ring.head == dw_ring.tail) && !dw_ring.stop)
+        {
+            if (dw_ctl.sync_period > 0.0)
+            {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += 1;
+                pthread_cond_timedwait(&dw_ring.not_empty, &dw_ring.mutex, &ts);
+            }
+            else
+                pthread_cond_wait(&dw_ring.not_empty, &dw_ring.mutex);
+
+            if (dw_ctl.sync_period > 0.0)
+                break;
+        }
+        if ((dw_ring.head == dw_ring.tail) && dw_ring.stop)
+            break;
+
+
+        // Coalesce the consecutive chunks for the same file.
+        int n_iov = 0;
+        dw_file_t* file = NULL;
+        while ((dw_ring.tail+n_iov < dw_ring.head) && (n_iov < DW_MAX_IOV))
+        {
+            dw_slot_t* slot = &dw_ring.slot[(dw_ring.tail+n_iov) % DW_RING_SLOTS];
+            if ((file != NULL) && (&dw_files.file[slot->file] != file))
+                break;
+            file = &dw_files.file[slot->file];
+            iov[n_iov].iov_base = slot->data;
+            iov[n_iov].iov_len  = slot->n;
+            n_iov++;
+        }
+        dw_ring.busy = 1;
+        pthread_mutex_unlock(&dw_ring.mutex);
+
+
+        // Write the data.
+        if (n_iov > 0)
+        {
+            struct timespec t0;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+
+            int n = 0;
+            for (int i = 0; i < n_iov; i++)
+                n += iov[i].iov_len;
+
+            int ret;
+            if (file->stage != NULL)
+                ret = dw_write_direct(file, iov, n_iov, 0);
+            else
+                ret = dw_write_all(file->fd, iov, n_iov);
+
+            char path[256];
+            if (ret < 0)
+                notify(WARNING, "Incomplete dump to file %s.", dw_fullname_r(file->tag, path, sizeof(path)));
+            else
+                dw_account(file, n, &t0);
+        }
+
+        gettimeofday(&tnow, NULL);
+        if ((dw_ctl.sync_period > 0.0) &&
+            ((tnow.tv_sec-tsync.tv_sec)+1.0e-6*(tnow.tv_usec-tsync.tv_usec) >= dw_ctl.sync_period))
+        {
+            dw_sync_files();
+            tsync = tnow;
+        }
+
+
+        // Release the slots.
+        pthread_mutex_lock(&dw_ring.mutex);
+        dw_ring.tail += n_iov;
+        dw_ring.busy  = 0;
+        pthread_cond_broadcast(&dw_ring.not_full);
+        if (dw_ring.head == dw_ring.tail)
+            pthread_cond_broadcast(&dw_ring.drained);
+    }
+    pthread_mutex_unlock(&dw_ring.mutex);
+
+    return NULL;
+}
+
+
+static int dw_start_async()
+{
+    dw_ring.memory = malloc((size_t)DW_RING_SLOTS*DW_SLOT_SIZE);
+    if (dw_ring.memory == NULL)
+        return(-1);
+
+    for (int i = 0; i < DW_RING_SLOTS; i++)
+        dw_ring.slot[i].data = dw_ring.memory + (size_t)i*DW_SLOT_SIZE;
+
+    pthread_mutex_init(&dw_ring.mutex, NULL);
+    pthread_cond_init(&dw_ring.not_empty, NULL);
+    pthread_cond_init(&dw_ring.not_full, NULL);
+    pthread_cond_init(&dw_ring.drained, NULL);
+    dw_ring.head   = 0;
+    dw_ring.tail   = 0;
+    dw_ring.stop   = 0;
+
+    if (pthread_create(&dw_ring.thread, NULL, dw_writer, NULL) != 0)
+    {
+        free(dw_ring.memory);
+        return(-1);
+    }
+    dw_ring.running = 1;
+
+    return(0);
+}
+
+
+int dw_enqueue(char* filetag, int n, void* data)
+{
+    if (n <= 0)
+        return(0);
+
+    if (!dw_ring.running)
+        return dw_raw_dump(filetag, n, data);
+
+    dw_file_t* pfile = dw_get_file(filetag, 0);
+    if (pfile == NULL)
+        return(-1);
+    int file = pfile-dw_files.file;
+
+    pthread_mutex_lock(&dw_ring.mutex);
+
+
+    // Copy the data to the ring, waiting for free slots if needed.
+    unsigned char* p = data;
+    while (n > 0)
+    {
+        if (dw_ring.head-dw_ring.tail == DW_RING_SLOTS)
+        {
+            notify(WARNING, "Asynchronous writer ring is full, waiting.");
+            while (dw_ring.head-dw_ring.tail == DW_RING_SLOTS)
+                pthread_cond_wait(&dw_ring.not_full, &dw_ring.mutex);
+        }
+
+        dw_slot_t* slot = &dw_ring.slot[dw_ring.head % DW_RING_SLOTS];
+        slot->file = file;
+        slot->n    = (n > DW_SLOT_SIZE) ? DW_SLOT_SIZE : n;
+        memcpy(slot->data, p, slot->n);
+        p += slot->n;
+        n -= slot->n;
+
+        dw_ring.head++;
+        pthread_cond_signal(&dw_ring.not_empty);
+    }
+
+    pthread_mutex_unlock(&dw_ring.mutex);
+
+    return(0);
+}
+
+
+int dw_flush()
+{
+    if (!dw_ring.running)
+        return(0);
+
+    pthread_mutex_lock(&dw_ring.mutex);
+    while ((dw_ring.head != dw_ring.tail) || dw_ring.busy)
+        pthread_cond_wait(&dw_ring.drained, &dw_ring.mutex);
+    pthread_mutex_unlock(&dw_ring.mutex);
+
+    return(0);
+}
+
+
+int dw_close()
+{
+    // Stop the I/O thread.
+    if (dw_ring.running)
+    {
+        pthread_mutex_lock(&dw_ring.mutex);
+        dw_ring.stop = 1;
+        pthread_cond_signal(&dw_ring.not_empty);
+        pthread_mutex_unlock(&dw_ring.mutex);
+
+        pthread_join(dw_ring.thread, NULL);
+        dw_ring.running = 0;
+        free(dw_ring.memory);
+    }
+
+
+    // Close the files.
+    pthread_mutex_lock(&dw_files.mutex);
+    for (int i = 0; i < dw_files.n_file; i++)
+        dw_close_file(&dw_files.file[i]);
+    dw_files.n_file = 0;
+    pthread_mutex_unlock(&dw_files.mutex);
+
+    if (dw_ctl.dirfd >= 0)
+    {
+        close(dw_ctl.dirfd);
+        dw_ctl.dirfd = -1;
+    }
+
+    return(0);
+}
+
+
+//========================================================================================
+//
+//  Event files.
+//
+//  Self-describing container for the selected events, see event_format.h for the layout
+//  and event_reader.c for reading it back. The records go through dw_raw_dump, hence the
+//  asynchronous writer if enabled. The index is kept in memory and appended at close,
+//  after which the header is completed in place. With --compress the samples of each
+//  record are packed with evt_pack.
+//
+//========================================================================================
+
+int dw_event_open(char* filetag, int antenna, float threshold, int multiplicity, float sample_rate)
+{
+    if (dw_event.tag[0] != '\0')
+    {
+        notify(ERROR, "Event file %s is already open.", dw_fullname(dw_event.tag));
+        return(-1);
+    }
+
+    if (dw_clear(filetag) < 0)
+        return(-1);
+
+
+    // Fill and write the header. The event count and index offset are set at close.
+    evt_header_t* header = &dw_event.header;
+    memset(header, 0x0, sizeof(evt_header_t));
+    memcpy(header->magic, EVT_MAGIC, sizeof(header->magic));
+    header->version      = EVT_VERSION;
+    header->header_size  = sizeof(evt_header_t);
+    header->run          = atoi(dw_ctl.run+1);
+    header->host         = atoi(dw_ctl.host+1);
+    header->antenna      = antenna;
+    header->multiplicity = multiplicity;
+    header->threshold    = threshold;
+    header->sample_rate  = sample_rate;
+    header->sample_size  = DW_EVENT_SAMPLES;
+    header->record_size  = EVT_INFO_SIZE*sizeof(int32_t)+DW_EVENT_SAMPLES;
+    header->chunk_size   = EVT_CHUNK_SIZE;
+    header->flags        = dw_ctl.compress ? EVT_FLAG_PACKED : 0;
+    gethostname(header->hostname, sizeof(header->hostname)-1);
+
+    if (dw_raw_dump(filetag, sizeof(evt_header_t), header) < 0)
+        return(-1);
+
+    snprintf(dw_event.tag, sizeof(dw_event.tag), "%s", filetag);
+    dw_event.offset  = sizeof(evt_header_t);
+    dw_event.n_chunk = 0;
+
+    return(0);
+}
+
+
+static int dw_grow(void** p, int* n_max, int n, int size)
+{
+    if (n <= *n_max)
+        return(0);
+
+    int n_new = (*n_max > 0) ? 2*(*n_max) : 64;
+    if (n_new < n)
+        n_new = n;
+
+    void* q = realloc(*p, (size_t)n_new*size);
+    if (q == NULL)
+        return(-1);
+    *p     = q;
+    *n_max = n_new;
+
+    return(0);
+}
+
+
+int dw_event_write(char* filetag, int n, int* info, unsigned char* data)
+{
+    if (strcmp(filetag, dw_event.tag) != 0)
+    {
+        notify(ERROR, "Event file %s is not open.", dw_fullname(filetag));
+        return(-1);
+    }
+    if (n <= 0)
+        return(0);
+
+    evt_header_t* header = &dw_event.header;
+    int packed = header->flags & EVT_FLAG_PACKED;
+    int n_info = EVT_INFO_SIZE*sizeof(int32_t);
+    int n_record = packed ? n_info+sizeof(int32_t)+EVT_CODEC_BOUND(header->sample_size) :
+                            header->record_size;
+
+    if ((dw_grow((void**)&dw_event.record, &dw_event.max_record, n*n_record, 1) < 0) ||
+        (dw_grow((void**)&dw_event.index, &dw_event.max_chunk,
+                 header->n_event/header->chunk_size+n/header->chunk_size+2, sizeof(evt_index_t)) < 0) ||
+        (packed && (dw_grow((void**)&dw_event.offsets, &dw_event.max_offset,
+                            header->n_event+n, sizeof(int64_t)) < 0)))
+    {
+        notify(ERROR, "Couldn't allocate memory for the records of %s.", dw_fullname(filetag));
+        return(-1);
+    }
+
+
+    // Interleave the time info and the samples, and update the index.
+    int size = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int* t = info+i*EVT_INFO_SIZE;
+        unsigned char* samples = data+i*header->sample_size;
+        unsigned char* record = dw_event.record+size;
+        int64_t offset = dw_event.offset+size;
+
+        memcpy(record, t, n_info);
+        if (packed)
+        {
+            int32_t n_packed = evt_pack(header->sample_size, samples, record+n_info+sizeof(int32_t));
+            memcpy(record+n_info, &n_packed, sizeof(int32_t));
+            size += n_info+sizeof(int32_t)+n_packed;
+            dw_event.offsets[header->n_event] = offset;
+        }
+        else
+        {
+            memcpy(record+n_info, samples, header->sample_size);
+            size += header->record_size;
+        }
+
+        if (header->n_event % header->chunk_size == 0)
+        {
+            evt_index_t* chunk = &dw_event.index[dw_event.n_chunk++];
+            chunk->offset      = offset;
+            chunk->first_event = header->n_event;
+            chunk->n_event     = 0;
+            chunk->sec_first   = t[0];
+            chunk->irq_first   = t[1];
+        }
+        evt_index_t* chunk = &dw_event.index[dw_event.n_chunk-1];
+        chunk->n_event++;
+        chunk->sec_last = t[0];
+        chunk->irq_last = t[1];
+        header->n_event++;
+    }
+    dw_event.offset += size;
+
+    return dw_raw_dump(filetag, size, dw_event.record);
+}
+
+
+int dw_event_close(char* filetag)
+{
+    if (strcmp(filetag, dw_event.tag) != 0)
+        return(0);
+
+    evt_header_t* header = &dw_event.header;
+    int ret = 0;
+
+
+    // Append the index and the trailer.
+    evt_trailer_t trailer;
+    memset(&trailer, 0x0, sizeof(trailer));
+    trailer.index_offset = dw_event.offset;
+    trailer.n_chunk      = dw_event.n_chunk;
+    memcpy(trailer.magic, EVT_INDEX_MAGIC, sizeof(trailer.magic));
+
+    if ((dw_raw_dump(filetag, dw_event.n_chunk*sizeof(evt_index_t), dw_event.index) < 0) ||
+        ((header->flags & EVT_FLAG_PACKED) &&
+         (dw_raw_dump(filetag, header->n_event*sizeof(int64_t), dw_event.offsets) < 0)) ||
+        (dw_raw_dump(filetag, sizeof(trailer), &trailer) < 0))
+        ret = -1;
+
+
+    // Complete the header once all the data are on file, from a separate descriptor
+    // since the cached one may be in append or direct mode.
+    dw_flush();
+    pthread_mutex_lock(&dw_files.mutex);
+    for (int i = 0; i < dw_files.n_file; i++) if (strcmp(dw_files.file[i].tag, filetag) == 0)
+        dw_close_file(&dw_files.file[i]);
+    pthread_mutex_unlock(&dw_files.mutex);
+
+    header->index_offset = dw_event.offset;
+
+    char name[64];
+    int fd = openat(dw_ctl.dirfd, dw_basename(name, sizeof(name), filetag), O_WRONLY);
+    if ((fd < 0) || (pwrite(fd, header, sizeof(evt_header_t), 0) != sizeof(evt_header_t)))
+    {
+        notify(WARNING, "Couldn't complete the header of %s [%s]", dw_fullname(filetag), strerror(errno));
+        ret = -1;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    free(dw_event.index);
+    free(dw_event.offsets);
+    free(dw_event.record);
+    memset(&dw_event, 0x0, sizeof(dw_event));
+
+    return(ret);
+}
+
+
 int dw_parse_option(char c, char* optarg)
 {
     if (c == 'L')
@@ -122,13 +923,25 @@ int dw_parse_option(char c, char* optarg)
         if (strlen(optarg) > 0)
            dw_ctl.location = optarg;
     }
+    else if (c == 'A')
+        dw_ctl.async = 1;
+    else if (c == 'Y')
+        dw_ctl.sync_period = strtod(optarg, NULL);
+    else if (c == 'X')
+        dw_ctl.direct = 1;
+    else if (c == 'K')
+        dw_ctl.compress = 1;
 
     return 0;
 }
 
 
 char dwhelp[] = 
-    "* dataloc:         the location where to store the data.\n";
+    "* dataloc:         the location where to store the data.\n"
+    "* asyncio:         write the data from a background thread.\n"
+    "* syncperiod:      the period of fdatasync calls for asynchronous I/Os, in unit second. Defaults to none.\n"
+    "* odirect:         open the files with O_DIRECT for asynchronous I/Os.\n"
+    "* compress:        pack the samples of event files losslessly.\n";
 
 char* dw_help_text()
 {
@@ -136,7 +949,7 @@ char* dw_help_text()
 }
 
 
-char dwusage[] = "(--dataloc=[char*])";
+char dwusage[] = "(--dataloc=[char*]) (--asyncio) (--syncperiod=[float]) (--odirect) (--compress)";
 
 char* dw_usage_text()
 {
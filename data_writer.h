@@ -4,17 +4,43 @@
 #define dw_dump(filetag, n, data) dw_raw_dump(filetag, (n)*sizeof(*data), data)
 
 #define DW_LONG_OPTIONS \
-    {"dataloc", required_argument, 0,   'L'}
+    {"dataloc",    required_argument, 0,   'L'},\
+    {"asyncio",    no_argument,       0,   'A'},\
+    {"syncperiod", required_argument, 0,   'Y'},\
+    {"odirect",    no_argument,       0,   'X'},\
+    {"compress",   no_argument,       0,   'K'}
+
+#define DW_GETOPT_DESCRIPTOR "L:AY:XK"
+
+// Samples per record in event files.
+#define DW_EVENT_SAMPLES 1024
+
+typedef struct {
+    long   bytes;
+    long   calls;
+    double latency;     // cumulated, in unit second
+    double max_latency;
+} dw_stats_t;
 
-#define DW_GETOPT_DESCRIPTOR "L:"
 
 char* dw_fullname(char* filetag);
+char* dw_fullname_r(char* filetag, char* name, int n);
 char** dw_location();
+int* dw_compress();
 int dw_initialise(int runid, int host);
 int dw_clear(char* filetag);
 int dw_log(char* filetag, char* line, ...);
 int dw_raw_dump(char* filetag, int n, void* data);
 
+int dw_enqueue(char* filetag, int n, void* data);
+int dw_flush();
+int dw_close();
+int dw_stats(char* filetag, dw_stats_t* stats);
+
+int dw_event_open(char* filetag, int antenna, float threshold, int multiplicity, float sample_rate);
+int dw_event_write(char* filetag, int n, int* info, unsigned char* data);
+int dw_event_close(char* filetag);
+
 int dw_parse_option(char c, char* optarg);
 char* dw_help_text();
 char* dw_usage_text();
@@ -0,0 +1,141 @@
+#include <string.h>
+#include "event_codec.h"
+
+//========================================================================================
+//
+//  Lossless packing of the ADC samples of an event record.
+//
+//  The samples are taken relative to their mean, modulo 256, and zigzag encoded so that
+//  the baseline noise maps to small integers. They are then bit-packed by blocks of
+//  EVT_CODEC_BLOCK samples, each block using the width of its largest residual. A spike
+//  only inflates the blocks where it sits.
+//
+//  Packed layout: [base][block widths, 4 bits each][LSB-first bit stream].
+//
+//========================================================================================
+
+static inline unsigned char evt_zigzag(unsigned char s, unsigned char base)
+{
+    signed char r = (signed char)(s-base);
+    return (unsigned char)((r << 1) ^ (r >> 7));
+}
+
+
+static inline unsigned char evt_unzigzag(unsigned char z, unsigned char base)
+{
+    return (unsigned char)(((z >> 1) ^ -(z & 1))+base);
+}
+
+
+static inline int evt_width(unsigned int v)
+{
+    int w = 0;
+    while (v)
+    {
+        v >>= 1;
+        w++;
+    }
+    return w;
+}
+
+
+int evt_pack(int n, unsigned char* samples, unsigned char* packed)
+{
+    // Reference level.
+    unsigned int sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += samples[i];
+    unsigned char base = (n > 0) ? (sum+n/2)/n : 0;
+
+    int n_block = (n+EVT_CODEC_BLOCK-1)/EVT_CODEC_BLOCK;
+    unsigned char* widths = packed+1;
+    unsigned char* out = widths+(n_block+1)/2;
+    packed[0] = base;
+    memset(widths, 0x0, (n_block+1)/2);
+
+
+    // Pack the residuals block by block.
+    unsigned long long acc = 0;
+    int n_acc = 0;
+    for (int b = 0; b < n_block; b++)
+    {
+        int i0 = b*EVT_CODEC_BLOCK;
+        int i1 = (i0+EVT_CODEC_BLOCK < n) ? i0+EVT_CODEC_BLOCK : n;
+
+        unsigned char z[EVT_CODEC_BLOCK];
+        unsigned char any = 0;
+        for (int i = i0; i < i1; i++)
+        {
+            z[i-i0] = evt_zigzag(samples[i], base);
+            any |= z[i-i0];
+        }
+        int w = evt_width(any);
+        widths[b/2] |= w << (4*(b%2));
+
+        if (w == 0)
+            continue;
+        for (int i = 0; i < i1-i0; i++)
+        {
+            acc |= (unsigned long long)z[i] << n_acc;
+            n_acc += w;
+            while (n_acc >= 8)
+            {
+                *out++ = acc & 0xff;
+                acc >>= 8;
+                n_acc -= 8;
+            }
+        }
+    }
+    if (n_acc > 0)
+        *out++ = acc & 0xff;
+
+    return out-packed;
+}
+
+
+int evt_unpack(int n, unsigned char* packed, int n_packed, unsigned char* samples)
+{
+    int n_block = (n+EVT_CODEC_BLOCK-1)/EVT_CODEC_BLOCK;
+    int n_head = 1+(n_block+1)/2;
+    if (n_packed < n_head)
+        return(-1);
+
+    unsigned char base = packed[0];
+    unsigned char* widths = packed+1;
+    unsigned char* in = packed+n_head;
+    unsigned char* end = packed+n_packed;
+
+    unsigned long long acc = 0;
+    int n_acc = 0;
+    for (int b = 0; b < n_block; b++)
+    {
+        int i0 = b*EVT_CODEC_BLOCK;
+        int i1 = (i0+EVT_CODEC_BLOCK < n) ? i0+EVT_CODEC_BLOCK : n;
+        int w = (widths[b/2] >> (4*(b%2))) & 0xf;
+        if (w > 8)
+            return(-1);
+
+        if (w == 0)
+        {
+            memset(samples+i0, base, i1-i0);
+            continue;
+        }
+
+        unsigned int mask = (1u << w)-1;
+        for (int i = i0; i < i1; i++)
+        {
+            while (n_acc < w)
+            {
+                if (in == end)
+                    return(-1);
+                acc |= (unsigned long long)(*in++) << n_acc;
+                n_acc += 8;
+            }
+            samples[i] = evt_unzigzag(acc & mask, base);
+            acc >>= w;
+            n_acc -= w;
+        }
+    }
+
+    return (in == end) ? 0 : -1;
+}
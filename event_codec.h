@@ -0,0 +1,14 @@
+#ifndef EVENT_CODEC_H
+#define EVENT_CODEC_H 1
+
+// Samples sharing the same bit width in a packed record.
+#define EVT_CODEC_BLOCK 64
+
+// Upper bound on the packed size of n samples.
+#define EVT_CODEC_BOUND(n) (1+((n)+2*EVT_CODEC_BLOCK-1)/(2*EVT_CODEC_BLOCK)+(n))
+
+
+int evt_pack(int n, unsigned char* samples, unsigned char* packed);
+int evt_unpack(int n, unsigned char* packed, int n_packed, unsigned char* samples);
+
+#endif
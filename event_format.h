@@ -0,0 +1,75 @@
+#ifndef EVENT_FORMAT_H
+#define EVENT_FORMAT_H 1
+
+#include <stdint.h>
+
+//========================================================================================
+//
+//  Event file layout.
+//
+//  [header][record 0][record 1] ... [record N-1][index entries][trailer]
+//
+//  The header describes the run and the selection. Records have a fixed size: TIME_SIZE
+//  ints (sec, irq, block, sample) followed by the samples, so event i starts at
+//  header_size+i*record_size. Events are grouped in chunks of chunk_size records and the
+//  index, written at close, gives the time range of each chunk. The trailer at the end of
+//  file points back to the index. A file without index (e.g. after a crash) is still
+//  readable, the number of events being inferred from the file size.
+//
+//  With EVT_FLAG_PACKED the samples are compressed with evt_pack and each record is
+//  TIME_SIZE ints, the packed size as an int and the packed samples. The index is then
+//  followed by the offset of every record, and an unclosed file is read by walking the
+//  records.
+//
+//  All fields are little endian.
+//
+//========================================================================================
+
+#define EVT_MAGIC         "TRENDEVT"
+#define EVT_INDEX_MAGIC   "TRENDIDX"
+#define EVT_VERSION       1
+#define EVT_CHUNK_SIZE    256
+#define EVT_INFO_SIZE     4
+
+#define EVT_FLAG_PACKED   0x1
+
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int32_t  run;
+    int32_t  host;
+    int32_t  antenna;
+    int32_t  multiplicity;
+    float    threshold;
+    float    sample_rate;       // in unit Hz
+    int32_t  sample_size;       // samples per event
+    int32_t  record_size;       // bytes per unpacked event record
+    int32_t  chunk_size;        // events per index entry
+    int32_t  flags;
+    int64_t  n_event;           // 0 until the file is closed
+    int64_t  index_offset;      // 0 until the file is closed
+    char     hostname[16];
+    char     reserved[40];
+} evt_header_t;                 // 128 bytes
+
+
+typedef struct {
+    int64_t  offset;            // of the first record
+    int32_t  first_event;
+    int32_t  n_event;
+    int32_t  sec_first;
+    int32_t  irq_first;
+    int32_t  sec_last;
+    int32_t  irq_last;
+} evt_index_t;                  // 32 bytes
+
+
+typedef struct {
+    int64_t  index_offset;
+    int64_t  n_chunk;
+    char     magic[8];
+} evt_trailer_t;                // 24 bytes
+
+#endif
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "event_reader.h"
+#include "event_codec.h"
+
+//========================================================================================
+//
+//  Reader for the event files written by dw_event_*. It does not depend on the rest of
+//  the DAQ, so that it can be linked in offline analysis tools. Errors are reported with
+//  a -1 (or NULL) return value and errno set.
+//
+//========================================================================================
+
+
+static int er_load_index(er_file_t* file, off_t size)
+{
+    evt_trailer_t trailer;
+    if ((size < (off_t)(file->header.header_size+sizeof(trailer))) ||
+        (pread(file->fd, &trailer, sizeof(trailer), size-sizeof(trailer)) != sizeof(trailer)) ||
+        (memcmp(trailer.magic, EVT_INDEX_MAGIC, sizeof(trailer.magic)) != 0))
+        return(-1);
+
+    size_t n = trailer.n_chunk*sizeof(evt_index_t);
+    if ((trailer.n_chunk < 0) || (trailer.index_offset+(off_t)(n+sizeof(trailer)) > size))
+        return(-1);
+
+    file->index = malloc(n+1);
+    if ((file->index == NULL) || (pread(file->fd, file->index, n, trailer.index_offset) != (ssize_t)n))
+    {
+        free(file->index);
+        file->index = NULL;
+        return(-1);
+    }
+    file->n_chunk = trailer.n_chunk;
+
+    file->n_event = 0;
+    if (file->n_chunk > 0)
+    {
+        evt_index_t* last = &file->index[file->n_chunk-1];
+        file->n_event = last->first_event+last->n_event;
+    }
+
+
+    // The record offsets follow for packed files.
+    size_t n_offset = (file->header.flags & EVT_FLAG_PACKED) ? file->n_event*sizeof(int64_t) : 0;
+    if (trailer.index_offset+(off_t)(n+n_offset+sizeof(trailer)) != size)
+        return(-1);
+    if (n_offset == 0)
+        return(0);
+
+    file->offsets = malloc(n_offset);
+    if ((file->offsets == NULL) ||
+        (pread(file->fd, file->offsets, n_offset, trailer.index_offset+n) != (ssize_t)n_offset))
+        return(-1);
+
+    return(0);
+}
+
+
+static int er_scan_records(er_file_t* file, off_t size)
+{
+    // Walk the packed records of a file without index, dropping a truncated last one.
+    int n_head = EVT_INFO_SIZE*sizeof(int32_t)+sizeof(int32_t);
+    int n_max = 0;
+    off_t offset = file->header.header_size;
+    file->n_event = 0;
+    while (offset+n_head <= size)
+    {
+        int32_t n_packed;
+        if (pread(file->fd, &n_packed, sizeof(n_packed), offset+n_head-sizeof(int32_t)) != sizeof(n_packed))
+            return(-1);
+        if ((n_packed < 0) || (n_packed > EVT_CODEC_BOUND(file->header.sample_size)) ||
+            (offset+n_head+n_packed > size))
+            break;
+
+        if (file->n_event == n_max)
+        {
+            n_max = (n_max > 0) ? 2*n_max : 1024;
+            int64_t* p = realloc(file->offsets, n_max*sizeof(int64_t));
+            if (p == NULL)
+                return(-1);
+            file->offsets = p;
+        }
+        file->offsets[file->n_event++] = offset;
+        offset += n_head+n_packed;
+    }
+
+    return(0);
+}
+
+
+er_file_t* er_open(char* path)
+{
+    er_file_t* file = calloc(1, sizeof(er_file_t));
+    if (file == NULL)
+        return NULL;
+
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0)
+    {
+        free(file);
+        return NULL;
+    }
+
+
+    // Check the header.
+    struct stat st;
+    if ((fstat(file->fd, &st) < 0) ||
+        (pread(file->fd, &file->header, sizeof(evt_header_t), 0) != sizeof(evt_header_t)) ||
+        (memcmp(file->header.magic, EVT_MAGIC, sizeof(file->header.magic)) != 0) ||
+        (file->header.version != EVT_VERSION) ||
+        (file->header.header_size < sizeof(evt_header_t)) ||
+        (file->header.record_size != (int)(EVT_INFO_SIZE*sizeof(int32_t))+file->header.sample_size))
+    {
+        close(file->fd);
+        free(file);
+        errno = EINVAL;
+        return NULL;
+    }
+
+
+    // Use the index if the file was closed properly, otherwise count the full records.
+    int packed = file->header.flags & EVT_FLAG_PACKED;
+    if (er_load_index(file, st.st_size) < 0)
+    {
+        free(file->index);
+        free(file->offsets);
+        file->index   = NULL;
+        file->offsets = NULL;
+        file->n_chunk = 0;
+
+        if (!packed)
+            file->n_event = (st.st_size-file->header.header_size)/file->header.record_size;
+        else if (er_scan_records(file, st.st_size) < 0)
+        {
+            er_close(file);
+            return NULL;
+        }
+    }
+
+    if (packed && ((file->packed = malloc(EVT_CODEC_BOUND(file->header.sample_size))) == NULL))
+    {
+        er_close(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+
+long er_count(er_file_t* file)
+{
+    return file->n_event;
+}
+
+
+int er_read(er_file_t* file, long ievent, int* info, unsigned char* data)
+{
+    if ((ievent < 0) || (ievent >= file->n_event))
+    {
+        errno = ERANGE;
+        return(-1);
+    }
+
+    off_t offset = file->header.header_size+(off_t)ievent*file->header.record_size;
+    int n_info = EVT_INFO_SIZE*sizeof(int32_t);
+    if (file->offsets != NULL)
+        offset = file->offsets[ievent];
+
+    if ((info != NULL) && (pread(file->fd, info, n_info, offset) != n_info))
+        return(-1);
+
+    if ((data != NULL) && (file->packed != NULL))
+    {
+        int32_t n_packed;
+        if ((pread(file->fd, &n_packed, sizeof(n_packed), offset+n_info) != sizeof(n_packed)) ||
+            (n_packed < 0) || (n_packed > EVT_CODEC_BOUND(file->header.sample_size)) ||
+            (pread(file->fd, file->packed, n_packed, offset+n_info+sizeof(n_packed)) != n_packed))
+            return(-1);
+
+        if (evt_unpack(file->header.sample_size, file->packed, n_packed, data) < 0)
+        {
+            errno = EILSEQ;
+            return(-1);
+        }
+        return(0);
+    }
+
+    if ((data != NULL) &&
+        (pread(file->fd, data, file->header.sample_size, offset+n_info) != file->header.sample_size))
+        return(-1);
+
+    return(0);
+}
+
+
+static int er_compare(int sec0, int irq0, int sec1, int irq1)
+{
+    if (sec0 != sec1)
+        return (sec0 < sec1) ? -1 : 1;
+    if (irq0 != irq1)
+        return (irq0 < irq1) ? -1 : 1;
+    return 0;
+}
+
+
+long er_find_time(er_file_t* file, int sec, int irq)
+{
+    // Narrow the search to a single chunk with the index.
+    long lo = 0;
+    long hi = file->n_event;
+    if (file->index != NULL)
+    {
+        int a = 0;
+        int b = file->n_chunk;
+        while (a < b)
+        {
+            int m = (a+b)/2;
+            if (er_compare(file->index[m].sec_last, file->index[m].irq_last, sec, irq) < 0)
+                a = m+1;
+            else
+                b = m;
+        }
+        if (a == file->n_chunk)
+            return file->n_event;
+        lo = file->index[a].first_event;
+        hi = lo+file->index[a].n_event;
+    }
+
+
+    // Then bisect on the records.
+    while (lo < hi)
+    {
+        long m = (lo+hi)/2;
+        int info[EVT_INFO_SIZE];
+        if (er_read(file, m, info, NULL) < 0)
+            return(-1);
+
+        if (er_compare(info[0], info[1], sec, irq) < 0)
+            lo = m+1;
+        else
+            hi = m;
+    }
+
+    return lo;
+}
+
+
+int er_close(er_file_t* file)
+{
+    if (file == NULL)
+        return(0);
+
+    close(file->fd);
+    free(file->index);
+    free(file->offsets);
+    free(file->packed);
+    free(file);
+
+    return(0);
+}
@@ -0,0 +1,24 @@
+#ifndef EVENT_READER_H
+#define EVENT_READER_H 1
+
+#include "event_format.h"
+
+
+typedef struct {
+    int           fd;
+    evt_header_t  header;
+    long          n_event;
+    int           n_chunk;
+    evt_index_t*  index;        // NULL for a file which was not closed properly
+    int64_t*      offsets;      // record offsets, for packed files only
+    unsigned char* packed;
+} er_file_t;
+
+
+er_file_t* er_open(char* path);
+long er_count(er_file_t* file);
+int er_read(er_file_t* file, long ievent, int* info, unsigned char* data);
+long er_find_time(er_file_t* file, int sec, int irq);
+int er_close(er_file_t* file);
+
+#endif
@@ -0,0 +1,527 @@
+//======================================================================================
+//
+//  kernel-bench.c
+//
+//======================================================================================
+//
+//  Microbenchmark of the processing kernels: spike search, coincidence search, PSD
+//  accumulation and raw data writing. The input is a buffer of synthetic data from the
+//  Synth DAQ backend, or of recorded data from a file. Each kernel is timed over
+//  several repetitions after a warm up call, and reported as one line of key=value
+//  pairs for regression comparisons.
+//
+//======================================================================================
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <stdio.h>
+
+#include "apexsim.h"
+#include "daq_i.h"
+#include "data_writer.h"
+#include "logger.h"
+#include "psd_engine.h"
+#include "selector.h"
+
+#if(USE_IPPS == 1)
+    #include "ipps.h"
+#endif
+
+
+#define BENCH_MAX_REPEAT 1000
+
+
+//========================================================================================
+//
+//  Subroutines prototypes.
+//
+//========================================================================================
+
+// Parse the input arguments.
+int parse_inputs(int argsc, char** argsv);
+
+// Show help text on usage.
+void print_usage(char* process);
+
+
+//========================================================================================
+//
+//  Settings.
+//
+//========================================================================================
+
+struct {
+    long            size;
+    int             n_repeat;
+    char*           input;
+    int             slice;
+    int             n_antenna;
+    long            write_size;
+    unsigned char*  data;
+} bench_ctl = {
+    64*1024*1024,
+    10,
+    NULL,
+    1024,
+    20,
+    64*1024*1024,
+    NULL
+};
+
+
+// A kernel call, timed by the harness.
+typedef int (*bench_kernel)(void* arg);
+
+
+static double bench_now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+1.0e-09*t.tv_nsec;
+}
+
+
+static int bench_compare(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y)-(x < y);
+}
+
+
+static void bench_run(char* name, bench_kernel kernel, void* arg, long bytes)
+{
+    // Warm up, then time the repetitions. The kernel returns the number of spikes or
+    // coincidences it found.
+    double dt[BENCH_MAX_REPEAT];
+    int n_spike = kernel(arg);
+    if (n_spike < 0)
+    {
+        notify(WARNING, "Kernel %s failed, skipped.", name);
+        return;
+    }
+
+    double mean = 0.0, var = 0.0;
+    for (int i = 0; i < bench_ctl.n_repeat; i++)
+    {
+        double t0 = bench_now();
+        n_spike = kernel(arg);
+        dt[i] = bench_now()-t0;
+        mean += dt[i]/bench_ctl.n_repeat;
+    }
+    for (int i = 0; i < bench_ctl.n_repeat; i++)
+        var += (dt[i]-mean)*(dt[i]-mean)/((bench_ctl.n_repeat > 1) ? bench_ctl.n_repeat-1 : 1);
+    qsort(dt, bench_ctl.n_repeat, sizeof(double), bench_compare);
+    double median = dt[bench_ctl.n_repeat/2];
+
+    printf("kernel=%s bytes=%ld reps=%d median=%.6e min=%.6e mean=%.6e stddev=%.6e "
+        "gbps=%.4f ns_per_sample=%.5f spikes=%d spikes_per_s=%.4e\n",
+        name, bytes, bench_ctl.n_repeat, median, dt[0], mean, sqrt(var),
+        bytes/median*1.0e-09, median/bytes*1.0e+09, n_spike, n_spike/median);
+    fflush(stdout);
+}
+
+
+//========================================================================================
+//
+//  Kernels.
+//
+//========================================================================================
+
+typedef struct {
+    selector_spike_algo algo;
+    int                 parallel;
+} bench_spike_t;
+
+
+static int bench_spikes(void* arg)
+{
+    bench_spike_t* b = arg;
+    int n_time;
+    int time[MAX_SPIKE];
+    if (b->parallel)
+        selector_parallel_find_spikes(b->algo, bench_ctl.size, bench_ctl.data, &n_time, time);
+    else
+        b->algo(bench_ctl.size, bench_ctl.data, &n_time, time);
+
+    return n_time;
+}
+
+
+typedef struct {
+    int (*algo)(int, int[MAX_ANTENNA], int[MAX_ANTENNA][MAX_SPIKE], char[MAX_ANTENNA][MAX_SPIKE]);
+    int  n_time[MAX_ANTENNA];
+    int  time[MAX_ANTENNA][MAX_SPIKE];
+    char decision[MAX_ANTENNA][MAX_SPIKE];
+} bench_coinc_t;
+
+
+static int bench_coincidences(void* arg)
+{
+    bench_coinc_t* b = arg;
+    if (b->algo(bench_ctl.n_antenna, b->n_time, b->time, b->decision) < 0)
+        return(-1);
+
+    int n = 0;
+    for (int ia = 0; ia < bench_ctl.n_antenna; ia++) for (int it = 0; it < b->n_time[ia]; it++)
+        n += b->decision[ia][it];
+
+    return n;
+}
+
+
+static void bench_coinc_input(bench_coinc_t* b)
+{
+    // A full buffer of spikes per antenna at random times, a tenth of which are copies
+    // of the times of the first antenna within a few samples, i.e. coincidences.
+    for (int ia = 0; ia < bench_ctl.n_antenna; ia++)
+    {
+        b->n_time[ia] = MAX_SPIKE;
+        for (int it = 0; it < MAX_SPIKE; it++)
+        {
+            if ((ia > 0) && (it % 10 == 0))
+                b->time[ia][it] = b->time[0][it]+(int)(drand48()*16);
+            else
+                b->time[ia][it] = (int)(drand48()*(bench_ctl.size-SAMPLE_SIZE));
+        }
+        for (int i = 1; i < MAX_SPIKE; i++) for (int j = i; (j > 0) && (b->time[ia][j-1] > b->time[ia][j]); j--)
+        {
+            int t = b->time[ia][j];
+            b->time[ia][j]   = b->time[ia][j-1];
+            b->time[ia][j-1] = t;
+        }
+    }
+}
+
+
+typedef struct {
+    int             n_slice;
+    unsigned char** slice;
+    float*          psd;
+    float           moments[2];
+#if(USE_IPPS == 1)
+    IppsFFTSpec_R_32f* spec;
+    Ipp8u*          buffer;
+    Ipp32f*         fft;
+    Ipp32f*         window;
+#endif
+} bench_psd_t;
+
+
+static int bench_psd_engine(void* arg)
+{
+    bench_psd_t* b = arg;
+    return psd_engine_accumulate(b->n_slice, b->slice, b->psd, b->moments);
+}
+
+
+#if(USE_IPPS == 1)
+static int bench_psd_ipp(void* arg)
+{
+    // The per slice IPP chain of psd.c.
+    bench_psd_t* b = arg;
+    const int n = bench_ctl.slice;
+    for (int i = 0; i < b->n_slice; i++)
+    {
+        float p[2];
+        ippsConvert_8u32f(b->slice[i], b->fft, n);
+        ippsMeanStdDev_32f(b->fft, n, p, p+1, ippAlgHintAccurate);
+        b->moments[0] += p[0];
+        b->moments[1] += p[1]*p[1];
+        ippsMul_32f_I(b->window, b->fft, n);
+        ippsFFTFwd_RToCCS_32f_I(b->fft, b->spec, b->buffer);
+        ippsSqr_32f_I(b->fft, n+2);
+        ippsAdd_32f_I(b->fft, b->psd, n+2);
+    }
+
+    return 0;
+}
+#endif
+
+
+static int bench_write(void* arg)
+{
+    // Records of the size written by online-trigger for a full buffer of spikes.
+    const int record = MAX_SPIKE*SAMPLE_SIZE;
+    for (long n = 0; n < bench_ctl.write_size; n += record)
+    {
+        if (dw_raw_dump("bench.bin", record, bench_ctl.data+(n % (bench_ctl.size-record+1))) < 0)
+            return(-1);
+    }
+    dw_flush();
+    dw_clear("bench.bin");
+
+    return 0;
+}
+
+
+//========================================================================================
+//
+//  Input data.
+//
+//========================================================================================
+
+static int bench_load()
+{
+    bench_ctl.data = malloc(bench_ctl.size);
+    if (bench_ctl.data == NULL)
+    {
+        notify(ERROR, "Could not allocate %ld bytes of input data.", bench_ctl.size);
+        return(-1);
+    }
+
+
+    // Recorded data, repeated if too short.
+    if (bench_ctl.input != NULL)
+    {
+        FILE* fid = fopen(bench_ctl.input, "r");
+        if (fid == NULL)
+        {
+            notify(ERROR, "Couldn't open input file %s", bench_ctl.input);
+            return(-1);
+        }
+        long n = 0;
+        while (n < bench_ctl.size)
+        {
+            long m = fread(bench_ctl.data+n, 1, bench_ctl.size-n, fid);
+            if ((m == 0) && (n == 0))
+            {
+                notify(ERROR, "Empty input file %s", bench_ctl.input);
+                fclose(fid);
+                return(-1);
+            }
+            n += m;
+            if (feof(fid))
+                rewind(fid);
+        }
+        fclose(fid);
+
+        return(0);
+    }
+
+
+    // Synthetic data, from successive buffers of the generator.
+    *daq_type() = Synth;
+    *daq_mode() = Master;
+    *apexsim_rate() = 0.0;
+    if (daq_start() < 0)
+        return(-1);
+    for (long n = 0; n < bench_ctl.size; n += daq_buffer_size())
+    {
+        if (daq_synchronise() < 0)
+        {
+            daq_close();
+            return(-1);
+        }
+        long m = bench_ctl.size-n;
+        if (m > daq_buffer_size())
+            m = daq_buffer_size();
+        memcpy(bench_ctl.data+n, daq_data(), m);
+    }
+    daq_close();
+
+    return(0);
+}
+
+
+//========================================================================================
+int main(int argsc, char *argsv[])
+//========================================================================================
+{
+    if (parse_inputs(argsc, argsv) < 0)
+        exit(0);
+
+    if (bench_load() < 0)
+        return -1;
+    srand48(1);
+
+
+    // Spike search.
+    bench_spike_t spike;
+#if(USE_IPPS == 1)
+    spike = (bench_spike_t){slipps_find_spikes, 0};
+    bench_run("slipps_find_spikes", bench_spikes, &spike, bench_ctl.size);
+#endif
+    spike = (bench_spike_t){selector_find_spikes, 0};
+    bench_run("selector_find_spikes", bench_spikes, &spike, bench_ctl.size);
+    spike = (bench_spike_t){selector_simd_find_spikes, 0};
+    bench_run("selector_simd_find_spikes", bench_spikes, &spike, bench_ctl.size);
+    if (*selector_threads() > 1)
+    {
+        spike = (bench_spike_t){selector_simd_find_spikes, 1};
+        bench_run("selector_parallel_find_spikes", bench_spikes, &spike, bench_ctl.size);
+    }
+
+
+    // Coincidence search, on the first antennas of the detector configuration.
+    static bench_coinc_t coinc;
+    int antenna_id[MAX_ANTENNA];
+    for (int ia = 0; ia < bench_ctl.n_antenna; ia++)
+        antenna_id[ia] = ia;
+    if (selector_initialise(bench_ctl.n_antenna, antenna_id) == 0)
+    {
+        bench_coinc_input(&coinc);
+        long bytes = (long)bench_ctl.n_antenna*MAX_SPIKE*sizeof(int);
+#if(USE_IPPS == 1)
+        coinc.algo = slipps_find_coincidences;
+        bench_run("slipps_find_coincidences", bench_coincidences, &coinc, bytes);
+#endif
+        coinc.algo = selector_find_coincidences;
+        bench_run("selector_find_coincidences", bench_coincidences, &coinc, bytes);
+    }
+    else
+        notify(WARNING, "No detector configuration, coincidence search skipped.");
+
+
+    // PSD accumulation over all the slices of the buffer.
+    bench_psd_t psd;
+    memset(&psd, 0x0, sizeof(psd));
+    psd.n_slice = bench_ctl.size/bench_ctl.slice;
+    psd.slice   = malloc(psd.n_slice*sizeof(unsigned char*));
+    psd.psd     = calloc(bench_ctl.slice+2, sizeof(float));
+    if ((psd.slice != NULL) && (psd.psd != NULL) && (psd_engine_initialise(bench_ctl.slice) == 0))
+    {
+        for (int i = 0; i < psd.n_slice; i++)
+            psd.slice[i] = bench_ctl.data+(long)i*bench_ctl.slice;
+        bench_run("psd_engine_accumulate", bench_psd_engine, &psd, (long)psd.n_slice*bench_ctl.slice);
+        psd_engine_close();
+
+#if(USE_IPPS == 1)
+        int order = (int)(log(bench_ctl.slice)/log(2)+0.05);
+        int size;
+        ippsFFTInitAlloc_R_32f(&psd.spec, order, IPP_FFT_DIV_FWD_BY_N, ippAlgHintAccurate);
+        ippsFFTGetBufSize_R_32f(psd.spec, &size);
+        psd.buffer = ippsMalloc_8u(size);
+        psd.fft    = ippsMalloc_32f(bench_ctl.slice+2);
+        psd.window = ippsMalloc_32f(bench_ctl.slice);
+        ippsSet_32f(1, psd.window, bench_ctl.slice);
+        ippsWinHann_32f_I(psd.window, bench_ctl.slice);
+        bench_run("psd_ipp", bench_psd_ipp, &psd, (long)psd.n_slice*bench_ctl.slice);
+        ippsFree(psd.buffer);
+        ippsFree(psd.fft);
+        ippsFree(psd.window);
+        ippsFFTFree_R_32f(psd.spec);
+#endif
+    }
+    free(psd.slice);
+    free(psd.psd);
+
+
+    // Raw data writing, with the data writer options.
+    if (dw_initialise(0, 0) == 0)
+    {
+        bench_run("dw_raw_dump", bench_write, NULL, bench_ctl.write_size);
+        unlink(dw_fullname("bench.bin"));
+        dw_close();
+    }
+
+    selector_close();
+    free(bench_ctl.data);
+
+    return 0;
+}
+
+
+//================================================================
+int parse_inputs(int argsc, char** argsv)
+//================================================================
+//
+//  Parse the inputs arguments.
+//
+//================================================================
+{
+    char c;
+
+    // Parse the command line.
+    while (1)
+    {
+        static struct option long_options[] =
+        {
+            {"help",          no_argument,       0, 'h'},
+            {"size",          required_argument, 0, 's'},
+            {"repeat",        required_argument, 0, 'n'},
+            {"input",         required_argument, 0, 'i'},
+            {"slice",         required_argument, 0, 'e'},
+            {"antennas",      required_argument, 0, 'a'},
+            {"writesize",     required_argument, 0, 'w'},
+            SELECTOR_LONG_OPTIONS,
+            DAQ_LONG_OPTIONS,
+	    DW_LONG_OPTIONS,
+	    LOGGER_LONG_OPTIONS,
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        c = getopt_long(argsc, argsv,
+	    "hs:n:i:e:a:w:" SELECTOR_GETOPT_DESCRIPTOR DAQ_GETOPT_DESCRIPTOR DW_GETOPT_DESCRIPTOR LOGGER_GETOPT_DESCRIPTOR,
+	    long_options, &option_index
+	);
+
+        if (c == -1)
+            break;
+        else if (c == 'h')
+        {
+            print_usage(argsv[0]);
+            return(-1);
+        }
+        else if (c == 's')
+            bench_ctl.size = atol(optarg);
+        else if (c == 'n')
+            bench_ctl.n_repeat = atoi(optarg);
+        else if (c == 'i')
+            bench_ctl.input = optarg;
+        else if (c == 'e')
+            bench_ctl.slice = atoi(optarg);
+        else if (c == 'a')
+            bench_ctl.n_antenna = atoi(optarg);
+        else if (c == 'w')
+            bench_ctl.write_size = atol(optarg);
+        else
+        {
+           selector_parse_option(c, optarg);
+           daq_parse_option(c, optarg);
+           dw_parse_option(c, optarg);
+           logger_parse_option(c, optarg);
+        }
+    }
+
+    // The spike search works on whole samples and at most a full DMA buffer.
+    bench_ctl.size -= bench_ctl.size % SAMPLE_SIZE;
+    if ((bench_ctl.size < MAX_SPIKE*SAMPLE_SIZE) || (bench_ctl.size > DMA_SIZE) ||
+        (bench_ctl.n_repeat < 1) || (bench_ctl.n_repeat > BENCH_MAX_REPEAT) ||
+        (bench_ctl.n_antenna < 2) || (bench_ctl.n_antenna > MAX_ANTENNA) || (bench_ctl.write_size < 0))
+    {
+        print_usage(argsv[0]);
+        return(-1);
+    }
+    return(0);
+}
+
+
+//================================================================
+void print_usage(char* proccess)
+//================================================================
+//
+//  Show help text on usage.
+//
+//================================================================
+{
+    printf(
+        "Usage: %s (--size=[long]) (--repeat=[int]) (--input=[char*]) (--slice=[int])\n"
+        "    (--antennas=[int]) (--writesize=[long]) %s %s %s %s\n"
+        "* size:            the size of the input buffer, in bytes. Defaults to 64 MB.\n"
+        "* repeat:          the number of timed calls per kernel. Defaults to 10.\n"
+        "* input:           a file of recorded data. Defaults to synthetic data, see synthopts.\n"
+        "* slice:           the slice size of the PSD, in samples. Defaults to 1024.\n"
+        "* antennas:        the number of antennas for the coincidence search. Defaults to 20.\n"
+        "* writesize:       the bytes written per call of the data writer. Defaults to 64 MB.\n",
+        proccess, selector_usage_text(), daq_usage_text(), dw_usage_text(), logger_usage_text()
+    );
+    printf(selector_help_text());
+    printf(daq_help_text());
+    printf(dw_help_text());
+    printf(logger_help_text());
+}
@@ -1,23 +1,88 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "logger.h"
 
+//========================================================================================
+//
+//  The messages are formatted by the caller into a record of a lock free ring, and
+//  printed by a background thread, such that no caller ever waits on the terminal or
+//  on the forwarding of stdout by mpirun. If the ring is full the message is dropped
+//  and counted. The last LOGGER_RESERVE records are kept for errors.
+//
+//  Messages of a same format are printed at most once per LOGGER_REPEAT_PERIOD. The
+//  ones in between are aggregated: the latest is printed at the end of the period with
+//  their count.
+//
+//========================================================================================
+
+#define LOGGER_RING_SIZE     1024       // Power of 2.
+#define LOGGER_MESSAGE_SIZE  232
+#define LOGGER_RESERVE       128        // Records kept for errors.
+#define LOGGER_N_REPEAT      64
+#define LOGGER_REPEAT_PERIOD 1000000000ULL
+#define LOGGER_POLL_PERIOD   5000000L
+
+
+typedef struct {
+    unsigned long sequence;
+    int           priority;
+    char*         format;
+    uint64_t      time;                 // in unit ns, from the logger start
+    char          text[LOGGER_MESSAGE_SIZE];
+} logger_record_t;
+
+
+typedef struct {
+    char*           format;
+    uint64_t        last;
+    int             count;
+    logger_record_t latest;
+} logger_repeat_t;
+
+
 struct {
-    int  verbosity;
-    char hostname[8];
+    int              verbosity;
+    char             hostname[8];
+    int              async;
+    volatile int     running;
+    uint64_t         start;
+    unsigned long    head;
+    unsigned long    tail;
+    unsigned long    dropped;
+    pthread_t        thread;
+    pthread_mutex_t  consumer;
+    logger_record_t  ring[LOGGER_RING_SIZE];
+    logger_repeat_t  repeat[LOGGER_N_REPEAT];
 } logger_ctl = {
     INFO,
-    "0000"
-}; 
+    "0000",
+    0,
+    0,
+    0,
+    0,
+    0,
+    0
+};
+
+static pthread_once_t logger_once = PTHREAD_ONCE_INIT;
 
 
-int notify(int priority, char* msg, ...)
+static uint64_t logger_clock()
 {
-    if (priority < logger_ctl.verbosity)
-        return(0); 
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000ULL+t.tv_nsec;
+}
+
 
+static void logger_print(logger_record_t* record, int count)
+{
     char* strprio[4] = {
         "DEBUG",
         "INFO",
@@ -25,23 +90,224 @@ int notify(int priority, char* msg, ...)
         "ERROR"
     }; 
 
-    // Get hostname if required.
+    printf("[%4s] %10.3f %-8s %s", logger_ctl.hostname, 1.0e-09*record->time, strprio[record->priority],
+        record->text);
+    if (count > 1)
+        printf(" (repeated %d times)", count);
+    printf("\n");
+}
+
+
+static void logger_report(logger_repeat_t* repeat)
+{
+    // Print the latest of the aggregated messages.
+    if (repeat->count == 0)
+        return;
+    logger_print(&repeat->latest, repeat->count);
+    repeat->last  = repeat->latest.time;
+    repeat->count = 0;
+}
+
+
+static void logger_process(logger_record_t* record)
+{
+    logger_repeat_t* repeat = logger_ctl.repeat+((uintptr_t)record->format >> 3) % LOGGER_N_REPEAT;
+
+    if ((repeat->format == record->format) && (record->time-repeat->last < LOGGER_REPEAT_PERIOD))
+    {
+        repeat->count++;
+        memcpy(&repeat->latest, record, sizeof(logger_record_t));
+        return;
+    }
+
+    logger_report(repeat);
+    logger_print(record, 1);
+    repeat->format = record->format;
+    repeat->last   = record->time;
+}
+
+
+static int logger_drain(int final)
+{
+    // Single consumer: the caller holds the consumer lock.
+    int n = 0;
+    while (1)
+    {
+        logger_record_t* record = logger_ctl.ring+(logger_ctl.tail & (LOGGER_RING_SIZE-1));
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != logger_ctl.tail+1)
+            break;
+        logger_process(record);
+        __atomic_store_n(&record->sequence, logger_ctl.tail+LOGGER_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&logger_ctl.tail, logger_ctl.tail+1, __ATOMIC_RELEASE);
+        n++;
+    }
+
+    unsigned long dropped = __atomic_exchange_n(&logger_ctl.dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0)
+    {
+        logger_record_t record = {0, WARNING, NULL, logger_clock()-logger_ctl.start, ""};
+        snprintf(record.text, LOGGER_MESSAGE_SIZE, "%lu messages dropped, the log ring was full.", dropped);
+        logger_print(&record, 1);
+        n++;
+    }
+
+    // Report the aggregated messages at the end of their period, or all at exit.
+    uint64_t now = logger_clock()-logger_ctl.start;
+    for (int i = 0; i < LOGGER_N_REPEAT; i++)
+    {
+        logger_repeat_t* repeat = logger_ctl.repeat+i;
+        if ((repeat->count > 0) && (final || (now-repeat->last >= LOGGER_REPEAT_PERIOD)))
+        {
+            logger_report(repeat);
+            n++;
+        }
+    }
+
+    if (n > 0)
+        fflush(stdout);
+    return n;
+}
+
+
+static void* logger_run(void* arg)
+{
+    struct timespec period = {0, LOGGER_POLL_PERIOD};
+    while (logger_ctl.running)
+    {
+        pthread_mutex_lock(&logger_ctl.consumer);
+        logger_drain(0);
+        pthread_mutex_unlock(&logger_ctl.consumer);
+        nanosleep(&period, NULL);
+    }
+
+    return NULL;
+}
+
+
+static void logger_exit()
+{
+    if (logger_ctl.async)
+    {
+        logger_ctl.running = 0;
+        pthread_join(logger_ctl.thread, NULL);
+        logger_ctl.async = 0;
+    }
+    logger_flush();
+}
+
+
+static void logger_fork_prepare()
+{
+    pthread_mutex_lock(&logger_ctl.consumer);
+    logger_drain(0);
+}
+
+
+static void logger_fork_parent()
+{
+    pthread_mutex_unlock(&logger_ctl.consumer);
+}
+
+
+static void logger_fork_child()
+{
+    // The consumer thread is not duplicated: print from the callers. The aggregated
+    // messages are left to the parent.
+    pthread_mutex_unlock(&logger_ctl.consumer);
+    memset(logger_ctl.repeat, 0x0, sizeof(logger_ctl.repeat));
+    logger_ctl.async   = 0;
+    logger_ctl.running = 0;
+}
+
+
+static void logger_start()
+{
+    logger_ctl.start = logger_clock();
     if (logger_ctl.hostname[0] == '0')
         gethostname(logger_ctl.hostname, sizeof(logger_ctl.hostname));
 
-    // Format message.
-    printf("[%4s] %-8s ", logger_ctl.hostname, strprio[priority]);
+    for (unsigned long i = 0; i < LOGGER_RING_SIZE; i++)
+        logger_ctl.ring[i].sequence = i;
+    pthread_mutex_init(&logger_ctl.consumer, NULL);
+
+    // Without a background thread the messages are printed synchronously.
+    logger_ctl.running = 1;
+    if (pthread_create(&logger_ctl.thread, NULL, logger_run, NULL) == 0)
+        logger_ctl.async = 1;
+    else
+        logger_ctl.running = 0;
+    pthread_atfork(logger_fork_prepare, logger_fork_parent, logger_fork_child);
+    atexit(logger_exit);
+}
+
+
+int logger_notify(int priority, char* msg, ...)
+{
+    if (priority < logger_ctl.verbosity)
+        return(0); 
+    pthread_once(&logger_once, logger_start);
+
+
+    // Reserve a record of the ring, or drop the message if it is full.
+    unsigned long position = __atomic_load_n(&logger_ctl.head, __ATOMIC_RELAXED);
+    unsigned long limit    = (priority >= ERROR) ? LOGGER_RING_SIZE : LOGGER_RING_SIZE-LOGGER_RESERVE;
+    logger_record_t* record;
+    while (1)
+    {
+        if (position-__atomic_load_n(&logger_ctl.tail, __ATOMIC_ACQUIRE) >= limit)
+        {
+            __atomic_add_fetch(&logger_ctl.dropped, 1, __ATOMIC_RELAXED);
+            return(-1);
+        }
+
+        record = logger_ctl.ring+(position & (LOGGER_RING_SIZE-1));
+        long delta = (long)(__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE)-position);
+        if (delta == 0)
+        {
+            if (__atomic_compare_exchange_n(&logger_ctl.head, &position, position+1, 1, __ATOMIC_RELAXED,
+                __ATOMIC_RELAXED))
+                break;
+        }
+        else if (delta < 0)
+        {
+            __atomic_add_fetch(&logger_ctl.dropped, 1, __ATOMIC_RELAXED);
+            return(-1);
+        }
+        else
+            position = __atomic_load_n(&logger_ctl.head, __ATOMIC_RELAXED);
+    }
+
+
+    // Format the message.
+    record->priority = priority;
+    record->format   = msg;
+    record->time     = logger_clock()-logger_ctl.start;
 
     va_list args;
     va_start(args, msg);
-    vprintf(msg, args);
+    vsnprintf(record->text, LOGGER_MESSAGE_SIZE, msg, args);
     va_end(args);
 
-    printf("\n");
+    __atomic_store_n(&record->sequence, position+1, __ATOMIC_RELEASE);
+
+    if (!logger_ctl.async)
+        logger_flush();
 
     return 0;
 }
 
+
+void logger_flush()
+{
+    // Print all the pending messages, e.g. before exiting without atexit handlers.
+    if (logger_ctl.start == 0)
+        return;
+    pthread_mutex_lock(&logger_ctl.consumer);
+    logger_drain(!logger_ctl.async);
+    pthread_mutex_unlock(&logger_ctl.consumer);
+}
+
+
 int logger_parse_option(char c, char* optarg)
 {
     if (c == 'V')
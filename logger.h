@@ -10,7 +10,16 @@
 
 enum LoggerPriority {DEBUG=0, INFO=1, WARNING=2, ERROR=3};
 
-int notify(int priority, char* msg, ...);
+// Lowest priority compiled in, e.g. -DLOGGER_LEVEL=INFO removes the DEBUG calls.
+#ifndef LOGGER_LEVEL
+    #define LOGGER_LEVEL DEBUG
+#endif
+
+#define notify(priority, ...) \
+    do { if ((priority) >= LOGGER_LEVEL) logger_notify((priority), __VA_ARGS__); } while (0)
+
+int logger_notify(int priority, char* msg, ...) __attribute__((format(printf, 2, 3)));
+void logger_flush();
 
 int logger_parse_option(char c, char* optarg);
 char* logger_help_text();
@@ -1,23 +1,74 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
 
 #include "notifier.h"
 #include "logger.h"
 
-#define SERVER_PORT_NUMBER 55000
+//========================================================================================
+//
+//  Notifications are queued and sent by a background thread over a persistent TCP
+//  connection, one line per message. The connection is (re)established by the thread,
+//  with a backoff, such that an unreachable host never blocks the callers. Messages
+//  are dropped when the queue is full, and a same run event is sent at most once per
+//  NOTIFIER_HOLDOFF with the count of the ones held off.
+//
+//========================================================================================
+
+#define NOTIFIER_QUEUE_SIZE      64
+#define NOTIFIER_MESSAGE_SIZE    256
+#define NOTIFIER_CONNECT_TIMEOUT 1000       // ms
+#define NOTIFIER_MIN_BACKOFF     0.5        // s
+#define NOTIFIER_MAX_BACKOFF     30.0
+#define NOTIFIER_HOLDOFF         1.0
+#define NOTIFIER_CLOSE_TIMEOUT   1.0
+
+
+static char* notifier_events[NOTIFIER_N_EVENT] = {"STARTED", "STOPPED", "DMA_STALL", "BUFFER_LOST", "RATE_ALARM"};
 
 
 struct {
     char* host;
+    int   port;
+    char  hostname[8];
 } notifier_ctl = {
-    NULL
+    NULL,
+    NOTIFIER_DEFAULT_PORT,
+    "u000"
+};
+
+
+// Queue of outbound messages, consumed by the sender thread.
+struct {
+    int             running;
+    int             stop;
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  not_empty;
+    long            head;
+    long            tail;
+    long            dropped;
+    double          last[NOTIFIER_N_EVENT];
+    int             held[NOTIFIER_N_EVENT];
+    char            message[NOTIFIER_QUEUE_SIZE][NOTIFIER_MESSAGE_SIZE];
+} notifier_queue = {
+    0,
+    0,
+    0,
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER
 };
 
 
@@ -27,53 +78,323 @@ char** notifier_host()
 }
 
 
+int* notifier_port()
+{
+    return &notifier_ctl.port;
+}
+
+
+static double notifier_clock()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec+1.0e-9*t.tv_nsec;
+}
+
+
+static int notifier_connect()
+{
+    // Resolve the host and connect, with a timeout.
+    struct addrinfo hints, *addresses;
+    memset(&hints, 0x0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    char port[16];
+    snprintf(port, sizeof(port), "%d", notifier_ctl.port);
+    int ret = getaddrinfo(notifier_ctl.host, port, &hints, &addresses);
+    if (ret != 0)
+    {
+        notify(WARNING, "could not retrieve host information about %s [%s]", notifier_ctl.host, gai_strerror(ret));
+        return -1;
+    }
+
+    int sd = -1;
+    for (struct addrinfo* a = addresses; (a != NULL) && (sd < 0); a = a->ai_next)
+    {
+        sd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (sd < 0)
+            continue;
+        fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+
+        if (connect(sd, a->ai_addr, a->ai_addrlen) < 0)
+        {
+            int error = errno;
+            struct pollfd pfd = {sd, POLLOUT, 0};
+            socklen_t n = sizeof(error);
+            if ((error != EINPROGRESS) || (poll(&pfd, 1, NOTIFIER_CONNECT_TIMEOUT) <= 0) ||
+                (getsockopt(sd, SOL_SOCKET, SO_ERROR, &error, &n) < 0) || (error != 0))
+            {
+                notify(WARNING, "could not connect to %s:%d [%s]", notifier_ctl.host, notifier_ctl.port,
+                    strerror((error == EINPROGRESS) ? ETIMEDOUT : error));
+                close(sd);
+                sd = -1;
+            }
+        }
+    }
+    freeaddrinfo(addresses);
+
+    return sd;
+}
+
+
+static int notifier_send(int sd, char* message)
+{
+    int n = strlen(message);
+    while (n > 0)
+    {
+        ssize_t ret = send(sd, message, n, MSG_NOSIGNAL);
+        if (ret > 0)
+        {
+            message += ret;
+            n       -= ret;
+        }
+        else if ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+        {
+            struct pollfd pfd = {sd, POLLOUT, 0};
+            if (poll(&pfd, 1, NOTIFIER_CONNECT_TIMEOUT) <= 0)
+                return -1;
+        }
+        else if ((ret < 0) && (errno == EINTR))
+            continue;
+        else
+            return -1;
+    }
+
+    return 0;
+}
+
+
+static void* notifier_sender(void* arg)
+{
+    int sd = -1;
+    double backoff = NOTIFIER_MIN_BACKOFF;
+    double retry   = 0.0;
+    double stop    = 0.0;
+    char message[NOTIFIER_MESSAGE_SIZE];
+
+    pthread_mutex_lock(&notifier_queue.mutex);
+    while (1)
+    {
+        // Wait for messages, or for the next connection attempt.
+        while ((notifier_queue.head == notifier_queue.tail) && !notifier_queue.stop)
+            pthread_cond_wait(&notifier_queue.not_empty, &notifier_queue.mutex);
+        if (notifier_queue.stop)
+        {
+            if (stop == 0.0)
+                stop = notifier_clock()+NOTIFIER_CLOSE_TIMEOUT;
+            if ((notifier_queue.head == notifier_queue.tail) || (notifier_clock() > stop))
+                break;
+        }
+        memcpy(message, notifier_queue.message[notifier_queue.tail % NOTIFIER_QUEUE_SIZE], NOTIFIER_MESSAGE_SIZE);
+        long dropped = notifier_queue.dropped;
+        notifier_queue.dropped = 0;
+        pthread_mutex_unlock(&notifier_queue.mutex);
+
+        if (dropped > 0)
+            notify(WARNING, "%ld notifications dropped, the queue was full.", dropped);
+
+
+        // Connect if needed, then send the oldest message.
+        double now = notifier_clock();
+        if ((sd < 0) && (now >= retry))
+        {
+            sd = notifier_connect();
+            if (sd < 0)
+            {
+                retry   = now+backoff;
+                backoff = (2.0*backoff < NOTIFIER_MAX_BACKOFF) ? 2.0*backoff : NOTIFIER_MAX_BACKOFF;
+            }
+            else
+                backoff = NOTIFIER_MIN_BACKOFF;
+        }
+
+        int sent    = 0;
+        double wake = 0.0;
+        if (sd >= 0)
+        {
+            if (notifier_send(sd, message) == 0)
+                sent = 1;
+            else
+            {
+                notify(WARNING, "could not send notification [%s]", strerror(errno));
+                close(sd);
+                sd    = -1;
+                retry = notifier_clock();
+            }
+        }
+        else
+            wake = (stop > 0.0) ? ((retry < stop) ? retry : stop) : retry;
+
+        pthread_mutex_lock(&notifier_queue.mutex);
+        if (sent)
+            notifier_queue.tail++;
+
+
+        // Sleep until the next attempt, or the close deadline.
+        now = notifier_clock();
+        if ((wake > now) && !(notifier_queue.stop && (stop == 0.0)))
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            double t = ts.tv_sec+1.0e-9*ts.tv_nsec+(wake-now);
+            ts.tv_sec  = (time_t)t;
+            ts.tv_nsec = (long)(1.0e+09*(t-ts.tv_sec));
+            pthread_cond_timedwait(&notifier_queue.not_empty, &notifier_queue.mutex, &ts);
+        }
+    }
+    pthread_mutex_unlock(&notifier_queue.mutex);
+
+    if (sd >= 0)
+    {
+        shutdown(sd, SHUT_WR);
+        close(sd);
+    }
+
+    return NULL;
+}
+
+
+static int notifier_enqueue(char* message)
+{
+    // Caller holds the queue lock. Start the sender on the first message.
+    if (!notifier_queue.running)
+    {
+        notifier_queue.stop = 0;
+        if (pthread_create(&notifier_queue.thread, NULL, notifier_sender, NULL) != 0)
+        {
+            notify(ERROR, "could not start the notifier thread");
+            return -1;
+        }
+        notifier_queue.running = 1;
+    }
+
+    if (notifier_queue.head-notifier_queue.tail == NOTIFIER_QUEUE_SIZE)
+    {
+        notifier_queue.dropped++;
+        return -1;
+    }
+    strcpy(notifier_queue.message[notifier_queue.head % NOTIFIER_QUEUE_SIZE], message);
+    notifier_queue.head++;
+    pthread_cond_signal(&notifier_queue.not_empty);
+
+    return 0;
+}
+
+
 int send_notification(const char* message, ...)
 {
-   if (notifier_ctl.host == NULL)
-       return 0;
-
-   // Retrieve the address of this host
-   struct hostent *hp = gethostbyname(notifier_ctl.host);
-   if (hp == NULL) {
-      notify(ERROR, "could not retrieve host information about %s [%s]",
-      notifier_ctl.host, strerror(errno));
-      return -1;
-   }
-
-   // Create a socket
-   int sd = socket(AF_INET, SOCK_STREAM, 0);
-   if (sd < 0) {
-      notify(ERROR, "could not create socket [%s]",  strerror(errno));
-      return -1;
-   }
-
-   // Fill the server address and connect to the target host
-   const int portNumber = SERVER_PORT_NUMBER;
-   struct sockaddr_in pin;
-   memset(&pin, 0, sizeof(pin));
-   pin.sin_family = AF_INET;
-   pin.sin_addr.s_addr = ((struct in_addr *)(hp->h_addr))->s_addr;
-   pin.sin_port = htons(portNumber);
-   if (connect(sd, (struct sockaddr *)&pin, sizeof(pin)) < 0) {
-      notify(WARNING, "could not connect to peer [%s]",  strerror(errno));
-      return -1;
-   }
-
-   // Format the message.
-   char buffer[128];
-   va_list args;
-   va_start(args, message);
-   vsprintf(buffer, message, args);
-   va_end(args);
-   
-   // Send the message
-   if (send(sd, buffer, strlen(buffer), 0) == -1) {
-      notify(ERROR, "could not send message [%s]", strerror(errno));
-      return -1;
-   }
-	
-   // Close the socket
-   shutdown(sd, SHUT_WR);
-   close(sd);
-   return 0;
+    if (notifier_ctl.host == NULL)
+        return 0;
+
+    // Format the message as a line.
+    char buffer[NOTIFIER_MESSAGE_SIZE];
+    va_list args;
+    va_start(args, message);
+    int n = vsnprintf(buffer, NOTIFIER_MESSAGE_SIZE-1, message, args);
+    va_end(args);
+    if (n > NOTIFIER_MESSAGE_SIZE-2)
+        n = NOTIFIER_MESSAGE_SIZE-2;
+    strcpy(buffer+n, "\n");
+
+    pthread_mutex_lock(&notifier_queue.mutex);
+    int ret = notifier_enqueue(buffer);
+    pthread_mutex_unlock(&notifier_queue.mutex);
+
+    return ret;
+}
+
+
+int notifier_event(int event, const char* details, ...)
+{
+    if ((notifier_ctl.host == NULL) || (event < 0) || (event >= NOTIFIER_N_EVENT))
+        return 0;
+
+    // Hold off the repeated events.
+    double now = notifier_clock();
+    pthread_mutex_lock(&notifier_queue.mutex);
+    if ((notifier_queue.last[event] > 0.0) && (now-notifier_queue.last[event] < NOTIFIER_HOLDOFF))
+    {
+        notifier_queue.held[event]++;
+        pthread_mutex_unlock(&notifier_queue.mutex);
+        return 0;
+    }
+    int held = notifier_queue.held[event];
+    notifier_queue.last[event] = now;
+    notifier_queue.held[event] = 0;
+    pthread_mutex_unlock(&notifier_queue.mutex);
+
+
+    // Format the message.
+    if (!notifier_queue.running)
+        gethostname(notifier_ctl.hostname, sizeof(notifier_ctl.hostname));
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    char buffer[NOTIFIER_MESSAGE_SIZE];
+    int n = snprintf(buffer, NOTIFIER_MESSAGE_SIZE, "%ld.%03ld %s %s", (long)t.tv_sec, (long)t.tv_usec/1000,
+        notifier_ctl.hostname, notifier_events[event]);
+    if ((details != NULL) && (n < NOTIFIER_MESSAGE_SIZE-1))
+    {
+        buffer[n++] = ' ';
+        va_list args;
+        va_start(args, details);
+        vsnprintf(buffer+n, NOTIFIER_MESSAGE_SIZE-n, details, args);
+        va_end(args);
+    }
+    if (held > 0)
+    {
+        n = strlen(buffer);
+        snprintf(buffer+n, NOTIFIER_MESSAGE_SIZE-n, " held=%d", held);
+    }
+
+    return send_notification("%s", buffer);
+}
+
+
+void notifier_close()
+{
+    // Send the pending messages, within NOTIFIER_CLOSE_TIMEOUT.
+    if (!notifier_queue.running)
+        return;
+
+    pthread_mutex_lock(&notifier_queue.mutex);
+    notifier_queue.stop = 1;
+    pthread_cond_signal(&notifier_queue.not_empty);
+    pthread_mutex_unlock(&notifier_queue.mutex);
+
+    pthread_join(notifier_queue.thread, NULL);
+    notifier_queue.running = 0;
+    notifier_queue.head    = notifier_queue.tail;
+}
+
+
+int notifier_parse_option(char c, char* optarg)
+{
+    if (c == 'N')
+    {
+        if (strlen(optarg) > 0)
+           notifier_ctl.host = optarg;
+    }
+    else if (c == 'Q')
+        notifier_ctl.port = atoi(optarg);
+
+    return 0;
+}
+
+
+char notifierhelp[] = 
+    "* notifyhost:      the host receiving the run notifications. Defaults to the master host.\n"
+    "* notifyport:      the TCP port of the notifications. Defaults to 55000.\n";
+
+char* notifier_help_text()
+{
+    return notifierhelp;
+}
+
+
+char notifierusage[] = "(--notifyhost=[char*]) (--notifyport=[int])";
+
+char* notifier_usage_text()
+{
+    return notifierusage;
 }
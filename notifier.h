@@ -1,7 +1,27 @@
 #ifndef NOTIFIER_H
 #define NOTIFIER_H 1
 
+#define NOTIFIER_LONG_OPTIONS \
+    {"notifyhost", required_argument, 0,   'N'},\
+    {"notifyport", required_argument, 0,   'Q'}
+
+#define NOTIFIER_GETOPT_DESCRIPTOR "N:Q:"
+
+#define NOTIFIER_DEFAULT_PORT 55000
+
+
+// Run events, sent as "<unix time> <host> <EVENT> <details>" lines.
+enum NotifierEvent {NOTIFIER_STARTED, NOTIFIER_STOPPED, NOTIFIER_DMA_STALL, NOTIFIER_BUFFER_LOST,
+    NOTIFIER_RATE_ALARM, NOTIFIER_N_EVENT};
+
 char** notifier_host();
-int send_notification(const char* message, ...);
+int* notifier_port();
+int send_notification(const char* message, ...) __attribute__((format(printf, 1, 2)));
+int notifier_event(int event, const char* details, ...) __attribute__((format(printf, 2, 3)));
+void notifier_close();
+
+int notifier_parse_option(char c, char* optarg);
+char* notifier_help_text();
+char* notifier_usage_text();
 
 #endif
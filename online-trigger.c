@@ -3,6 +3,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <mpi.h>
 #include <math.h>
 #include <string.h>
@@ -14,12 +15,53 @@
 #include "data_writer.h"
 #include "notifier.h"
 #include "selector.h"
+#include "wire_protocol.h"
+#include "stats.h"
+#include "work_memory.h"
 
 
 #define MPI_OK_TAG  1
 
-#define SPIKE_ALGO  slipps_find_spikes
-#define COINC_ALGO  slipps_find_coincidences
+// Default time to wait for late antennas, in unit second.
+#define DEFAULT_DEADLINE 0.5
+
+#if(USE_IPPS == 1)
+    #define SPIKE_ALGO  slipps_find_spikes
+    #define COINC_ALGO  slipps_find_coincidences
+#else
+    #define SPIKE_ALGO  selector_simd_find_spikes
+    #define COINC_ALGO  selector_find_coincidences
+#endif
+
+
+// Coincidence node: the master, or a sub-master in tree mode. Its children are the slaves,
+// or the sub-masters for the master in tree mode. Spike times are stored per antenna, in
+// the node numbering. The master keeps the antenna and index of each hit received from a
+// sub-master, in order to send back its decision.
+struct {
+    int            n_antenna;
+    int            time[MAX_ANTENNA][MAX_SPIKE];
+    int            n_time[MAX_ANTENNA];
+    char           decision[MAX_ANTENNA][MAX_SPIKE];
+    int            owner[MAX_ANTENNA];          // child reporting the antenna
+    int            global[MAX_ANTENNA];         // master index of the antenna, for a sub-master
+    int            id;                          // antenna id of a sub-master host
+
+    int            n_child;
+    int            rank[MAX_ANTENNA];
+    int            antenna[MAX_ANTENNA];        // antenna of a slave, -1 for a sub-master
+    int            size[MAX_ANTENNA];
+    unsigned char* message[MAX_ANTENNA];
+    wp_header_t    header[MAX_ANTENNA];
+    int            valid[MAX_ANTENNA];
+    int            held[MAX_ANTENNA];
+    double         t_held[MAX_ANTENNA];
+    MPI_Request    request[MAX_ANTENNA];
+    int*           hit_antenna[MAX_ANTENNA];
+    int*           hit_index[MAX_ANTENNA];
+} node_ctl = {
+    0
+};
 
 
 //========================================================================================
@@ -33,7 +75,24 @@ static int halt = 0; // stop flag control.
 static void sig_int(int);
 
 // Parse the input arguments.
-int parse_inputs(int argsc, char** argsv, char** runid);
+int parse_inputs(int argsc, char** argsv, char** runid, int* pipeline, double* deadline,
+    int* n_submaster, int* cluster_multiplicity, int* rank_ids);
+
+// Copy the raw data window centered on a spike.
+static void copy_window(unsigned char* window, unsigned char* data, int t);
+
+// Exchange of the master decisions.
+static void send_decision(int rank, wp_header_t* header, char* decision);
+static int read_decision(unsigned char* reply, MPI_Status* status, wp_header_t* header, char* decision);
+
+// Coincidence node of the master and sub-masters.
+static int node_add_child(int rank, int antenna);
+static void node_receive(int c);
+static void node_decode(int c, int n_message);
+static void node_reply(int c, int empty);
+static void node_forward(int parent, int seq, int irq, int n_coinc[MAX_ANTENNA]);
+static void node_run(int parent, double deadline);
+static void node_close();
 
 // Show help text on usage.
 void print_usage(char* process);
@@ -47,7 +106,7 @@ int main(int argsc, char **argsv)
     // Initialise MPI.
     //====================================================================================
     MPI_Init(&argsc, &argsv);
-    MPI_Errhandler_set(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
+    MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
 
     int mpi_rank;
     int mpi_n_process;
@@ -63,8 +122,14 @@ int main(int argsc, char **argsv)
     //====================================================================================
     char* runid       = NULL;
     char* master_host = "u183";
+    int   pipeline    = 0;
+    double deadline   = DEFAULT_DEADLINE;
+    int   n_submaster = 0;
+    int   cluster_multiplicity = 1;
+    int   rank_ids    = 0;
     
-    if (parse_inputs(argsc, argsv, &runid) < 0)
+    if (parse_inputs(argsc, argsv, &runid, &pipeline, &deadline, &n_submaster, &cluster_multiplicity,
+        &rank_ids) < 0)
         exit(0);
     
     
@@ -72,6 +137,13 @@ int main(int argsc, char **argsv)
     char host[8] = "u000";
     gethostname(host, sizeof(host));
 
+
+    // The sub-masters, if any, are the last ranks. With rank ids, e.g. for emulating the
+    // array on a single machine, the master is the first rank and the antenna ID of a
+    // slave is its rank minus one.
+    int is_submaster = (mpi_rank >= mpi_n_process-n_submaster);
+    int is_master    = !is_submaster && (rank_ids ? (mpi_rank == 0) : (strcmp(host, master_host) == 0));
+
     
     // Redirect the SIGINT interupt.
     signal(SIGINT, sig_int);
@@ -80,11 +152,8 @@ int main(int argsc, char **argsv)
     //====================================================================================
     //  Master process.
     //====================================================================================    
-    if(strcmp(host, master_host) == 0)
+    if (is_master)
     {
-        int        time[MAX_ANTENNA][MAX_SPIKE];
-        int        n_time[MAX_ANTENNA];
-        char       decision[MAX_ANTENNA][MAX_SPIKE];
         MPI_Status mpi_status;
 
 
@@ -108,52 +177,158 @@ int main(int argsc, char **argsv)
         }
 
 
-        // Map antenna ID's and initialise the selector.
+        // Map antenna ID's and initialise the selector. The last ranks are the
+        // sub-masters, which send the antenna ID of their host, if any.
         int antenna_id[MAX_ANTENNA];
-        int ip, ia = 0;
+        int rank[MAX_ANTENNA];
+        int submaster_id[MAX_ANTENNA];
+        int submaster_rank[MAX_ANTENNA];
+        int ip, ia = 0, is = 0;
         for(ip = 0; ip < mpi_n_process; ip++) if (ip != mpi_rank)
         {
-            MPI_Recv(&antenna_id[ia], 1, MPI_INT, ip, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_status);
-            ia++;
+            int id;
+            MPI_Recv(&id, 1, MPI_INT, ip, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_status);
+            if (ip >= mpi_n_process-n_submaster)
+            {
+                submaster_id[is]   = id;
+                submaster_rank[is] = ip;
+                is++;
+            }
+            else if (ia < MAX_ANTENNA)
+            {
+                antenna_id[ia] = id;
+                rank[ia]       = ip;
+                ia++;
+            }
+        }
+        int n_antenna = mpi_n_process-1-n_submaster;
+        if (n_antenna > MAX_ANTENNA)
+        {
+            notify(ERROR, "Too many antennas (%d), at most %d are supported.", n_antenna, MAX_ANTENNA);
+            return -1;
         }
-        selector_initialise(mpi_n_process-1, antenna_id);
+        if (selector_initialise(n_antenna, antenna_id) < 0)
+            return -1;
+        node_ctl.n_antenna = n_antenna;
 
 
-        // Master loop.
-        int iloop = 0;
-        while (halt == 0)
-	{
-            // Synchronize with slaves process.
-            MPI_Barrier(MPI_COMM_WORLD);
+        // Flat mode: the slaves report to the master.
+        if (n_submaster == 0)
+        {
+            for (ia = 0; ia < n_antenna; ia++)
+            {
+                MPI_Send(&mpi_rank, 1, MPI_INT, rank[ia], MPI_OK_TAG, MPI_COMM_WORLD);
+                node_ctl.owner[ia] = node_add_child(rank[ia], ia);
+            }
+        }
 
 
-	    // Receive the spike times from all channels.
-            ia = 0;
-            for(ip = 0; ip < mpi_n_process; ip++) if (ip != mpi_rank)
+        // Tree mode: group the antennas around the sub-masters and send them their
+        // cluster as {rank, antenna ID, master index} triplets. The sub-masters then
+        // report to the master and the slaves to their sub-master.
+        else
+        {
+            int seed[MAX_ANTENNA];
+            int cluster[MAX_ANTENNA];
+            for (is = 0; is < n_submaster; is++)
+            {
+                seed[is] = -1;
+                for (ia = 0; ia < n_antenna; ia++) if (antenna_id[ia] == submaster_id[is])
+                    seed[is] = ia;
+            }
+            if (selector_cluster(n_antenna, n_submaster, seed, cluster) < 0)
+                return -1;
+
+            for (is = 0; is < n_submaster; is++)
             {
-	        MPI_Recv(&time[ia][0], MAX_SPIKE, MPI_LONG, ip, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_status);
-                MPI_Get_count(&mpi_status, MPI_INT, &n_time[ia]);
-                ia++;
+                int member[3*MAX_ANTENNA];
+                int n_member = 0;
+                for (ia = 0; ia < n_antenna; ia++) if (cluster[ia] == is)
+                {
+                    member[3*n_member+0] = rank[ia];
+                    member[3*n_member+1] = antenna_id[ia];
+                    member[3*n_member+2] = ia;
+                    n_member++;
+                }
 
-		notify(DEBUG, "loop=%d, process=%d, spikes=%d", iloop, ip, n_time[ia]);
+                MPI_Send(&n_member, 1, MPI_INT, submaster_rank[is], MPI_OK_TAG, MPI_COMM_WORLD);
+                if (n_member == 0)
+                    continue;
+                MPI_Send(member, 3*n_member, MPI_INT, submaster_rank[is], MPI_OK_TAG, MPI_COMM_WORLD);
+
+                int c = node_add_child(submaster_rank[is], -1);
+                for (ia = 0; ia < n_antenna; ia++) if (cluster[ia] == is)
+                    node_ctl.owner[ia] = c;
+                notify(INFO, "Sub-master %d (process %d): %d antennas.", is, submaster_rank[is], n_member);
             }
 
-            
-            // Find candidate spikes.
-            COINC_ALGO(mpi_n_process-1, n_time, time, decision);
+            for (ia = 0; ia < n_antenna; ia++)
+                MPI_Send(&submaster_rank[cluster[ia]], 1, MPI_INT, rank[ia], MPI_OK_TAG, MPI_COMM_WORLD);
+        }
+
+
+        // Run the coincidence search.
+        node_run(-1, deadline);
+        node_close();
+    }
+
 
-	    
-            // Send back the master decision to slaves.
-            ia = 0;
-            for(ip = 0; ip < mpi_n_process; ip++) if (ip != mpi_rank)
+    //====================================================================================
+    //  Sub-master process.
+    //====================================================================================        
+    else if (is_submaster)
+    {
+        int master_rank;
+        MPI_Status mpi_status;
+
+        // Circulate the information on the master.
+        int rank_prev = mpi_rank-1;
+        if (rank_prev == -1)
+            rank_prev = mpi_n_process-1;
+        int rank_next = mpi_rank+1;
+        if (rank_next == mpi_n_process)
+            rank_next = 0;
+
+        MPI_Recv(&master_rank, 1, MPI_INT, rank_prev, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_status);
+        MPI_Send(&master_rank, 1, MPI_INT, rank_next, MPI_OK_TAG, MPI_COMM_WORLD);
+
+        if (master_rank >= mpi_n_process-n_submaster)
+        {
+            notify(ERROR, "The master process (%d) can not be a sub-master.", master_rank);
+            return -1;
+        }
+
+
+        // Send the antenna id of the host, if any, and get the cluster from the master.
+        int hostid = rank_ids ? -1 : atoi(host+1)-ANTENNA_ID_OFFSET;
+        MPI_Send(&hostid, 1, MPI_INT, master_rank, MPI_OK_TAG, MPI_COMM_WORLD);
+
+        int n_member;
+        int member[3*MAX_ANTENNA];
+        MPI_Recv(&n_member, 1, MPI_INT, master_rank, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_status);
+        if (n_member > 0)
+        {
+            MPI_Recv(member, 3*n_member, MPI_INT, master_rank, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_status);
+
+            int antenna_id[MAX_ANTENNA];
+            for (int ia = 0; ia < n_member; ia++)
             {
-	        MPI_Send(&decision[ia][0], n_time[ia], MPI_CHAR, ip, MPI_OK_TAG, MPI_COMM_WORLD);
-                ia++;
+                antenna_id[ia]      = member[3*ia+1];
+                node_ctl.global[ia] = member[3*ia+2];
+                node_ctl.owner[ia]  = node_add_child(member[3*ia], ia);
             }
+            node_ctl.n_antenna = n_member;
+            node_ctl.id        = hostid;
+            *selector_multiplicity() = cluster_multiplicity;
 
-		
-            iloop++;
-	}
+            if (selector_initialise(n_member, antenna_id) < 0)
+                return -1;
+
+
+            // Run the candidate search.
+            node_run(master_rank, deadline);
+            node_close();
+        }
     }
 	
 
@@ -162,14 +337,30 @@ int main(int argsc, char **argsv)
     //====================================================================================        
     else 
     { 
-        int time[MAX_SPIKE];
-        int n_time, master_rank;
-        char decision[MAX_SPIKE];
+        int time[2][MAX_SPIKE];
+        int n_time[2], master_rank, parent_rank;
+        char decision[2][MAX_SPIKE];
         MPI_Status mpi_status;
-        unsigned char d_save[MAX_SPIKE*SAMPLE_SIZE];
+
+        // Encoded spike times and decision replies.
+        unsigned char message[2][WP_TIMES_SIZE(MAX_SPIKE)];
+        unsigned char reply[2][WP_DECISIONS_SIZE(MAX_SPIKE)];
+        wp_header_t header[2];
+        int n_message;
+        unsigned char* d_save;
         int t_save[MAX_SPIKE*TIME_SIZE];
         int n_save;
 
+        // Double buffering for the pipelined mode: while the master decides on one buffer
+        // the spikes of the next one are searched. The candidate windows are snapshot
+        // since the DMA overwrites the buffer before the decision is known.
+        unsigned char* d_window[2];
+        int t_window[2][2] = {{0, 0}, {0, 0}};
+        int valid[2]       = {0, 0};
+        MPI_Request mpi_request[2][2];
+        int pending = 0;
+        int ib      = 0;
+
         // Circulate the information on the master.
         int rank_prev = mpi_rank-1;
         if (rank_prev == -1)
@@ -182,56 +373,76 @@ int main(int argsc, char **argsv)
         MPI_Send(&master_rank, 1, MPI_INT, rank_next, MPI_OK_TAG, MPI_COMM_WORLD);
 
 
+        // Get the antenna ID.
+        int antid = rank_ids ? mpi_rank-1 : atoi(host+1)-ANTENNA_ID_OFFSET;
+        int ihost = antid+ANTENNA_ID_OFFSET;
+
+
+        // Allocate the saved and the snapshot windows on huge pages, locked and local to
+        // this node.
+        d_save = wm_alloc(3*MAX_SPIKE*SAMPLE_SIZE, WM_DEFAULT);
+        if (d_save == NULL)
+            return -1;
+        d_window[0] = d_save+MAX_SPIKE*SAMPLE_SIZE;
+        d_window[1] = d_window[0]+MAX_SPIKE*SAMPLE_SIZE;
+
+
 	// Initialize the DAQ.
-        (*notifier_host()) = master_host;
+        if (*notifier_host() == NULL)
+            (*notifier_host()) = master_host;
+        (*daq_antenna())   = antid;
 	if (daq_start() < 0)
             return -1;
 
 
         // Initialise data & log files.
-        char datafile[] = "data.bin";
-        char timefile[] = "time.bin";
-        char logfile[]  = "log.txt";
+        char eventfile[] = "event.bin";
+        char logfile[]   = "log.txt";
         int irun  = atoi(runid);
-        int ihost = atoi(host+1);
 
         dw_initialise(irun, ihost);
-        dw_clear(datafile);
-        dw_clear(timefile);
+        dw_event_open(eventfile, antid, *selector_threshold(), *selector_multiplicity(), 1.0/CONSTANT_TS);
         dw_clear(logfile);
+        stats_open("online-trigger", ihost);
+        notifier_event(NOTIFIER_STARTED, "run=%d antenna=%d", irun, ihost);
 
 
-        // Send the antenna id to the master.
-        int antid = ihost-ANTENNA_ID_OFFSET;
+        // Send the antenna id to the master, which tells where to send the spikes: to
+        // itself or to a sub-master.
         MPI_Send(&antid, 1, MPI_INT, master_rank, MPI_OK_TAG, MPI_COMM_WORLD);
+        MPI_Recv(&parent_rank, 1, MPI_INT, master_rank, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_status);
 
 
         // Processing loop.
-        int iloop = 0;
+        int iloop    = 0;
+        int last_irq = -1;
         n_save = 0;	
 	while (halt == 0)
 	{
             // Dump the previous data to file, if data integrity was OK.
+            uint64_t t_loop = stats_clock();
+            uint64_t t_lap  = t_loop;
             if (n_save > 0)
             {
-                dw_dump(timefile, 4*n_save, t_save);
-                dw_dump(datafile, SAMPLE_SIZE*n_save, d_save);
+                dw_event_write(eventfile, n_save, t_save, d_save);
+                n_save = 0;
+                stats_lap(STATS_WRITE, &t_lap);
             }
 
 
-            // Synchronize with slaves process.
-            MPI_Barrier(MPI_COMM_WORLD);
-
-
             // Get the time at loop start.
-            struct timeval tstart, tsync, tsend, trecv, tstop;
+            struct timeval tstart;
             gettimeofday(&tstart, NULL);
 
 		
             // Synchronize with a buffer switch.
             if (daq_synchronise() < 0)
+            {
+                notifier_event(NOTIFIER_DMA_STALL, "irq=%d", daq_counter());
                 break;
+            }
             int irq_start = daq_counter();
+            double dtc    = 1.0e-9*stats_lap(STATS_SYNC, &t_lap);
 
 
             // Check for interupt.
@@ -239,85 +450,173 @@ int main(int argsc, char **argsv)
                 break;
 
 
+            // Count the buffers switched since the previous loop.
+            stats_count(STATS_BUFFERS, (last_irq < 0) ? 1 : irq_start-last_irq);
+            if ((last_irq >= 0) && (irq_start-last_irq > 1))
+            {
+                stats_count(STATS_LOST, irq_start-last_irq-1);
+                notifier_event(NOTIFIER_BUFFER_LOST, "irq=%d lost=%d", irq_start, irq_start-last_irq-1);
+            }
+            last_irq = irq_start;
+
+
             // Map the iddle buffer.
             unsigned char* data = daq_data();
 
 
             // Find candidate spikes.
-            gettimeofday(&tsync, NULL);
-            float stddev = SPIKE_ALGO(daq_buffer_size(), data, &n_time, time);
+            float stddev = selector_parallel_find_spikes(SPIKE_ALGO, daq_buffer_size(), data, &n_time[ib], time[ib]);
+            if (n_time[ib] >= MAX_SPIKE)
+                notifier_event(NOTIFIER_RATE_ALARM, "irq=%d spikes=%d sigma=%.1f", irq_start, n_time[ib], stddev);
+            t_window[ib][0] = tstart.tv_sec;
+            t_window[ib][1] = irq_start;
+
+            header[ib].seq     = iloop;
+            header[ib].irq     = irq_start;
+            header[ib].antenna = antid;
+            header[ib].count   = n_time[ib];
+            n_message = wp_encode_times(&header[ib], time[ib], message[ib]);
+
+
+            // Snapshot the candidate windows in pipelined mode.
+            int irq_stop;
+            if (pipeline)
+            {
+                for (int it = 0; it < n_time[ib]; it++)
+                    copy_window(d_window[ib]+it*SAMPLE_SIZE, data, time[ib][it]);
+
+                irq_stop  = daq_counter();
+                valid[ib] = (irq_stop == irq_start);
+            }
 
 
             // Send the candidates spike times to the master.
-            gettimeofday(&tsend, NULL);	
-	    MPI_Send(time, n_time, MPI_INT, master_rank, MPI_OK_TAG, MPI_COMM_WORLD);
+            double dta = 1.0e-9*stats_lap(STATS_SEARCH, &t_lap);
+            double dtd;
+            int jb = ib;
+            if (pipeline)
+            {
+                MPI_Isend(message[ib], n_message, MPI_BYTE, parent_rank, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_request[ib][0]);
+                MPI_Irecv(reply[ib], WP_DECISIONS_SIZE(MAX_SPIKE), MPI_BYTE, parent_rank, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_request[ib][1]);
+                dtd = 1.0e-9*stats_lap(STATS_SEND, &t_lap);
+
+                // Receive the master decision on the previous buffer.
+                jb = 1-ib;
+                if (pending)
+                {
+                    MPI_Status mpi_statuses[2];
+                    MPI_Waitall(2, mpi_request[jb], mpi_statuses);
+                    if (read_decision(reply[jb], &mpi_statuses[1], &header[jb], decision[jb]) < 0)
+                        n_time[jb] = 0;
+                }
+                else
+                {
+                    // Nothing was pending on the first loop.
+                    n_time[jb] = 0;
+                    valid[jb]  = 1;
+                }
+                pending = 1;
+            }
+            else
+            {
+	        MPI_Send(message[ib], n_message, MPI_BYTE, parent_rank, MPI_OK_TAG, MPI_COMM_WORLD);
+                dtd = 1.0e-9*stats_lap(STATS_SEND, &t_lap);
 
 	        
-            // Receive the master decision.
-	    MPI_Recv(decision, n_time, MPI_CHAR, master_rank, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_status);	
-	    gettimeofday(&trecv, NULL);
+                // Receive the master decision.
+	        MPI_Recv(reply[ib], WP_DECISIONS_SIZE(MAX_SPIKE), MPI_BYTE, parent_rank, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_status);	
+                if (read_decision(reply[ib], &mpi_status, &header[ib], decision[ib]) < 0)
+                    n_time[ib] = 0;
+            }
+            dtd += 1.0e-9*stats_lap(STATS_DECISION, &t_lap);
 
             
             // Copy the selected spikes to memory.
             unsigned char* pd = d_save;
             n_save = 0;
-            for (int it = 0; it < n_time; it++)
+            for (int it = 0; it < n_time[jb]; it++)
             {
-                if (decision[it] == 0x1)
+                if (decision[jb][it] == 0x1)
                 {
                     // Append time data.
-                    t_save[n_save*TIME_SIZE+0] = tstart.tv_sec;
-                    t_save[n_save*TIME_SIZE+1] = irq_start;
-                    t_save[n_save*TIME_SIZE+2] = time[it]/1024;
-                    t_save[n_save*TIME_SIZE+3] = time[it]%1024;
+                    t_save[n_save*TIME_SIZE+0] = t_window[jb][0];
+                    t_save[n_save*TIME_SIZE+1] = t_window[jb][1];
+                    t_save[n_save*TIME_SIZE+2] = time[jb][it]/1024;
+                    t_save[n_save*TIME_SIZE+3] = time[jb][it]%1024;
                     n_save++;
 
                     // Copy the centered raw data.
-                    int istart = time[it] - 512;
-                    if (istart < 0)
-                        istart = 0;
-                    else if (istart >=  daq_buffer_size()-1024)
-                        istart = daq_buffer_size()-1025;
-
-                    memcpy(pd, data+istart, SAMPLE_SIZE);
+                    if (pipeline)
+                        memcpy(pd, d_window[jb]+it*SAMPLE_SIZE, SAMPLE_SIZE);
+                    else
+                        copy_window(pd, data, time[jb][it]);
                     pd += SAMPLE_SIZE;
                 }
             }
 
 
             // Check data integrity.
-            int irq_stop = daq_counter();
-            if (irq_stop != irq_start)
+            if (!pipeline)
+            {
+                irq_stop  = daq_counter();
+                valid[jb] = (irq_stop == irq_start);
+            }
+            if (!valid[jb])
+            {
                 n_save = 0;
+                stats_count(STATS_INVALID, 1);
+                notifier_event(NOTIFIER_BUFFER_LOST, "irq=%d overwritten=1", header[jb].irq);
+            }
+            double dtw = 1.0e-9*stats_lap(STATS_COPY, &t_lap);
 
 
-            // Log the loop status.
+            // Log the loop status. The trigger counts refer to the decided buffer, i.e. the
+            // previous one in pipelined mode.
             notify(INFO, "iloop = %d, irq = %d/%d, trigger=%d/%d, sigma=%.1f", 
-            iloop, irq_start, irq_stop, n_save, n_time, stddev);
+            iloop, irq_start, irq_stop, n_save, n_time[jb], stddev);
             
 
             // Write statistics to log file.
-            gettimeofday(&tstop, NULL);
-            double dtc = (tsync.tv_sec-tstart.tv_sec)+1.0e-6*(tsync.tv_usec-tstart.tv_usec);
-            double dta = (tsend.tv_sec-tsync.tv_sec)+1.0e-6*(tsend.tv_usec-tsync.tv_usec);
-            double dtd = (trecv.tv_sec-tsend.tv_sec)+1.0e-6*(trecv.tv_usec-tsend.tv_usec);
-            double dtw = (tstop.tv_sec-trecv.tv_sec)+1.0e-6*(tstop.tv_usec-trecv.tv_usec);
             double t0 = tstart.tv_sec+1.0e-6*tstart.tv_usec;
 
             dw_log(
                 logfile,
                 "%.3lf %.3lf %.3lf %.3lf %.3lf %d %d %d %d %d %.1f",
-                t0, dtc, dta, dtd, dtw, iloop, irq_start, irq_stop, n_time, n_save, stddev
+                t0, dtc, dta, dtd, dtw, iloop, irq_start, irq_stop, n_time[jb], n_save, stddev
             );
+            stats_count(STATS_LOOPS, 1);
+            stats_count(STATS_SPIKES, n_time[ib]);
+            stats_count(STATS_SAVES, n_save);
+            stats_lap(STATS_LOOP, &t_loop);
 
 
             // Increment loop index.
 	    iloop++;
+            if (pipeline)
+                ib = 1-ib;
+        }
+
+
+        // Drop the decision still in flight, if any.
+        if (pending)
+        {
+            int lb = 1-ib;
+            MPI_Cancel(&mpi_request[lb][1]);
+            MPI_Waitall(2, mpi_request[lb], MPI_STATUSES_IGNORE);
         }
 	
 
-        // Close the DAQ.
+        // Close the DAQ, the spike search threads and the data files.
         daq_close();	
+        selector_close();
+        if (n_save > 0)
+            dw_event_write(eventfile, n_save, t_save, d_save);
+        dw_event_close(eventfile);
+        dw_close();
+        stats_close();
+        wm_free(d_save);
+        notifier_event(NOTIFIER_STOPPED, "run=%d loops=%d", irun, iloop);
+        notifier_close();
     }
 
 
@@ -340,7 +639,378 @@ static void sig_int(int signo)
 
 
 //================================================================
-int parse_inputs(int argsc, char** argsv, char** runid)
+static void send_decision(int rank, wp_header_t* header, char* decision)
+//================================================================
+//
+//  Send the decision bitmap on the spikes of a message.
+//
+//================================================================
+{
+    unsigned char reply[WP_DECISIONS_SIZE(MAX_ANTENNA*MAX_SPIKE)];
+    int n_reply = wp_encode_decisions(header, decision, reply);
+
+    MPI_Send(reply, n_reply, MPI_BYTE, rank, MPI_OK_TAG, MPI_COMM_WORLD);
+}
+
+
+//================================================================
+static int read_decision(unsigned char* reply, MPI_Status* status, wp_header_t* header, char* decision)
+//================================================================
+//
+//  Decode the master reply to a spike message, checking that it
+//  matches the message.
+//
+//================================================================
+{
+    int n_reply;
+    MPI_Get_count(status, MPI_BYTE, &n_reply);
+
+    wp_header_t check;
+    if ((wp_decode_decisions(reply, n_reply, &check, decision, header->count) < 0) ||
+        (check.seq != header->seq) || (check.irq != header->irq) || (check.count != header->count))
+    {
+        notify(WARNING, "Unexpected decision from the master (seq=%d, irq=%d).", header->seq, header->irq);
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+//================================================================
+static void copy_window(unsigned char* window, unsigned char* data, int t)
+//================================================================
+//
+//  Copy the raw data window centered on a spike.
+//
+//================================================================
+{
+    int istart = t - 512;
+    if (istart < 0)
+        istart = 0;
+    else if (istart >=  daq_buffer_size()-1024)
+        istart = daq_buffer_size()-1025;
+
+    memcpy(window, data+istart, SAMPLE_SIZE);
+}
+
+
+//================================================================
+static int node_add_child(int rank, int antenna)
+//================================================================
+//
+//  Add a slave, reporting the given antenna, or a sub-master if
+//  antenna is -1. Returns the child index.
+//
+//================================================================
+{
+    int c = node_ctl.n_child++;
+    node_ctl.rank[c]    = rank;
+    node_ctl.antenna[c] = antenna;
+    node_ctl.held[c]    = 0;
+
+    if (antenna >= 0)
+        node_ctl.size[c] = WP_TIMES_SIZE(MAX_SPIKE);
+    else
+    {
+        node_ctl.size[c]        = WP_HITS_SIZE(MAX_ANTENNA*MAX_SPIKE);
+        node_ctl.hit_antenna[c] = malloc(MAX_ANTENNA*MAX_SPIKE*sizeof(int));
+        node_ctl.hit_index[c]   = malloc(MAX_ANTENNA*MAX_SPIKE*sizeof(int));
+    }
+    node_ctl.message[c] = malloc(node_ctl.size[c]);
+
+    return c;
+}
+
+
+//================================================================
+static void node_receive(int c)
+//================================================================
+//
+//  Post the receive for the next message of a child.
+//
+//================================================================
+{
+    MPI_Irecv(node_ctl.message[c], node_ctl.size[c], MPI_BYTE, node_ctl.rank[c], MPI_OK_TAG, MPI_COMM_WORLD, &node_ctl.request[c]);
+}
+
+
+//================================================================
+static void node_decode(int c, int n_message)
+//================================================================
+//
+//  Decode the message of a child to the spike times of its
+//  antennas. A malformed message is flagged invalid and leaves no
+//  spikes.
+//
+//================================================================
+{
+    static int hit_time[MAX_ANTENNA*MAX_SPIKE];
+    wp_header_t* header = &node_ctl.header[c];
+    memset(header, 0x0, sizeof(wp_header_t));
+
+    int valid;
+    int ia = node_ctl.antenna[c];
+    if (ia >= 0)
+    {
+        valid = (wp_decode_times(node_ctl.message[c], n_message, header, node_ctl.time[ia], MAX_SPIKE) == 0);
+        node_ctl.n_time[ia] = valid ? header->count : 0;
+    }
+    else
+    {
+        // Hits are appended to the times of their antenna, which must belong to the
+        // cluster of the sub-master.
+        for (ia = 0; ia < node_ctl.n_antenna; ia++) if (node_ctl.owner[ia] == c)
+            node_ctl.n_time[ia] = 0;
+
+        valid = (wp_decode_hits(node_ctl.message[c], n_message, header, node_ctl.hit_antenna[c], hit_time, MAX_ANTENNA*MAX_SPIKE) == 0);
+        for (int k = 0; valid && (k < header->count); k++)
+        {
+            ia = node_ctl.hit_antenna[c][k];
+            if ((ia >= node_ctl.n_antenna) || (node_ctl.owner[ia] != c) || (node_ctl.n_time[ia] == MAX_SPIKE))
+            {
+                valid = 0;
+                break;
+            }
+            node_ctl.hit_index[c][k] = node_ctl.n_time[ia];
+            node_ctl.time[ia][node_ctl.n_time[ia]++] = hit_time[k];
+        }
+
+        if (!valid)
+        {
+            for (ia = 0; ia < node_ctl.n_antenna; ia++) if (node_ctl.owner[ia] == c)
+                node_ctl.n_time[ia] = 0;
+        }
+    }
+
+    if (!valid)
+    {
+        notify(WARNING, "Malformed spike message from process %d (%d bytes).", node_ctl.rank[c], n_message);
+        header->count = 0;
+    }
+    node_ctl.valid[c] = valid;
+}
+
+
+//================================================================
+static void node_reply(int c, int empty)
+//================================================================
+//
+//  Send its decision to a child and wait for its next message.
+//
+//================================================================
+{
+    static char no_decision[MAX_ANTENNA*MAX_SPIKE];
+    static char bits[MAX_ANTENNA*MAX_SPIKE];
+
+    int ia = node_ctl.antenna[c];
+    if (empty)
+        send_decision(node_ctl.rank[c], &node_ctl.header[c], no_decision);
+    else if (ia >= 0)
+        send_decision(node_ctl.rank[c], &node_ctl.header[c], node_ctl.decision[ia]);
+    else
+    {
+        for (int k = 0; k < node_ctl.header[c].count; k++)
+            bits[k] = node_ctl.decision[node_ctl.hit_antenna[c][k]][node_ctl.hit_index[c][k]];
+        send_decision(node_ctl.rank[c], &node_ctl.header[c], bits);
+    }
+
+    node_receive(c);
+    node_ctl.held[c] = 0;
+}
+
+
+//================================================================
+static void node_forward(int parent, int seq, int irq, int n_coinc[MAX_ANTENNA])
+//================================================================
+//
+//  Forward the candidate spikes of a sub-master to the master and
+//  get back its decision.
+//
+//================================================================
+{
+    static int  antenna[MAX_ANTENNA*MAX_SPIKE];
+    static int  time[MAX_ANTENNA*MAX_SPIKE];
+    static int  index[MAX_ANTENNA*MAX_SPIKE];
+    static char bits[MAX_ANTENNA*MAX_SPIKE];
+    static unsigned char buffer[WP_HITS_SIZE(MAX_ANTENNA*MAX_SPIKE)];
+
+
+    // Candidates are the spikes in coincidence within the cluster, with the cluster
+    // multiplicity. All spikes are candidates for a multiplicity of 1.
+    if (*selector_multiplicity() > 1)
+        COINC_ALGO(node_ctl.n_antenna, n_coinc, node_ctl.time, node_ctl.decision);
+    else
+    {
+        memset(node_ctl.decision, 0x0, sizeof(node_ctl.decision));
+        for (int ia = 0; ia < node_ctl.n_antenna; ia++)
+            memset(node_ctl.decision[ia], 0x1, n_coinc[ia]);
+    }
+
+    int n_hit = 0;
+    for (int ia = 0; ia < node_ctl.n_antenna; ia++)
+    {
+        for (int it = 0; it < n_coinc[ia]; it++) if (node_ctl.decision[ia][it])
+        {
+            antenna[n_hit] = node_ctl.global[ia];
+            time[n_hit]    = node_ctl.time[ia][it];
+            index[n_hit]   = ia*MAX_SPIKE+it;
+            n_hit++;
+        }
+    }
+
+
+    // Exchange with the master.
+    wp_header_t header = {seq, irq, node_ctl.id, n_hit};
+    int n_buffer = wp_encode_hits(&header, antenna, time, buffer);
+    MPI_Send(buffer, n_buffer, MPI_BYTE, parent, MPI_OK_TAG, MPI_COMM_WORLD);
+
+    MPI_Status mpi_status;
+    MPI_Recv(buffer, WP_DECISIONS_SIZE(MAX_ANTENNA*MAX_SPIKE), MPI_BYTE, parent, MPI_OK_TAG, MPI_COMM_WORLD, &mpi_status);
+    if (read_decision(buffer, &mpi_status, &header, bits) < 0)
+        memset(bits, 0x0, n_hit);
+
+    memset(node_ctl.decision, 0x0, sizeof(node_ctl.decision));
+    for (int k = 0; k < n_hit; k++)
+        node_ctl.decision[index[k]/MAX_SPIKE][index[k]%MAX_SPIKE] = bits[k];
+}
+
+
+//================================================================
+static void node_run(int parent, double deadline)
+//================================================================
+//
+//  Coincidence loop of the master, or of a sub-master if parent
+//  is set. There is no global synchronisation: the spike times
+//  are grouped by buffer sequence, and children which did not
+//  report a sequence before the deadline are processed as empty.
+//
+//================================================================
+{
+    MPI_Status mpi_statuses[MAX_ANTENNA];
+    int        indices[MAX_ANTENNA];
+    int        n_child = node_ctl.n_child;
+    int        c;
+
+    // Post the receives for the first spike messages.
+    for (c = 0; c < n_child; c++)
+        node_receive(c);
+
+    int iloop    = 0;
+    int last_seq = 0;
+    while (halt == 0)
+    {
+        // Collect the spike messages, blocking only if none is held.
+        int n_held = 0;
+        for (c = 0; c < n_child; c++)
+            n_held += node_ctl.held[c];
+
+        int n_done = 0;
+        if (n_held == 0)
+            MPI_Waitsome(n_child, node_ctl.request, &n_done, indices, mpi_statuses);
+        else
+            MPI_Testsome(n_child, node_ctl.request, &n_done, indices, mpi_statuses);
+
+        double t_now = MPI_Wtime();
+        for (int k = 0; (k < n_done) && (n_done != MPI_UNDEFINED); k++)
+        {
+            c = indices[k];
+            int n_message;
+            MPI_Get_count(&mpi_statuses[k], MPI_BYTE, &n_message);
+            node_decode(c, n_message);
+            node_ctl.held[c]   = 1;
+            node_ctl.t_held[c] = t_now;
+            n_held++;
+
+            notify(DEBUG, "loop=%d, process=%d, seq=%d, irq=%d, spikes=%d", iloop, node_ctl.rank[c],
+                node_ctl.header[c].seq, node_ctl.header[c].irq, node_ctl.header[c].count);
+        }
+
+
+        // Answer late messages right away, with an empty decision.
+        for (c = 0; c < n_child; c++) if (node_ctl.held[c] && ((node_ctl.header[c].irq <= last_seq) || !node_ctl.valid[c]))
+        {
+            if (node_ctl.valid[c])
+                notify(WARNING, "Late spike times from process %d (irq=%d, last=%d).", node_ctl.rank[c], node_ctl.header[c].irq, last_seq);
+            node_reply(c, 1);
+            n_held--;
+        }
+
+
+        // Select the oldest buffer sequence. It is processed once all children have
+        // reported, or when its deadline is over.
+        int    seq     = INT_MAX;
+        int    n_seq   = 0;
+        double t_first = t_now;
+        for (c = 0; c < n_child; c++) if (node_ctl.held[c] && (node_ctl.header[c].irq < seq))
+            seq = node_ctl.header[c].irq;
+        for (c = 0; c < n_child; c++) if (node_ctl.held[c] && (node_ctl.header[c].irq == seq))
+        {
+            n_seq++;
+            if (node_ctl.t_held[c] < t_first)
+                t_first = node_ctl.t_held[c];
+        }
+
+        if ((n_seq == 0) || ((n_held < n_child) && (t_now-t_first < deadline)))
+        {
+            usleep(100);
+            continue;
+        }
+
+        if (n_seq < n_child)
+            notify(DEBUG, "loop=%d, seq=%d: %d/%d processes reported.", iloop, seq, n_seq, n_child);
+
+
+        // Find candidate spikes. The times of held messages for a later sequence are
+        // kept, only their count is hidden from the coincidence search.
+        int n_coinc[MAX_ANTENNA];
+        for (int ia = 0; ia < node_ctl.n_antenna; ia++)
+        {
+            c = node_ctl.owner[ia];
+            n_coinc[ia] = (node_ctl.held[c] && (node_ctl.header[c].irq == seq)) ? node_ctl.n_time[ia] : 0;
+        }
+        if (parent < 0)
+            COINC_ALGO(node_ctl.n_antenna, n_coinc, node_ctl.time, node_ctl.decision);
+        else
+            node_forward(parent, iloop, seq, n_coinc);
+
+
+        // Send back the decision to the children that reported.
+        for (c = 0; c < n_child; c++) if (node_ctl.held[c] && (node_ctl.header[c].irq == seq))
+            node_reply(c, 0);
+
+        last_seq = seq;
+        iloop++;
+    }
+}
+
+
+//================================================================
+static void node_close()
+//================================================================
+//
+//  Cancel the pending receives and release the buffers.
+//
+//================================================================
+{
+    for (int c = 0; c < node_ctl.n_child; c++)
+    {
+        if (!node_ctl.held[c])
+        {
+            MPI_Cancel(&node_ctl.request[c]);
+            MPI_Wait(&node_ctl.request[c], MPI_STATUS_IGNORE);
+        }
+        free(node_ctl.message[c]);
+        free(node_ctl.hit_antenna[c]);
+        free(node_ctl.hit_index[c]);
+    }
+    node_ctl.n_child = 0;
+}
+
+
+//================================================================
+int parse_inputs(int argsc, char** argsv, char** runid, int* pipeline, double* deadline,
+    int* n_submaster, int* cluster_multiplicity, int* rank_ids)
 //================================================================
 //
 //  Parse the inputs arguments.
@@ -361,15 +1031,22 @@ int parse_inputs(int argsc, char** argsv, char** runid)
         {
             {"help",          no_argument,       0, 'h'},
             {"runid",         required_argument, 0, 'r'},
+            {"pipeline",      no_argument,       0, 'P'},
+            {"deadline",      required_argument, 0, 'd'},
+            {"submasters",    required_argument, 0, 's'},
+            {"clustermult",   required_argument, 0, 'k'},
+            {"rankids",       no_argument,       0, 'i'},
             SELECTOR_LONG_OPTIONS,
             DAQ_LONG_OPTIONS,
 	    DW_LONG_OPTIONS,
-	    LOGGER_LONG_OPTIONS
+	    LOGGER_LONG_OPTIONS,
+	    NOTIFIER_LONG_OPTIONS
         };
 
         int option_index = 0;
         c = getopt_long(argsc, argsv, 
-	    "hr:" SELECTOR_GETOPT_DESCRIPTOR DAQ_GETOPT_DESCRIPTOR DW_GETOPT_DESCRIPTOR LOGGER_GETOPT_DESCRIPTOR,
+	    "hr:Pd:s:k:i" SELECTOR_GETOPT_DESCRIPTOR DAQ_GETOPT_DESCRIPTOR DW_GETOPT_DESCRIPTOR LOGGER_GETOPT_DESCRIPTOR
+	    NOTIFIER_GETOPT_DESCRIPTOR,
 	    long_options, &option_index
 	);
 
@@ -382,17 +1059,29 @@ int parse_inputs(int argsc, char** argsv, char** runid)
         }
         else if (c == 'r')
             *runid = optarg;
+        else if (c == 'P')
+            *pipeline = 1;
+        else if (c == 'd')
+            *deadline = strtod(optarg, NULL);
+        else if (c == 's')
+            *n_submaster = atoi(optarg);
+        else if (c == 'k')
+            *cluster_multiplicity = atoi(optarg);
+        else if (c == 'i')
+            *rank_ids = 1;
         else
         {
            selector_parse_option(c, optarg);
            daq_parse_option(c, optarg);
            dw_parse_option(c, optarg);
            logger_parse_option(c, optarg);
+           notifier_parse_option(c, optarg);
         }
     }
 
     // Check if mandatory arguments where provided.
-    if((*selector_threshold() == 0.0) || (*runid == NULL) || (*selector_multiplicity() == 0))
+    if((*selector_threshold() == 0.0) || (*runid == NULL) || (*selector_multiplicity() == 0) ||
+       (*n_submaster < 0) || (*n_submaster > MAX_ANTENNA))
     {
         print_usage(argsv[0]);
         return(-1);
@@ -410,12 +1099,24 @@ void print_usage(char* proccess)
 //================================================================
 {
     printf(
-        "Usage: %s --runid=[int] %s %s %s %s\n"
-        "* runid:           the runnumber for the data file name.\n",
-        proccess, selector_usage_text(), daq_usage_text(), dw_usage_text(), logger_usage_text()
+        "Usage: %s --runid=[int] (--pipeline) (--deadline=[float]) (--submasters=[int]) (--clustermult=[int]) (--rankids) %s %s %s %s %s\n"
+        "* runid:           the runnumber for the data file name.\n"
+        "* pipeline:        search the next buffer while waiting for the master decision.\n"
+        "* deadline:        the time the master waits for late antennas, in unit second. Defaults to 0.5 s.\n"
+        "* submasters:      the number of sub-masters, run as the last MPI ranks. The antennas are\n"
+        "                   grouped in as many clusters, around the sub-master hosts when these\n"
+        "                   are antennas. Defaults to 0: all slaves report to the master.\n"
+        "* clustermult:     the multiplicity within a cluster for its spikes to be forwarded to\n"
+        "                   the master. Coincidences spread over clusters with less antennas in\n"
+        "                   each are lost above 1. Defaults to 1: all spikes are forwarded.\n"
+        "* rankids:         take the master and the antenna IDs from the MPI ranks instead of\n"
+        "                   the hostnames, for running several antennas on a single machine.\n",
+        proccess, selector_usage_text(), daq_usage_text(), dw_usage_text(), logger_usage_text(),
+        notifier_usage_text()
     );
     printf(selector_help_text());
     printf(daq_help_text());
     printf(dw_help_text());
     printf(logger_help_text());
+    printf(notifier_help_text());
 }
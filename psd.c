@@ -18,10 +18,18 @@
 #include <getopt.h>
 #include <stdio.h>
 
-#include "ipps.h"
+// Set to 0 for building without Intel IPP.
+#ifndef USE_IPPS
+    #define USE_IPPS 1
+#endif
+
+#if(USE_IPPS == 1)
+    #include "ipps.h"
+#endif
 #include "daq_i.h"
 #include "data_writer.h"
 #include "logger.h"
+#include "psd_engine.h"
 
 
 //======================================================================================
@@ -44,7 +52,7 @@ int halt = 0; // Stop flag
 // Routines for the parsing of input arguments.
 //======================================================================================
 int parse_inputs(int argsc, char** argsv, float* statistic,
-float* period, int* maxiter, char** runid);
+float* period, int* maxiter, char** runid, int* native);
 void print_usage(char* proccess);
 
 
@@ -68,39 +76,7 @@ int main( int argsc, char *argsv[] )
   float fparameters[ N_FPARAMETERS ];
   char *runnumber;
   int  islice, nstat;
-
-  // Allocate memory for FFT
-  //===
-  const int FFT_order = (int)( log( SLICE_SIZE )/log( 2 ) + 0.05 );
-  const int FFT_size  = (int)( SLICE_SIZE/2+1 );
-  const int CCS_size  = (int)( SLICE_SIZE+2 ); 
-  IppsFFTSpec_R_32f* pFFT;
-  IppStatus status = ippsFFTInitAlloc_R_32f( &pFFT, FFT_order, IPP_FFT_DIV_FWD_BY_N, ippAlgHintAccurate );
-  if ( status != ippStsNoErr )
-  {
-    notify(ERROR, "Could not allocate FFT structure memory. Aborting." );
-    return( 0 );
-  }
-
-  int FFT_buffer_size = 0;
-  status = ippsFFTGetBufSize_R_32f( pFFT, &FFT_buffer_size );
-  Ipp8u* FFT_buffer = ippsMalloc_8u( FFT_buffer_size );
-  if ( FFT_buffer == NULL )
-  {
-    notify(ERROR, "Could not allocate memory for FFT buffer. Aborting." );
-    return( 0 );
-  }
-
-  Ipp32f* FFT_data = ippsMalloc_32f( CCS_size );
-  Ipp32f* psd      = ippsMalloc_32f( CCS_size );
-  Ipp32f* FFT_win  = ippsMalloc_32f( SLICE_SIZE );    
-  if ( ( FFT_data == NULL ) || ( psd == NULL ) || ( FFT_win == NULL ) )
-  {
-     notify(ERROR, "Could not allocate memory for FFT data. Aborting." );
-    return( 0 );
-  }
-  ippsSet_32f( 1, FFT_win, SLICE_SIZE );     
-  ippsWinHann_32f_I( FFT_win, SLICE_SIZE );
+  int  native = !USE_IPPS;
 
 
   //====================================================================================
@@ -109,7 +85,7 @@ int main( int argsc, char *argsv[] )
   float statistic = 1e5;
   float period_s  = 0;
 
-  if (parse_inputs(argsc, argsv, &statistic, &period_s, &Nsample, &runnumber) < 0)
+  if (parse_inputs(argsc, argsv, &statistic, &period_s, &Nsample, &runnumber, &native) < 0)
       return(0);
   
   period = (int)(period_s/1.3422 + 0.4999);
@@ -118,6 +94,60 @@ int main( int argsc, char *argsv[] )
   scaling = statistic*MAGIC_SCALING/1e5/period;
 
 
+  // Allocate memory for FFT
+  //===
+  const int FFT_size  = (int)( SLICE_SIZE/2+1 );
+  const int CCS_size  = (int)( SLICE_SIZE+2 ); 
+  float* psd = NULL;
+  unsigned char** slices = NULL;
+  if ( native )
+  {
+    psd    = malloc( CCS_size*sizeof( float ) );
+    slices = malloc( nslice*sizeof( unsigned char* ) );
+    if ( ( psd == NULL ) || ( slices == NULL ) || ( psd_engine_initialise( SLICE_SIZE ) < 0 ) )
+    {
+      notify(ERROR, "Could not allocate memory for FFT data. Aborting." );
+      return( 0 );
+    }
+  }
+#if(USE_IPPS == 1)
+  const int FFT_order = (int)( log( SLICE_SIZE )/log( 2 ) + 0.05 );
+  IppsFFTSpec_R_32f* pFFT = NULL;
+  Ipp8u*  FFT_buffer = NULL;
+  Ipp32f* FFT_data   = NULL;
+  Ipp32f* FFT_win    = NULL;
+  if ( !native )
+  {
+    IppStatus status = ippsFFTInitAlloc_R_32f( &pFFT, FFT_order, IPP_FFT_DIV_FWD_BY_N, ippAlgHintAccurate );
+    if ( status != ippStsNoErr )
+    {
+      notify(ERROR, "Could not allocate FFT structure memory. Aborting." );
+      return( 0 );
+    }
+
+    int FFT_buffer_size = 0;
+    status = ippsFFTGetBufSize_R_32f( pFFT, &FFT_buffer_size );
+    FFT_buffer = ippsMalloc_8u( FFT_buffer_size );
+    if ( FFT_buffer == NULL )
+    {
+      notify(ERROR, "Could not allocate memory for FFT buffer. Aborting." );
+      return( 0 );
+    }
+
+    FFT_data = ippsMalloc_32f( CCS_size );
+    psd      = ippsMalloc_32f( CCS_size );
+    FFT_win  = ippsMalloc_32f( SLICE_SIZE );    
+    if ( ( FFT_data == NULL ) || ( psd == NULL ) || ( FFT_win == NULL ) )
+    {
+      notify(ERROR, "Could not allocate memory for FFT data. Aborting." );
+      return( 0 );
+    }
+    ippsSet_32f( 1, FFT_win, SLICE_SIZE );     
+    ippsWinHann_32f_I( FFT_win, SLICE_SIZE );
+  }
+#endif
+
+
   //====================================================================================
   // Configure I/Os
   //====================================================================================       
@@ -173,12 +203,22 @@ int main( int argsc, char *argsv[] )
     {
       nstat = 0;
       memset( fparameters, 0x0, N_FPARAMETERS*sizeof( float ) );
-      ippsZero_32f( psd, CCS_size );
+      memset( psd, 0x0, CCS_size*sizeof( float ) );
     }
 
-    // Accumulation
+    // Accumulation, the native engine processing all the selected slices at once
     //===
-    for ( islice = 0; islice < nslice; islice++ )
+    if ( native )
+    {
+      int n = 0;
+      for ( islice = 0; islice < nslice; islice++ )
+        if ( drand48() < scaling )
+          slices[ n++ ] = dma_buf+islice*SLICE_SIZE;
+      psd_engine_accumulate( n, slices, psd, fparameters );
+      nstat += n;
+    }
+#if(USE_IPPS == 1)
+    else for ( islice = 0; islice < nslice; islice++ )
     {
       if ( drand48() < scaling ) 
       {
@@ -196,6 +236,7 @@ int main( int argsc, char *argsv[] )
       }
       dma_buf += SLICE_SIZE;
     }
+#endif
     nacc++;
 
 
@@ -208,13 +249,18 @@ int main( int argsc, char *argsv[] )
       if ( nstat == 0 )
         continue;
 
-      for ( islice = 0; islice < FFT_size; islice++ )
-        psd[ 2*islice ] += psd[ 2*islice +1 ];
-      for ( islice = 1; islice < FFT_size; islice++ )
-        psd[ islice ] = psd[ 2*islice ];
-      Ipp32f norm = 1.0/nstat;
-      ippsCopy_32f( fparameters, psd+FFT_size, N_FPARAMETERS );
-      ippsMulC_32f_I( norm, psd, FFT_size+N_FPARAMETERS );
+      // The native engine already sums the real and imaginary parts.
+      if ( !native )
+      {
+        for ( islice = 0; islice < FFT_size; islice++ )
+          psd[ 2*islice ] += psd[ 2*islice +1 ];
+        for ( islice = 1; islice < FFT_size; islice++ )
+          psd[ islice ] = psd[ 2*islice ];
+      }
+      float norm = 1.0/nstat;
+      memcpy( psd+FFT_size, fparameters, N_FPARAMETERS*sizeof( float ) );
+      for ( islice = 0; islice < FFT_size+N_FPARAMETERS; islice++ )
+        psd[ islice ] *= norm;
       psd[ FFT_size+1 ] = sqrt( psd[ FFT_size+1 ] );
 
       irq_after = daq_counter();
@@ -241,13 +287,25 @@ int main( int argsc, char *argsv[] )
   //====================================================================================
   // Close $ free
   //====================================================================================
-  ippsFFTFree_R_32f( pFFT );
-  ippsFree( FFT_buffer );
-  ippsFree( FFT_data );
-  ippsFree( psd );
-  ippsFree( FFT_win );
+  if ( native )
+  {
+    psd_engine_close();
+    free( psd );
+    free( slices );
+  }
+#if(USE_IPPS == 1)
+  else
+  {
+    ippsFFTFree_R_32f( pFFT );
+    ippsFree( FFT_buffer );
+    ippsFree( FFT_data );
+    ippsFree( psd );
+    ippsFree( FFT_win );
+  }
+#endif
 
   daq_close();
+  dw_close();
 
   return( 0 );
 }
@@ -265,7 +323,7 @@ static void sig_int( int signo )
 
 //================================================================
 int parse_inputs(int argsc, char** argsv, float* statistic,
-float* period, int* maxiter, char** runid)
+float* period, int* maxiter, char** runid, int* native)
 //================================================================
 //
 //  Parse the inputs arguments.
@@ -288,6 +346,7 @@ float* period, int* maxiter, char** runid)
             {"period",     required_argument, 0, 'p'},
             {"runid",      required_argument, 0, 'r'},
             {"maxiter",    required_argument, 0, 'm'},
+            {"native",     no_argument,       0, 'n'},
             DAQ_LONG_OPTIONS,
             DW_LONG_OPTIONS,
             LOGGER_LONG_OPTIONS
@@ -295,7 +354,7 @@ float* period, int* maxiter, char** runid)
 
         int option_index = 0;
         c = getopt_long(argsc, argsv, 
-	    "hl:p:r:" DAQ_GETOPT_DESCRIPTOR DW_GETOPT_DESCRIPTOR LOGGER_GETOPT_DESCRIPTOR, 
+	    "hs:p:r:m:n" DAQ_GETOPT_DESCRIPTOR DW_GETOPT_DESCRIPTOR LOGGER_GETOPT_DESCRIPTOR, 
 	    long_options, &option_index
 	);
 
@@ -314,6 +373,8 @@ float* period, int* maxiter, char** runid)
             *runid = optarg;
         else if (c == 'm')
             *maxiter = atoi(optarg);
+        else if (c == 'n')
+            *native = 1;
         else
         {
             daq_parse_option(c, optarg);
@@ -343,11 +404,12 @@ void print_usage(char* proccess)
 //================================================================
 {
     printf(
-        "Usage: %s --runid=[int] (--period=[float]) (--statistic=[float]) (--maxiter=[int]) %s %s %s\n"
+        "Usage: %s --runid=[int] (--period=[float]) (--statistic=[float]) (--maxiter=[int]) (--native) %s %s %s\n"
         "* runid:           the runnumber for the data file name.\n"
         "* period:          the periodicity of the psd measurement, in unit second. Defaults to 1.3 s.\n"
         "* statistic:       the statistic used for the psd. Defaults to 1e5.\n"
-        "* maxiter:         the maximum number of psd measurements. A negative value indicates infinite looping. Defaults to -1.\n",
+        "* maxiter:         the maximum number of psd measurements. A negative value indicates infinite looping. Defaults to -1.\n"
+        "* native:          compute the spectra with the built-in FFT engine instead of IPP. Always on without IPP.\n",
         proccess, daq_usage_text(), dw_usage_text(), logger_usage_text()
     );
     printf(daq_help_text());
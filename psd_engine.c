@@ -0,0 +1,232 @@
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include "psd_engine.h"
+#include "logger.h"
+
+//========================================================================================
+//
+//  Power spectral density of 8-bit ADC slices, without IPP.
+//
+//  A real slice of n samples is transformed as a complex sequence of n/2 points, z[m] =
+//  x[2m]+i*x[2m+1], followed by a split step giving the n/2+1 bins of the real spectrum.
+//  The Hann window is applied while loading the samples in bit reversed order and the
+//  power is accumulated while splitting. PSD_ENGINE_BATCH slices are processed together,
+//  stored interleaved, so that every butterfly runs over contiguous lanes which the
+//  compiler turns into SIMD instructions.
+//
+//  The conventions are those of the IPP based code in psd.c: forward transform divided
+//  by n, Hann window w[j] = 0.5*(1-cos(2*pi*j/(n-1))) and unbiased standard deviation.
+//
+//========================================================================================
+
+#define B PSD_ENGINE_BATCH
+
+
+struct {
+    int    n;
+    int    m;                   // n/2
+    int*   reverse;             // bit reversal permutation over m
+    float* window;              // n
+    float* twiddle;             // m/2 complex, exp(-2i*pi*k/m)
+    float* split;               // m+1 complex, exp(-2i*pi*k/n)
+    float* re;                  // m*B
+    float* im;                  // m*B
+} psd_engine_ctl = {
+    0
+};
+
+
+int psd_engine_initialise(int n)
+{
+    if ((n < PSD_ENGINE_MIN_SIZE) || (n > PSD_ENGINE_MAX_SIZE) || (n & (n-1)))
+    {
+        notify(ERROR, "Unsupported PSD slice size %d.", n);
+        return(-1);
+    }
+
+    psd_engine_close();
+    int m = n/2;
+    psd_engine_ctl.n = n;
+    psd_engine_ctl.m = m;
+
+    psd_engine_ctl.reverse = malloc(m*sizeof(int));
+    psd_engine_ctl.window  = malloc(n*sizeof(float));
+    psd_engine_ctl.twiddle = malloc(m*sizeof(float));
+    psd_engine_ctl.split   = malloc(2*(m+1)*sizeof(float));
+    if ((psd_engine_ctl.reverse == NULL) || (psd_engine_ctl.window == NULL) ||
+        (psd_engine_ctl.twiddle == NULL) || (psd_engine_ctl.split == NULL) ||
+        (posix_memalign((void**)&psd_engine_ctl.re, 64, m*B*sizeof(float)) != 0) ||
+        (posix_memalign((void**)&psd_engine_ctl.im, 64, m*B*sizeof(float)) != 0))
+    {
+        notify(ERROR, "Could not allocate memory for the PSD engine.");
+        psd_engine_close();
+        return(-1);
+    }
+
+
+    // Tables.
+    int n_bit = 0;
+    while ((1 << n_bit) < m)
+        n_bit++;
+    for (int i = 0; i < m; i++)
+    {
+        int r = 0;
+        for (int b = 0; b < n_bit; b++)
+            r |= ((i >> b) & 1) << (n_bit-1-b);
+        psd_engine_ctl.reverse[i] = r;
+    }
+
+    for (int j = 0; j < n; j++)
+        psd_engine_ctl.window[j] = 0.5*(1.0-cos(2.0*M_PI*j/(n-1)));
+
+    for (int k = 0; k < m/2; k++)
+    {
+        psd_engine_ctl.twiddle[2*k]   =  cos(2.0*M_PI*k/m);
+        psd_engine_ctl.twiddle[2*k+1] = -sin(2.0*M_PI*k/m);
+    }
+
+    for (int k = 0; k <= m; k++)
+    {
+        psd_engine_ctl.split[2*k]   =  cos(2.0*M_PI*k/n);
+        psd_engine_ctl.split[2*k+1] = -sin(2.0*M_PI*k/n);
+    }
+
+    return(0);
+}
+
+
+static void psd_engine_batch(unsigned char** slice, int n_lane, float* psd, float* moments)
+{
+    const int n = psd_engine_ctl.n;
+    const int m = psd_engine_ctl.m;
+    const float* w = psd_engine_ctl.window;
+    float* restrict re = psd_engine_ctl.re;
+    float* restrict im = psd_engine_ctl.im;
+
+
+    // Moments, then windowed load in bit reversed order. Unused lanes are zeroed.
+    for (int b = 0; b < B; b++)
+    {
+        if (b >= n_lane)
+        {
+            for (int j = 0; j < m; j++)
+                re[j*B+b] = im[j*B+b] = 0.0;
+            continue;
+        }
+
+        const unsigned char* x = slice[b];
+        int sum = 0, sum2 = 0;
+        for (int j = 0; j < n; j++)
+        {
+            sum  += x[j];
+            sum2 += x[j]*x[j];
+        }
+        double mean = (double)sum/n;
+        moments[0] += mean;
+        moments[1] += (sum2-sum*mean)/(n-1);
+
+        for (int j = 0; j < m; j++)
+        {
+            int r = psd_engine_ctl.reverse[j];
+            re[r*B+b] = x[2*j]*w[2*j];
+            im[r*B+b] = x[2*j+1]*w[2*j+1];
+        }
+    }
+
+
+    // Radix-2 decimation in time over the m complex points.
+    for (int len = 2; len <= m; len <<= 1)
+    {
+        int half = len/2;
+        int step = m/len;
+        for (int i = 0; i < m; i += len)
+        {
+            for (int j = 0; j < half; j++)
+            {
+                float wr = psd_engine_ctl.twiddle[2*j*step];
+                float wi = psd_engine_ctl.twiddle[2*j*step+1];
+                float* restrict ar = re+(i+j)*B;
+                float* restrict ai = im+(i+j)*B;
+                float* restrict br = re+(i+j+half)*B;
+                float* restrict bi = im+(i+j+half)*B;
+                for (int b = 0; b < B; b++)
+                {
+                    float tr = wr*br[b]-wi*bi[b];
+                    float ti = wr*bi[b]+wi*br[b];
+                    br[b] = ar[b]-tr;
+                    bi[b] = ai[b]-ti;
+                    ar[b] = ar[b]+tr;
+                    ai[b] = ai[b]+ti;
+                }
+            }
+        }
+    }
+
+
+    // Split into the real spectrum and accumulate the power.
+    const float norm = 1.0/((float)n*n);
+    float p[B];
+
+    for (int b = 0; b < B; b++)
+        p[b] = (re[b]+im[b])*(re[b]+im[b]);
+    for (int b = 0; b < n_lane; b++)
+        psd[0] += p[b]*norm;
+
+    for (int b = 0; b < B; b++)
+        p[b] = (re[b]-im[b])*(re[b]-im[b]);
+    for (int b = 0; b < n_lane; b++)
+        psd[m] += p[b]*norm;
+
+    for (int k = 1; k < m; k++)
+    {
+        float wr = psd_engine_ctl.split[2*k];
+        float wi = psd_engine_ctl.split[2*k+1];
+        const float* zr = re+k*B;
+        const float* zi = im+k*B;
+        const float* yr = re+(m-k)*B;
+        const float* yi = im+(m-k)*B;
+        for (int b = 0; b < B; b++)
+        {
+            float er = 0.5f*(zr[b]+yr[b]);
+            float ei = 0.5f*(zi[b]-yi[b]);
+            float or = 0.5f*(zi[b]+yi[b]);
+            float oi = 0.5f*(yr[b]-zr[b]);
+            float xr = er+wr*or-wi*oi;
+            float xi = ei+wr*oi+wi*or;
+            p[b] = xr*xr+xi*xi;
+        }
+
+        float s = 0.0;
+        for (int b = 0; b < n_lane; b++)
+            s += p[b];
+        psd[k] += s*norm;
+    }
+}
+
+
+int psd_engine_accumulate(int n_slice, unsigned char** slice, float* psd, float* moments)
+{
+    if (psd_engine_ctl.n == 0)
+    {
+        notify(ERROR, "The PSD engine is not initialised.");
+        return(-1);
+    }
+
+    for (int i = 0; i < n_slice; i += B)
+        psd_engine_batch(slice+i, (n_slice-i < B) ? n_slice-i : B, psd, moments);
+
+    return(0);
+}
+
+
+void psd_engine_close()
+{
+    free(psd_engine_ctl.reverse);
+    free(psd_engine_ctl.window);
+    free(psd_engine_ctl.twiddle);
+    free(psd_engine_ctl.split);
+    free(psd_engine_ctl.re);
+    free(psd_engine_ctl.im);
+    memset(&psd_engine_ctl, 0x0, sizeof(psd_engine_ctl));
+}
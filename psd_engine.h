@@ -0,0 +1,15 @@
+#ifndef PSD_ENGINE_H
+#define PSD_ENGINE_H 1
+
+// Number of slices transformed together.
+#define PSD_ENGINE_BATCH 8
+
+#define PSD_ENGINE_MIN_SIZE 8
+#define PSD_ENGINE_MAX_SIZE 4096
+
+
+int psd_engine_initialise(int n);
+int psd_engine_accumulate(int n_slice, unsigned char** slice, float* psd, float* moments);
+void psd_engine_close();
+
+#endif
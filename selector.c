@@ -2,29 +2,76 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
 #include "selector.h"
 #include "logger.h"
 
 
-#define USE_IPPS 1
-
-
 #if(USE_IPPS == 1)
     #include "ipp.h"
 #endif
 
+#if defined(__x86_64__) || defined(__i386__)
+    #define USE_SIMD 1
+    #include <immintrin.h>
+#else
+    #define USE_SIMD 0
+#endif
+
+
+// Block kernels used by selector_simd_find_spikes, selected at runtime.
+typedef struct {
+    const char* name;
+    void (*sums)(const unsigned char* p, int* sum, int* sum2);
+    unsigned char (*amax)(const unsigned char* p, unsigned char mu);
+} selector_kernel_t;
+
 
 struct {
     float threshold;
     int   multiplicity;
     char* detconfig;
+    int   n_thread;
     int   delay[MAX_ANTENNA];
     int   distance[MAX_ANTENNA][MAX_ANTENNA];
+    const selector_kernel_t* kernel;
 } selector_ctl = 
 {
     6.0,
     4,
-    "/home/pastsoft/trend/daq/config/22-02-12.cfg"
+    "/home/pastsoft/trend/daq/config/22-02-12.cfg",
+    1
+};
+
+
+// Chunk of the DMA buffer scanned by a single thread.
+typedef struct {
+    int   offset;
+    int   length;
+    int   n_time;
+    int   time[MAX_SPIKE];
+    float stddev;
+    int   generation;   // last round seen by the worker of this chunk
+} selector_chunk_t;
+
+
+// Pool of worker threads for selector_parallel_find_spikes.
+struct {
+    int                 n_worker;
+    pthread_t           worker[MAX_THREAD];
+    pthread_mutex_t     mutex;
+    pthread_cond_t      start;
+    pthread_cond_t      done;
+    int                 generation;
+    int                 n_active;
+    int                 n_done;
+    int                 stop;
+    selector_spike_algo algo;
+    unsigned char*      data;
+    selector_chunk_t    chunk[MAX_THREAD];
+} selector_pool = {
+    0
 };
 
 
@@ -46,12 +93,14 @@ char** selector_detconfig()
 }
 
 
-int selector_initialise(int n_antenna, int antenna_id[MAX_ANTENNA])
+int* selector_threads()
 {
-    // Read delays and distances.
-    float delay[MAX_ANTENNA];
-    float distance[MAX_ANTENNA][MAX_ANTENNA];
+    return &selector_ctl.n_thread;
+}
+
 
+static int selector_read_config(float delay[MAX_ANTENNA], float distance[MAX_ANTENNA][MAX_ANTENNA])
+{
     FILE* fid = fopen(selector_ctl.detconfig, "r");
     if (fid == NULL)
     {
@@ -67,6 +116,18 @@ int selector_initialise(int n_antenna, int antenna_id[MAX_ANTENNA])
 
     fclose(fid);
 
+    return(0);
+}
+
+
+int selector_initialise(int n_antenna, int antenna_id[MAX_ANTENNA])
+{
+    // Read delays and distances.
+    float delay[MAX_ANTENNA];
+    float distance[MAX_ANTENNA][MAX_ANTENNA];
+    if (selector_read_config(delay, distance) < 0)
+        return(-1);
+
 
     // Compute the rounded and remaped values in unit sample.
     for (int i = 0; i < n_antenna; i++)
@@ -85,6 +146,133 @@ int selector_initialise(int n_antenna, int antenna_id[MAX_ANTENNA])
 }
 
 
+int selector_geometry(float delay[MAX_ANTENNA], float position[MAX_ANTENNA][3])
+{
+    // Recover antenna positions, in meters, from the distances of the configuration
+    // file by classical multidimensional scaling: the positions are the 3 leading
+    // eigenvectors of the double centered squared distances, scaled by the square root
+    // of their eigenvalue. They are defined up to a rotation, which does not matter
+    // for plane waves of isotropic directions.
+    static double b[MAX_ANTENNA][MAX_ANTENNA];
+    float distance[MAX_ANTENNA][MAX_ANTENNA];
+    if (selector_read_config(delay, distance) < 0)
+        return(-1);
+
+    const int n = MAX_ANTENNA;
+    double row[MAX_ANTENNA], all = 0.0;
+    for (int i = 0; i < n; i++)
+    {
+        row[i] = 0.0;
+        for (int j = 0; j < n; j++)
+            row[i] += (double)distance[i][j]*distance[i][j]/n;
+        all += row[i]/n;
+    }
+    for (int i = 0; i < n; i++) for (int j = 0; j < n; j++)
+        b[i][j] = -0.5*((double)distance[i][j]*distance[i][j]-row[i]-row[j]+all);
+
+
+    // Power iterations, deflating each component found.
+    for (int k = 0; k < 3; k++)
+    {
+        double v[MAX_ANTENNA], w[MAX_ANTENNA], lambda = 0.0;
+        for (int i = 0; i < n; i++)
+            v[i] = 1.0+0.01*i*(k+1);
+
+        for (int it = 0; it < 1000; it++)
+        {
+            double norm = 0.0;
+            for (int i = 0; i < n; i++)
+            {
+                w[i] = 0.0;
+                for (int j = 0; j < n; j++)
+                    w[i] += b[i][j]*v[j];
+                norm += w[i]*w[i];
+            }
+            norm = sqrt(norm);
+            if (norm == 0.0)
+                break;
+
+            double change = 0.0;
+            for (int i = 0; i < n; i++)
+            {
+                change += fabs(w[i]/norm-v[i]);
+                v[i] = w[i]/norm;
+            }
+            if (change < 1.0e-12*n)
+                break;
+        }
+
+        for (int i = 0; i < n; i++) for (int j = 0; j < n; j++)
+            lambda += v[i]*b[i][j]*v[j];
+        double scale = (lambda > 0.0) ? sqrt(lambda) : 0.0;
+        for (int i = 0; i < n; i++)
+            position[i][k] = scale*v[i];
+
+        for (int i = 0; i < n; i++) for (int j = 0; j < n; j++)
+            b[i][j] -= lambda*v[i]*v[j];
+    }
+
+    return(0);
+}
+
+
+int selector_cluster(int n_antenna, int n_cluster, int seed[], int cluster[MAX_ANTENNA])
+{
+    // Group the antennas around n_cluster centers, using the light distances of
+    // selector_initialise. Centers are the seeds if set, or else the antennas farthest
+    // from the centers already picked.
+    if ((n_cluster < 1) || (n_cluster > MAX_ANTENNA))
+    {
+        notify(ERROR, "Invalid number of clusters %d.", n_cluster);
+        return(-1);
+    }
+
+    int center[MAX_ANTENNA];
+    for (int k = 0; k < n_cluster; k++)
+        center[k] = ((seed != NULL) && (seed[k] >= 0) && (seed[k] < n_antenna)) ? seed[k] : -1;
+
+    for (int k = 0; (k < n_cluster) && (n_antenna > 0); k++) if (center[k] < 0)
+    {
+        int best = 0;
+        int d_best = -1;
+        for (int ia = 0; ia < n_antenna; ia++)
+        {
+            int d_min = INT_MAX;
+            for (int l = 0; l < n_cluster; l++) if (center[l] >= 0)
+            {
+                int d = (ia == center[l]) ? -1 : selector_ctl.distance[ia][center[l]];
+                if (d < d_min)
+                    d_min = d;
+            }
+            if (d_min > d_best)
+            {
+                best   = ia;
+                d_best = d_min;
+            }
+        }
+        center[k] = best;
+    }
+
+
+    // Assign each antenna to its closest center.
+    for (int ia = 0; ia < n_antenna; ia++)
+    {
+        int d_min = INT_MAX;
+        for (int k = 0; k < n_cluster; k++)
+        {
+            int d = (ia == center[k]) ? -1 : selector_ctl.distance[ia][center[k]];
+            if (d < d_min)
+            {
+                cluster[ia] = k;
+                d_min = d;
+            }
+        }
+    }
+
+    return(0);
+}
+
+
 #if(USE_IPPS == 1)
 float slipps_find_spikes(int n_data, unsigned char* data, int* n_time, int time[MAX_SPIKE])
 {
@@ -241,84 +429,630 @@ float selector_find_spikes(int n_data, unsigned char* data, int* n_time, int tim
     return(stddev);
 }
 
-int selector_find_coincidences(int n_antenna, int n_time[MAX_ANTENNA], int time[MAX_ANTENNA][MAX_SPIKE], char 
-decision[MAX_ANTENNA][MAX_SPIKE])
+//========================================================================================
+//
+//  Vectorised spike finder on the raw 8 bit samples.
+//
+//  Each block is processed in two passes: the sum and the sum of squares of the samples
+//  (psadbw and pmaddwd) and then the maximum absolute deviation to the truncated mean
+//  (saturated byte differences). The statistics are computed from the same integer sums
+//  as selector_find_spikes such that the spike times are bit identical.
+//
+//========================================================================================
+
+static void selector_sums_scalar(const unsigned char* p, int* sum, int* sum2)
 {
-    return 0;
+    int s = 0, s2 = 0;
+    for (int j = 0; j < SAMPLE_SIZE; j++)
+    {
+        s  += p[j];
+        s2 += p[j]*p[j];
+    }
+    *sum  = s;
+    *sum2 = s2;
 }
 
 
-#if(USE_IPPS == 1)
-int slipps_find_coincidences(int n_antenna, int n_time[MAX_ANTENNA], int time[MAX_ANTENNA][MAX_SPIKE], char 
-decision[MAX_ANTENNA][MAX_SPIKE])
+static unsigned char selector_amax_scalar(const unsigned char* p, unsigned char mu)
 {
-    // Initialise decision.
-    memset(decision, 0x0, MAX_ANTENNA*MAX_SPIKE);
+    unsigned char amax = 0;
+    for (int j = 0; j < SAMPLE_SIZE; j++)
+    {
+        unsigned char a = (p[j] > mu) ? p[j]-mu : mu-p[j];
+        if (a > amax)
+            amax = a;
+    }
+    return amax;
+}
+
+
+static const selector_kernel_t selector_kernel_scalar = {
+    "scalar", selector_sums_scalar, selector_amax_scalar
+};
 
 
-    // Sort times.
-    Ipp32s t[MAX_ANTENNA*MAX_SPIKE];
-    Ipp32s antenna[MAX_ANTENNA*MAX_SPIKE];
-    int    index[MAX_ANTENNA*MAX_SPIKE];
+#if(USE_SIMD == 1)
+__attribute__((target("sse2")))
+static void selector_sums_sse2(const unsigned char* p, int* sum, int* sum2)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i s  = zero;
+    __m128i s2 = zero;
+    for (int j = 0; j < SAMPLE_SIZE; j += 16)
+    {
+        __m128i x  = _mm_loadu_si128((const __m128i*)(p+j));
+        __m128i lo = _mm_unpacklo_epi8(x, zero);
+        __m128i hi = _mm_unpackhi_epi8(x, zero);
+        s  = _mm_add_epi32(s, _mm_sad_epu8(x, zero));
+        s2 = _mm_add_epi32(s2, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+    s2 = _mm_add_epi32(s2, _mm_shuffle_epi32(s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s2 = _mm_add_epi32(s2, _mm_shuffle_epi32(s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    *sum  = _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+    *sum2 = _mm_cvtsi128_si32(s2);
+}
 
-    int n_t = 0;
-    Ipp32s *pt = t, *pa = antenna;
+
+__attribute__((target("sse2")))
+static unsigned char selector_amax_sse2(const unsigned char* p, unsigned char mu)
+{
+    const __m128i m = _mm_set1_epi8((char)mu);
+    __m128i amax = _mm_setzero_si128();
+    for (int j = 0; j < SAMPLE_SIZE; j += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(p+j));
+        amax = _mm_max_epu8(amax, _mm_or_si128(_mm_subs_epu8(x, m), _mm_subs_epu8(m, x)));
+    }
+    amax = _mm_max_epu8(amax, _mm_srli_si128(amax, 8));
+    amax = _mm_max_epu8(amax, _mm_srli_si128(amax, 4));
+    amax = _mm_max_epu8(amax, _mm_srli_si128(amax, 2));
+    amax = _mm_max_epu8(amax, _mm_srli_si128(amax, 1));
+    return (unsigned char)_mm_cvtsi128_si32(amax);
+}
+
+
+static const selector_kernel_t selector_kernel_sse2 = {
+    "sse2", selector_sums_sse2, selector_amax_sse2
+};
+
+
+__attribute__((target("avx2")))
+static void selector_sums_avx2(const unsigned char* p, int* sum, int* sum2)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i s  = zero;
+    __m256i s2 = zero;
+    for (int j = 0; j < SAMPLE_SIZE; j += 32)
+    {
+        __m256i x  = _mm256_loadu_si256((const __m256i*)(p+j));
+        __m256i lo = _mm256_unpacklo_epi8(x, zero);
+        __m256i hi = _mm256_unpackhi_epi8(x, zero);
+        s  = _mm256_add_epi32(s, _mm256_sad_epu8(x, zero));
+        s2 = _mm256_add_epi32(s2, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+    }
+    __m128i s_4  = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    __m128i s2_4 = _mm_add_epi32(_mm256_castsi256_si128(s2), _mm256_extracti128_si256(s2, 1));
+    s2_4 = _mm_add_epi32(s2_4, _mm_shuffle_epi32(s2_4, _MM_SHUFFLE(1, 0, 3, 2)));
+    s2_4 = _mm_add_epi32(s2_4, _mm_shuffle_epi32(s2_4, _MM_SHUFFLE(2, 3, 0, 1)));
+    *sum  = _mm_cvtsi128_si32(s_4) + _mm_cvtsi128_si32(_mm_srli_si128(s_4, 8));
+    *sum2 = _mm_cvtsi128_si32(s2_4);
+}
+
+
+__attribute__((target("avx2")))
+static unsigned char selector_amax_avx2(const unsigned char* p, unsigned char mu)
+{
+    const __m256i m = _mm256_set1_epi8((char)mu);
+    __m256i amax = _mm256_setzero_si256();
+    for (int j = 0; j < SAMPLE_SIZE; j += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(p+j));
+        amax = _mm256_max_epu8(amax, _mm256_or_si256(_mm256_subs_epu8(x, m), _mm256_subs_epu8(m, x)));
+    }
+    __m128i a = _mm_max_epu8(_mm256_castsi256_si128(amax), _mm256_extracti128_si256(amax, 1));
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 8));
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 4));
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 2));
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 1));
+    return (unsigned char)_mm_cvtsi128_si32(a);
+}
+
+
+static const selector_kernel_t selector_kernel_avx2 = {
+    "avx2", selector_sums_avx2, selector_amax_avx2
+};
+
+
+__attribute__((target("avx512f,avx512bw")))
+static void selector_sums_avx512(const unsigned char* p, int* sum, int* sum2)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i s  = zero;
+    __m512i s2 = zero;
+    for (int j = 0; j < SAMPLE_SIZE; j += 64)
+    {
+        __m512i x  = _mm512_loadu_si512((const void*)(p+j));
+        __m512i lo = _mm512_unpacklo_epi8(x, zero);
+        __m512i hi = _mm512_unpackhi_epi8(x, zero);
+        s  = _mm512_add_epi64(s, _mm512_sad_epu8(x, zero));
+        s2 = _mm512_add_epi32(s2, _mm512_add_epi32(_mm512_madd_epi16(lo, lo), _mm512_madd_epi16(hi, hi)));
+    }
+    *sum  = (int)_mm512_reduce_add_epi64(s);
+    *sum2 = _mm512_reduce_add_epi32(s2);
+}
+
+
+__attribute__((target("avx512f,avx512bw")))
+static unsigned char selector_amax_avx512(const unsigned char* p, unsigned char mu)
+{
+    const __m512i m = _mm512_set1_epi8((char)mu);
+    __m512i amax = _mm512_setzero_si512();
+    for (int j = 0; j < SAMPLE_SIZE; j += 64)
+    {
+        __m512i x = _mm512_loadu_si512((const void*)(p+j));
+        amax = _mm512_max_epu8(amax, _mm512_or_si512(_mm512_subs_epu8(x, m), _mm512_subs_epu8(m, x)));
+    }
+    __m256i a8 = _mm256_max_epu8(_mm512_castsi512_si256(amax), _mm512_extracti64x4_epi64(amax, 1));
+    __m128i a  = _mm_max_epu8(_mm256_castsi256_si128(a8), _mm256_extracti128_si256(a8, 1));
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 8));
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 4));
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 2));
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 1));
+    return (unsigned char)_mm_cvtsi128_si32(a);
+}
+
+
+static const selector_kernel_t selector_kernel_avx512 = {
+    "avx512", selector_sums_avx512, selector_amax_avx512
+};
+#endif
+
+
+static const selector_kernel_t* selector_dispatch()
+{
+    const selector_kernel_t* kernel = &selector_kernel_scalar;
+
+#if(USE_SIMD == 1)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        kernel = &selector_kernel_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        kernel = &selector_kernel_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        kernel = &selector_kernel_sse2;
+#endif
+
+    notify(DEBUG, "Using the %s spike finder kernel.", kernel->name);
+    return kernel;
+}
+
+
+float selector_simd_find_spikes(int n_data, unsigned char* data, int* n_time, int time[MAX_SPIKE])
+{
+    if (selector_ctl.kernel == NULL)
+        selector_ctl.kernel = selector_dispatch();
+    const selector_kernel_t* kernel = selector_ctl.kernel;
+
+    unsigned char* pd = data;
+    int i, j, imax = n_data/SAMPLE_SIZE;
+
+    float stddev        = 0.0;
+    int   nstd          = 0;
+    int   it            = 0;
+    float sample_size_f = (float)SAMPLE_SIZE;
+    for (i = 0; i < imax; i++, pd += SAMPLE_SIZE)
+    {
+        // Check if maximum number of spikes was reached.
+        if (it == MAX_SPIKE)
+            break;
+
+
+        // Compute the mean and standard deviation.
+        int mu_i, sigma_i;
+        kernel->sums(pd, &mu_i, &sigma_i);
+
+        float mu_f    = mu_i/sample_size_f;
+        float sigma_f = sigma_i/sample_size_f - mu_f*mu_f;
+        if (sigma_f > 0.0)
+            sigma_f = sqrt(sigma_f);
+        else
+            sigma_f = 0.0;
+
+        stddev += sigma_f*sigma_f;
+        nstd++;
+
+        sigma_f *= selector_ctl.threshold;
+        if (sigma_f >= 255.0)
+            continue;
+
+        unsigned char mu        = (unsigned char)mu_f;
+        unsigned char threshold = (unsigned char)sigma_f;
+
+
+        // Get the maximum amplitude and locate its first occurence only for spikes.
+        unsigned char amax = kernel->amax(pd, mu);
+        if (amax <= threshold)
+            continue;
+
+        for (j = 0; j < SAMPLE_SIZE; j++)
+            if (((pd[j] > mu) ? pd[j]-mu : mu-pd[j]) == amax)
+                break;
+
+        int ti = i*SAMPLE_SIZE + j;
+        if ((it == 0) || (ti-time[it-1] >= POST_SPIKE_DEAD_TIME))
+        {
+            time[it] = ti;
+            it++;
+        }
+    }
+
+
+    // Update the numbre of spikes.
+    *n_time = it;
+
+
+    // Averaged standard deviation.
+    stddev = sqrt(stddev/nstd);
+
+    return(stddev);
+}
+
+
+//========================================================================================
+//
+//  Multi-threaded spike search.
+//
+//  The buffer is split in chunks of whole blocks, one per thread, and each chunk is
+//  scanned with the serial algorithm. Since there is at most one spike per block only
+//  the first spike of a chunk can fall in the dead time of the previous chunk's last
+//  spike, such that re-applying POST_SPIKE_DEAD_TIME and MAX_SPIKE while merging the
+//  chunks in order gives the same spike times as a serial scan. The returned standard
+//  deviation is averaged over the chunks that were merged.
+//
+//========================================================================================
+
+static void selector_scan_chunk(selector_chunk_t* chunk)
+{
+    chunk->stddev = selector_pool.algo(chunk->length, selector_pool.data+chunk->offset,
+        &chunk->n_time, chunk->time);
+
+    for (int it = 0; it < chunk->n_time; it++)
+        chunk->time[it] += chunk->offset;
+}
+
+
+static void* selector_worker(void* arg)
+{
+    selector_chunk_t* chunk = (selector_chunk_t*)arg;
+    int ic = chunk-selector_pool.chunk;
+
+    while (1)
+    {
+        pthread_mutex_lock(&selector_pool.mutex);
+        while ((selector_pool.generation == chunk->generation) && !selector_pool.stop)
+            pthread_cond_wait(&selector_pool.start, &selector_pool.mutex);
+        if (selector_pool.stop)
+        {
+            pthread_mutex_unlock(&selector_pool.mutex);
+            break;
+        }
+        chunk->generation = selector_pool.generation;
+        int active = (ic < selector_pool.n_active);
+        pthread_mutex_unlock(&selector_pool.mutex);
+
+        // The chunks past the active ones are left over from a larger buffer.
+        if (!active)
+            continue;
+        selector_scan_chunk(chunk);
+
+        pthread_mutex_lock(&selector_pool.mutex);
+        selector_pool.n_done++;
+        pthread_cond_signal(&selector_pool.done);
+        pthread_mutex_unlock(&selector_pool.mutex);
+    }
+
+    return NULL;
+}
+
+
+static int selector_start_pool(int n_worker)
+{
+    if (selector_pool.n_worker == 0)
+    {
+        pthread_mutex_init(&selector_pool.mutex, NULL);
+        pthread_cond_init(&selector_pool.start, NULL);
+        pthread_cond_init(&selector_pool.done, NULL);
+    }
+
+    while (selector_pool.n_worker < n_worker)
+    {
+        // Chunk 0 is processed by the calling thread. A new worker waits for the next round.
+        int iw = selector_pool.n_worker;
+        pthread_mutex_lock(&selector_pool.mutex);
+        selector_pool.chunk[iw+1].generation = selector_pool.generation;
+        pthread_mutex_unlock(&selector_pool.mutex);
+        if (pthread_create(&selector_pool.worker[iw], NULL, selector_worker, &selector_pool.chunk[iw+1]) != 0)
+        {
+            notify(WARNING, "Couldn't start spike search thread %d, using %d.", iw+1, selector_pool.n_worker+1);
+            break;
+        }
+        selector_pool.n_worker++;
+    }
+
+    return selector_pool.n_worker;
+}
+
+
+int selector_close()
+{
+    if (selector_pool.n_worker == 0)
+        return(0);
+
+    pthread_mutex_lock(&selector_pool.mutex);
+    selector_pool.stop = 1;
+    pthread_cond_broadcast(&selector_pool.start);
+    pthread_mutex_unlock(&selector_pool.mutex);
+
+    for (int iw = 0; iw < selector_pool.n_worker; iw++)
+        pthread_join(selector_pool.worker[iw], NULL);
+    selector_pool.n_worker = 0;
+    selector_pool.stop     = 0;
+
+    pthread_mutex_destroy(&selector_pool.mutex);
+    pthread_cond_destroy(&selector_pool.start);
+    pthread_cond_destroy(&selector_pool.done);
+
+    return(0);
+}
+
+
+float selector_parallel_find_spikes(selector_spike_algo algo, int n_data, unsigned char* data, int* n_time, int time[MAX_SPIKE])
+{
+    int n_thread = selector_ctl.n_thread;
+    int n_block  = n_data/SAMPLE_SIZE;
+    if (n_thread > MAX_THREAD)
+        n_thread = MAX_THREAD;
+    if (n_thread > n_block)
+        n_thread = n_block;
+    if ((n_thread > 1) && (selector_start_pool(n_thread-1)+1 < n_thread))
+        n_thread = selector_pool.n_worker+1;
+    if (n_thread <= 1)
+        return algo(n_data, data, n_time, time);
+
+    // Resolve the SIMD kernel before the workers race for it.
+    if (selector_ctl.kernel == NULL)
+        selector_ctl.kernel = selector_dispatch();
+
+
+    // Split the buffer and wake up the workers.
+    for (int ic = 0; ic < n_thread; ic++)
+    {
+        int b0 = (int)(((long)n_block*ic)/n_thread);
+        int b1 = (int)(((long)n_block*(ic+1))/n_thread);
+        selector_pool.chunk[ic].offset = b0*SAMPLE_SIZE;
+        selector_pool.chunk[ic].length = (b1-b0)*SAMPLE_SIZE;
+    }
+
+    pthread_mutex_lock(&selector_pool.mutex);
+    selector_pool.algo     = algo;
+    selector_pool.data     = data;
+    selector_pool.n_active = n_thread;
+    selector_pool.n_done   = 0;
+    selector_pool.generation++;
+    pthread_cond_broadcast(&selector_pool.start);
+    pthread_mutex_unlock(&selector_pool.mutex);
+
+    selector_scan_chunk(&selector_pool.chunk[0]);
+
+    pthread_mutex_lock(&selector_pool.mutex);
+    while (selector_pool.n_done < n_thread-1)
+        pthread_cond_wait(&selector_pool.done, &selector_pool.mutex);
+    pthread_mutex_unlock(&selector_pool.mutex);
+
+
+    // Merge the chunks in time order.
+    float variance = 0.0;
+    int   nvar     = 0;
+    int   it       = 0;
+    for (int ic = 0; (ic < n_thread) && (it < MAX_SPIKE); ic++)
+    {
+        selector_chunk_t* chunk = &selector_pool.chunk[ic];
+        variance += chunk->stddev*chunk->stddev*chunk->length;
+        nvar     += chunk->length;
+
+        for (int jt = 0; (jt < chunk->n_time) && (it < MAX_SPIKE); jt++)
+        {
+            int ti = chunk->time[jt];
+            if ((it == 0) || (ti-time[it-1] >= POST_SPIKE_DEAD_TIME))
+            {
+                time[it] = ti;
+                it++;
+            }
+        }
+    }
+    *n_time = it;
+
+    return(sqrt(variance/nvar));
+}
+
+
+//========================================================================================
+//
+//  Coincidence search.
+//
+//  The spike times, corrected for the cable delays, are merged in time order from the
+//  per antenna lists, which the spike search returns sorted. Spikes at the same time are
+//  ordered by antenna. A window then starts at every spike and extends while the next
+//  spike is either on the same antenna or within the antenna pair distance. If it spans
+//  enough antennas all its spikes are accepted and the search resumes after it.
+//
+//========================================================================================
+
+// Spikes of all antennas, in time order.
+typedef struct {
+    int       n;
+    int       t[MAX_ANTENNA*MAX_SPIKE];
+    short     antenna[MAX_ANTENNA*MAX_SPIKE];
+    short     index[MAX_ANTENNA*MAX_SPIKE];
+    long long key[2][MAX_ANTENNA*MAX_SPIKE];
+} selector_spikes_t;
+
+static selector_spikes_t selector_spikes;
+
+
+// Merge keys pack the delayed time, the antenna and the spike index. The antenna breaks
+// ties.
+#define SELECTOR_KEY(t, ia, it) ((long long)(t)*65536+((ia) << 8)+(it))
+
+
+static void selector_merge_spikes(int n_antenna, int n_time[MAX_ANTENNA], int time[MAX_ANTENNA][MAX_SPIKE], selector_spikes_t* spikes)
+{
+    // One sorted run per antenna.
+    int start[MAX_ANTENNA+1];
+    int n_run = 0;
+    int n = 0;
+    long long* in = spikes->key[0];
     for (int ia = 0; ia < n_antenna; ia++)
     {
-        ippsCopy_32s(&time[ia][0], pt, n_time[ia]);
-        ippsSubC_32s_ISfs(selector_ctl.delay[ia], pt, n_time[ia], 0);
-        ippsSet_32s(ia, pa, n_time[ia]);
+        if (n_time[ia] == 0)
+            continue;
+        start[n_run++] = n;
+        for (int it = 0; it < n_time[ia]; it++)
+            in[n++] = SELECTOR_KEY(time[ia][it]-selector_ctl.delay[ia], ia, it);
+    }
+    start[n_run] = n;
+
+
+    // Merge the runs pairwise until a single one is left. The two way merge is branchless,
+    // the order of the next keys being unpredictable. It first proceeds from both ends at
+    // once, which gives two independent dependency chains, for as many steps as there are
+    // keys in the shorter run so that no pointer leaves its run. Keys are unique.
+    long long* out = spikes->key[1];
+    while (n_run > 1)
+    {
+        int m = 0;
+        for (int r = 0; r < n_run; r += 2)
+        {
+            int i  = start[r];
+            int j  = start[r+1];
+            int ib = j-1;
+            int jb = ((r+2 <= n_run) ? start[r+2] : j)-1;
+            int k  = i;
+            int kb = jb;
+            start[m++] = i;
+
+            int h = (ib-i < jb-j) ? ib-i+1 : jb-j+1;
+            for (; h > 0; h--)
+            {
+                long long x = in[i], y = in[j];
+                int c = y < x;
+                out[k++] = c ? y : x;
+                i += 1-c;
+                j += c;
+
+                long long xb = in[ib], yb = in[jb];
+                int cb = xb > yb;
+                out[kb--] = cb ? xb : yb;
+                ib -= cb;
+                jb -= 1-cb;
+            }
 
-        pa  += n_time[ia]; 
-        pt  += n_time[ia];
-        n_t += n_time[ia];
+            while ((i <= ib) && (j <= jb))
+            {
+                long long x = in[i], y = in[j];
+                int c = y < x;
+                out[k++] = c ? y : x;
+                i += 1-c;
+                j += c;
+            }
+            while (i <= ib)
+                out[k++] = in[i++];
+            while (j <= jb)
+                out[k++] = in[j++];
+        }
+        start[m] = n;
+        n_run = m;
+
+        long long* swap = in;
+        in  = out;
+        out = swap;
     }
 
-    ippsSortIndexAscend_32s_I(t, index, n_t);
-    
 
-    // Look for coincs.
-    Ipp32s Ia0[MAX_ANTENNA*MAX_SPIKE], Ia1[MAX_ANTENNA*MAX_SPIKE];
+    // Unpack.
+    for (int i = 0; i < n; i++)
+    {
+        spikes->t[i]       = in[i] >> 16;
+        spikes->antenna[i] = (in[i] >> 8) & 0xff;
+        spikes->index[i]   = in[i] & 0xff;
+    }
+    spikes->n = n;
+}
+
 
-    int nCoinc;    
-    ippsZero_32s(Ia0, n_antenna);
-    int j0, j1;
-    for (j0 = 0; j0 < n_t-1; j0++)
+static void selector_scan_coincidences(selector_spikes_t* spikes, char decision[MAX_ANTENNA][MAX_SPIKE])
+{
+    // Per antenna counts of the current window. Only the touched entries are reset.
+    int count[MAX_ANTENNA] = {0};
+    int touched[MAX_ANTENNA];
+
+    int n_t = spikes->n;
+    int* t = spikes->t;
+    short* antenna = spikes->antenna;
+    for (int j0 = 0; j0 < n_t-1; j0++)
     {
-         int ant0 = antenna[index[j0]];
-         ippsZero_32s(Ia1, n_antenna);
-         nCoinc = 1;
-         Ia1[ant0]++;
-
-         for (j1 = j0+1; j1 < n_t; j1++)
-         {
-             int ant1 = antenna[index[j1]]; 
-
-             if ((ant1 == ant0) || (t[j1]-t[j0] <= selector_ctl.distance[ant1][ant0]))
-             {
-                 if (Ia1[ant1] == 0)
-                     nCoinc += 1;
-
-                 Ia1[ant1]++;
-             }
-             else
-                 break;
-         }
-         notify(DEBUG, "%s antennas in coinc.", nCoinc);
-	 
-         if (nCoinc >= selector_ctl.multiplicity)
-         {
-             for (int ia = 0; ia < n_antenna; ia++) if (Ia1[ia] > 0)
-                 memset(&decision[ia][Ia0[ia]], 0x1, Ia1[ia]);
-
-             j0 = j1-1;
-             ippsAdd_32s_ISfs(Ia1, Ia0, n_antenna, 0);
-         }
-         else
-             Ia0[ant0]++;
+        int a0 = antenna[j0];
+        int n_coinc = 0;
+        int j1;
+        for (j1 = j0; j1 < n_t; j1++)
+        {
+            int a1 = antenna[j1];
+            if ((a1 != a0) && (t[j1]-t[j0] > selector_ctl.distance[a1][a0]))
+                break;
+            if (count[a1]++ == 0)
+                touched[n_coinc++] = a1;
+        }
+
+        if (n_coinc >= selector_ctl.multiplicity)
+        {
+            for (int j = j0; j < j1; j++)
+                decision[antenna[j]][spikes->index[j]] = 1;
+            j0 = j1-1;
+        }
+
+        for (int i = 0; i < n_coinc; i++)
+            count[touched[i]] = 0;
     }
+}
+
+
+int selector_find_coincidences(int n_antenna, int n_time[MAX_ANTENNA], int time[MAX_ANTENNA][MAX_SPIKE], char 
+decision[MAX_ANTENNA][MAX_SPIKE])
+{
+    // Initialise decision.
+    memset(decision, 0x0, MAX_ANTENNA*MAX_SPIKE);
+
+
+    // Merge the times and look for coincs.
+    selector_merge_spikes(n_antenna, n_time, time, &selector_spikes);
+    selector_scan_coincidences(&selector_spikes, decision);
+
+    return 0;
+}
+
+
+#if(USE_IPPS == 1)
+int slipps_find_coincidences(int n_antenna, int n_time[MAX_ANTENNA], int time[MAX_ANTENNA][MAX_SPIKE], char 
+decision[MAX_ANTENNA][MAX_SPIKE])
+{
+    // Initialise decision.
+    ippsZero_8u((Ipp8u*)decision, MAX_ANTENNA*MAX_SPIKE);
+
+
+    // Merge the times and look for coincs.
+    selector_merge_spikes(n_antenna, n_time, time, &selector_spikes);
+    selector_scan_coincidences(&selector_spikes, decision);
 
-    
     return 0;
 }
 #endif
@@ -335,6 +1069,14 @@ int selector_parse_option(char c, char* optarg)
         if (strlen(optarg) > 0)
             selector_ctl.detconfig = optarg;
     }
+    else if (c == 'T')
+    {
+        selector_ctl.n_thread = atoi(optarg);
+        if (selector_ctl.n_thread < 1)
+            selector_ctl.n_thread = 1;
+        else if (selector_ctl.n_thread > MAX_THREAD)
+            selector_ctl.n_thread = MAX_THREAD;
+    }
 
     return 0;
 }
@@ -343,7 +1085,8 @@ int selector_parse_option(char c, char* optarg)
 char selectorhelp[] =
         "* threshold:       the trigger threshold as multiple of standard deviation.\n"
         "* multiplicity:    the minimum number of coincident events required for recording.\n"
-        "* detconfig:       the detector configuration file: delays and distances.\n";
+        "* detconfig:       the detector configuration file: delays and distances.\n"
+        "* threads:         the number of threads for the spike search. Defaults to 1.\n";
 
 char* selector_help_text()
 {
@@ -351,7 +1094,7 @@ char* selector_help_text()
 }
 
 
-char selectorusage[] = "--threshold=[float] --multiplicity=[int] (-detconfig=[char*])";
+char selectorusage[] = "--threshold=[float] --multiplicity=[int] (-detconfig=[char*]) (--threads=[int])";
 
 char* selector_usage_text()
 {
@@ -1,8 +1,15 @@
 #ifndef SELECTOR_H
 #define SELECTOR_H 1
 
+// Set to 0 for building without Intel IPP.
+#ifndef USE_IPPS
+    #define USE_IPPS 1
+#endif
+
+
 #define MAX_ANTENNA 80
 #define MAX_SPIKE   256
+#define MAX_THREAD  32
 #define SAMPLE_SIZE 1024
 #define TIME_SIZE   4
 
@@ -19,21 +26,31 @@
 #define SELECTOR_LONG_OPTIONS \
     {"threshold",    required_argument, 0, 't'},\
     {"multiplicity", required_argument, 0, 'm'},\
-    {"detconfig",    required_argument, 0, 'C'}
+    {"detconfig",    required_argument, 0, 'C'},\
+    {"threads",      required_argument, 0, 'T'}
+
+#define SELECTOR_GETOPT_DESCRIPTOR "t:m:C:T:"
+
 
-#define SELECTOR_GETOPT_DESCRIPTOR "t:m:C:"
+typedef float (*selector_spike_algo)(int n_data, unsigned char* data, int* n_time, int time[MAX_SPIKE]);
 
 
 float* selector_threshold();
 int* selector_multiplicity();
 char** selector_config();
+int* selector_threads();
 
 int selector_initialise(int n_antenna, int antenna_id[MAX_ANTENNA]);
+int selector_cluster(int n_antenna, int n_cluster, int seed[], int cluster[MAX_ANTENNA]);
+int selector_geometry(float delay[MAX_ANTENNA], float position[MAX_ANTENNA][3]);
+int selector_close();
 
 float slipps_find_spikes(int n_data, unsigned char* data, int* n_time, int time[MAX_SPIKE]);
 int slipps_find_coincidences(int n_antenna, int n_time[MAX_ANTENNA], int time[MAX_ANTENNA][MAX_SPIKE], char 
 decision[MAX_ANTENNA][MAX_SPIKE]);
 float selector_find_spikes(int n_data, unsigned char* data, int* n_time, int time[MAX_SPIKE]);
+float selector_simd_find_spikes(int n_data, unsigned char* data, int* n_time, int time[MAX_SPIKE]);
+float selector_parallel_find_spikes(selector_spike_algo algo, int n_data, unsigned char* data, int* n_time, int time[MAX_SPIKE]);
 int selector_find_coincidences(int n_antenna, int n_time[MAX_ANTENNA], int time[MAX_ANTENNA][MAX_SPIKE], char 
 decision[MAX_ANTENNA][MAX_SPIKE]);
 
@@ -97,6 +97,21 @@ int simdaq_copy_data(unsigned char* data, int length)
 }
 
 
+unsigned char* simdaq_map_data(int length)
+{
+    if (length > SIMDAQ_SIZE)
+    {
+        notify(ERROR, "In simdaq_map_data: length %d exceeds the simulation buffer (%d)", length, SIMDAQ_SIZE);
+        return NULL;
+    }
+
+    if (simdaq_copy_data(simdaq_ctl.buffer, length) < 0)
+        return NULL;
+
+    return simdaq_ctl.buffer;
+}
+
+
 int simdaq_close()
 {
     if (simdaq_ctl.fid != NULL)
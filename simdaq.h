@@ -12,6 +12,7 @@ int simdaq_synchronise();
 int simdaq_counter();
 unsigned char* simdaq_data();
 int simdaq_copy_data(unsigned char* data, int length);
+unsigned char* simdaq_map_data(int length);
 int simdaq_close();
 
 int simdaq_irq();
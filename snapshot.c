@@ -26,7 +26,11 @@
 #include "selector.h"
 
 
-#define SPIKE_ALGO  slipps_find_spikes
+#if(USE_IPPS == 1)
+    #define SPIKE_ALGO  slipps_find_spikes
+#else
+    #define SPIKE_ALGO  selector_simd_find_spikes
+#endif
 
 
 //========================================================================================
@@ -69,7 +73,8 @@ int main( int argsc, char *argsv[] )
 
 
     // Initialize the DAQ.
-    (*notifier_host()) = master_host;
+    if (*notifier_host() == NULL)
+        (*notifier_host()) = master_host;
     if (daq_start() < 0)
         return -1;
 
@@ -116,7 +121,7 @@ int main( int argsc, char *argsv[] )
 
         // Find candidate spikes.
         gettimeofday(&tsync, NULL);
-        SPIKE_ALGO(daq_buffer_size(), data, &n_time, time);
+        selector_parallel_find_spikes(SPIKE_ALGO, daq_buffer_size(), data, &n_time, time);
 
         // Log the loop status.
         int irq_stop = daq_counter();
@@ -146,8 +151,11 @@ int main( int argsc, char *argsv[] )
     }
 	
 
-    // Close the DAQ.
+    // Close the DAQ and the spike search threads, and flush the data files.
     daq_close();	
+    selector_close();
+    dw_close();
+    notifier_close();
 
 
     return( 0 );
@@ -189,12 +197,14 @@ int parse_inputs(int argsc, char** argsv, char** runid)
             SELECTOR_LONG_OPTIONS,
             DAQ_LONG_OPTIONS,
 	    DW_LONG_OPTIONS,
-	    LOGGER_LONG_OPTIONS
+	    LOGGER_LONG_OPTIONS,
+	    NOTIFIER_LONG_OPTIONS
         };
 
         int option_index = 0;
         c = getopt_long(argsc, argsv, 
-	    "hr:" SELECTOR_GETOPT_DESCRIPTOR DAQ_GETOPT_DESCRIPTOR DW_GETOPT_DESCRIPTOR LOGGER_GETOPT_DESCRIPTOR,
+	    "hr:" SELECTOR_GETOPT_DESCRIPTOR DAQ_GETOPT_DESCRIPTOR DW_GETOPT_DESCRIPTOR LOGGER_GETOPT_DESCRIPTOR
+	    NOTIFIER_GETOPT_DESCRIPTOR,
 	    long_options, &option_index
 	);
 
@@ -213,6 +223,7 @@ int parse_inputs(int argsc, char** argsv, char** runid)
            daq_parse_option(c, optarg);
 	   dw_parse_option(c, optarg);
 	   logger_parse_option(c, optarg);
+	   notifier_parse_option(c, optarg);
 	}
     }
 
@@ -235,12 +246,14 @@ void print_usage(char* proccess)
 //========================================================================================
 {
     printf(
-        "Usage: %s --runid=[int] %s %s %s %s\n"
+        "Usage: %s --runid=[int] %s %s %s %s %s\n"
         "* runid:           the runnumber for the data file name.\n",
-        proccess, selector_usage_text(), daq_usage_text(), dw_usage_text(), logger_usage_text()
+        proccess, selector_usage_text(), daq_usage_text(), dw_usage_text(), logger_usage_text(),
+        notifier_usage_text()
     );
     printf(selector_help_text());
     printf(daq_help_text());
     printf(dw_help_text());
     printf(logger_help_text());
+    printf(notifier_help_text());
 }
@@ -0,0 +1,202 @@
+//======================================================================================
+//
+//  stats-monitor.c
+//
+//======================================================================================
+//
+//  Live view of the acquisition loop statistics of a running trigger: the latency
+//  distribution of each loop stage and the loop counters, read from the shared page of
+//  the stats module. The trigger is never blocked nor slowed down by the monitor.
+//
+//======================================================================================
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdio.h>
+
+#include "logger.h"
+#include "stats.h"
+
+
+//========================================================================================
+//
+//  Subroutines prototypes.
+//
+//========================================================================================
+
+// Parse the input arguments.
+int parse_inputs(int argsc, char** argsv);
+
+// Show help text on usage.
+void print_usage(char* process);
+
+
+//========================================================================================
+//
+//  Settings.
+//
+//========================================================================================
+
+struct {
+    char*  program;
+    int    host;
+    double interval;
+} monitor_ctl = {
+    "online-trigger",
+    -1,
+    0.0
+};
+
+
+static stats_page_t monitor_current;
+static stats_page_t monitor_previous;
+
+
+static void monitor_print(stats_page_t* page, stats_page_t* previous, double dt)
+{
+    // A page left over by a killed trigger is flagged stopped.
+    int alive = (kill(page->pid, 0) == 0) || (errno == EPERM);
+    printf("# A%04d pid=%d up=%lds%s\n", page->host, page->pid, (long)(time(NULL)-page->start),
+        alive ? "" : " (stopped)");
+    printf("%-10s %10s %10s %10s %10s %10s %10s %10s  (ms)\n", "stage", "count", "mean", "p50", "p90", "p99",
+        "p99.9", "max");
+    for (int i = 0; i < STATS_N_STAGE; i++)
+    {
+        stats_histogram_t* h = page->stage+i;
+        if (h->count == 0)
+            continue;
+        printf("%-10s %10llu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", stats_stage_name(i),
+            (unsigned long long)h->count, 1.0e-06*h->sum/h->count, 1.0e+03*stats_quantile(h, 0.5),
+            1.0e+03*stats_quantile(h, 0.9), 1.0e+03*stats_quantile(h, 0.99), 1.0e+03*stats_quantile(h, 0.999),
+            1.0e-06*h->max);
+    }
+
+    for (int i = 0; i < STATS_N_COUNTER; i++)
+    {
+        printf("%-10s %10llu", stats_counter_name(i), (unsigned long long)page->counter[i]);
+        if (previous != NULL)
+            printf(" %10.1f /s", (page->counter[i]-previous->counter[i])/dt);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+
+//========================================================================================
+int main(int argsc, char *argsv[])
+//========================================================================================
+{
+    if (parse_inputs(argsc, argsv) < 0)
+        exit(0);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/trend_%s_A%04d", monitor_ctl.program, monitor_ctl.host);
+    stats_page_t* page = stats_attach(name);
+    if (page == NULL)
+        return -1;
+
+
+    // Print a snapshot, or refresh it periodically with the counter rates.
+    if (stats_snapshot(page, &monitor_current) < 0)
+    {
+        notify(ERROR, "Couldn't get a consistent snapshot of %s.", name);
+        return -1;
+    }
+    monitor_print(&monitor_current, NULL, 0.0);
+
+    while (monitor_ctl.interval > 0.0)
+    {
+        usleep((useconds_t)(1.0e+06*monitor_ctl.interval));
+        monitor_previous = monitor_current;
+        if (stats_snapshot(page, &monitor_current) < 0)
+            continue;
+        if (monitor_current.pid != monitor_previous.pid)
+            break;
+        printf("\n");
+        monitor_print(&monitor_current, &monitor_previous, monitor_ctl.interval);
+    }
+
+    return 0;
+}
+
+
+//================================================================
+int parse_inputs(int argsc, char** argsv)
+//================================================================
+//
+//  Parse the inputs arguments.
+//
+//================================================================
+{
+    char c;
+
+    // Parse the command line.
+    while (1)
+    {
+        static struct option long_options[] =
+        {
+            {"help",          no_argument,       0, 'h'},
+            {"program",       required_argument, 0, 'p'},
+            {"antenna",       required_argument, 0, 'a'},
+            {"interval",      required_argument, 0, 'i'},
+	    LOGGER_LONG_OPTIONS,
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        c = getopt_long(argsc, argsv, "hp:a:i:" LOGGER_GETOPT_DESCRIPTOR, long_options, &option_index);
+
+        if (c == -1)
+            break;
+        else if (c == 'h')
+        {
+            print_usage(argsv[0]);
+            return(-1);
+        }
+        else if (c == 'p')
+            monitor_ctl.program = optarg;
+        else if (c == 'a')
+            monitor_ctl.host = atoi(optarg);
+        else if (c == 'i')
+            monitor_ctl.interval = atof(optarg);
+        else
+           logger_parse_option(c, optarg);
+    }
+
+    // The antenna defaults to the one of this host.
+    if (monitor_ctl.host < 0)
+    {
+        char host[64];
+        if (gethostname(host, sizeof(host)) == 0)
+            monitor_ctl.host = atoi(host+1);
+    }
+    if ((monitor_ctl.host < 0) || (monitor_ctl.interval < 0.0))
+    {
+        print_usage(argsv[0]);
+        return(-1);
+    }
+    return(0);
+}
+
+
+//================================================================
+void print_usage(char* proccess)
+//================================================================
+//
+//  Show help text on usage.
+//
+//================================================================
+{
+    printf(
+        "Usage: %s (--program=[char*]) (--antenna=[int]) (--interval=[double]) %s\n"
+        "* program:         the monitored program. Defaults to online-trigger.\n"
+        "* antenna:         the antenna number, as in the data file names. Defaults to this host's.\n"
+        "* interval:        the refresh period, in seconds. Defaults to a single snapshot.\n",
+        proccess, logger_usage_text()
+    );
+    printf(logger_help_text());
+}
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "stats.h"
+#include "logger.h"
+
+//========================================================================================
+//
+//  Instrumentation of the acquisition loops: stage latencies and counters, kept in a
+//  page of shared memory, /dev/shm/trend_<program>_A<host>, which monitors map read
+//  only. The latencies are histogrammed with a log-linear binning, 2^STATS_SUB_BITS
+//  buckets per octave, i.e. a 6% resolution from 1 ns to beyond an hour.
+//
+//  There is a single writer, the acquisition loop. Its updates are enclosed in a
+//  sequence lock: the sequence number is odd while an update is in progress, and a
+//  reader retries its copy if the number was odd or changed meanwhile. Neither side
+//  ever blocks.
+//
+//========================================================================================
+
+static char* stats_stages[STATS_N_STAGE] = {"sync", "search", "send", "decision", "copy", "write", "loop"};
+static char* stats_counters[STATS_N_COUNTER] = {"loops", "buffers", "lost", "invalid", "spikes", "saves"};
+
+
+struct {
+    stats_page_t* page;
+    int           shared;
+    char          name[64];
+} stats_ctl = {
+    NULL,
+    0
+};
+
+
+int stats_open(char* program, int host)
+{
+    stats_close();
+    snprintf(stats_ctl.name, sizeof(stats_ctl.name), "/trend_%s_A%04d", program, host);
+
+
+    // Map the page in shared memory, or else in private memory.
+    stats_page_t* page = MAP_FAILED;
+    int fd = shm_open(stats_ctl.name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if ((fd >= 0) && (ftruncate(fd, sizeof(stats_page_t)) == 0))
+        page = mmap(NULL, sizeof(stats_page_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0)
+        close(fd);
+
+    if (page == MAP_FAILED)
+    {
+        notify(WARNING, "Couldn't share the statistics as %s, keeping them private.", stats_ctl.name);
+        shm_unlink(stats_ctl.name);
+        page = calloc(1, sizeof(stats_page_t));
+        if (page == NULL)
+        {
+            notify(ERROR, "Could not allocate memory for the statistics.");
+            return(-1);
+        }
+        stats_ctl.shared = 0;
+    }
+    else
+    {
+        memset(page, 0x0, sizeof(stats_page_t));
+        stats_ctl.shared = 1;
+    }
+
+    memcpy(page->magic, STATS_MAGIC, sizeof(page->magic));
+    page->version = STATS_VERSION;
+    page->size    = sizeof(stats_page_t);
+    page->pid     = getpid();
+    page->host    = host;
+    page->start   = time(NULL);
+    stats_ctl.page = page;
+
+    return(0);
+}
+
+
+void stats_close()
+{
+    if (stats_ctl.page == NULL)
+        return;
+
+    if (stats_ctl.shared)
+    {
+        munmap(stats_ctl.page, sizeof(stats_page_t));
+        shm_unlink(stats_ctl.name);
+    }
+    else
+        free(stats_ctl.page);
+    stats_ctl.page = NULL;
+}
+
+
+uint64_t stats_clock()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000ULL+t.tv_nsec;
+}
+
+
+static int stats_bucket(uint64_t ns)
+{
+    if (ns < (1 << STATS_SUB_BITS))
+        return (int)ns;
+
+    int e = 63-__builtin_clzll(ns);
+    int b = ((e-STATS_SUB_BITS+1) << STATS_SUB_BITS)+(int)((ns >> (e-STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS)-1));
+
+    return (b < STATS_N_BUCKET) ? b : STATS_N_BUCKET-1;
+}
+
+
+static double stats_bucket_value(int b)
+{
+    // Middle of the bucket, in unit ns.
+    if (b < (1 << STATS_SUB_BITS))
+        return b;
+
+    int e = (b >> STATS_SUB_BITS)+STATS_SUB_BITS-1;
+    double width = ldexp(1.0, e-STATS_SUB_BITS);
+    return ldexp(1.0, e)+((b & ((1 << STATS_SUB_BITS)-1))+0.5)*width;
+}
+
+
+static inline void stats_begin()
+{
+    __atomic_add_fetch(&stats_ctl.page->sequence, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static inline void stats_end()
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_add_fetch(&stats_ctl.page->sequence, 1, __ATOMIC_RELEASE);
+}
+
+
+void stats_record(int stage, uint64_t ns)
+{
+    if ((stats_ctl.page == NULL) || (stage < 0) || (stage >= STATS_N_STAGE))
+        return;
+
+    stats_histogram_t* h = stats_ctl.page->stage+stage;
+    stats_begin();
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->bucket[stats_bucket(ns)]++;
+    stats_end();
+}
+
+
+uint64_t stats_lap(int stage, uint64_t* t)
+{
+    // Record the time elapsed since *t and restart from now.
+    uint64_t now = stats_clock();
+    uint64_t dt  = now-*t;
+    stats_record(stage, dt);
+    *t = now;
+
+    return dt;
+}
+
+
+void stats_count(int counter, uint64_t n)
+{
+    if ((stats_ctl.page == NULL) || (counter < 0) || (counter >= STATS_N_COUNTER))
+        return;
+
+    stats_begin();
+    stats_ctl.page->counter[counter] += n;
+    stats_end();
+}
+
+
+stats_page_t* stats_attach(char* name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        notify(ERROR, "Couldn't open the statistics %s.", name);
+        return NULL;
+    }
+
+    stats_page_t* page = mmap(NULL, sizeof(stats_page_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ((page == MAP_FAILED) || (memcmp(page->magic, STATS_MAGIC, sizeof(page->magic)) != 0) ||
+        (page->version != STATS_VERSION) || (page->size != sizeof(stats_page_t)))
+    {
+        notify(ERROR, "Invalid statistics %s.", name);
+        if (page != MAP_FAILED)
+            munmap(page, sizeof(stats_page_t));
+        return NULL;
+    }
+
+    return page;
+}
+
+
+int stats_snapshot(stats_page_t* page, stats_page_t* copy)
+{
+    // Consistent copy of a page being updated by its writer.
+    for (int i = 0; i < 1000; i++)
+    {
+        uint32_t s0 = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        if (s0 & 0x1)
+            continue;
+        memcpy(copy, page, sizeof(stats_page_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE) == s0)
+            return(0);
+    }
+
+    return(-1);
+}
+
+
+double stats_quantile(stats_histogram_t* histogram, double q)
+{
+    // In unit second.
+    if (histogram->count == 0)
+        return 0.0;
+
+    uint64_t rank = (uint64_t)(q*(histogram->count-1))+1;
+    uint64_t n = 0;
+    for (int b = 0; b < STATS_N_BUCKET; b++)
+    {
+        n += histogram->bucket[b];
+        if (n >= rank)
+        {
+            double v = stats_bucket_value(b);
+            return 1.0e-09*((v < histogram->max) ? v : histogram->max);
+        }
+    }
+
+    return 1.0e-09*histogram->max;
+}
+
+
+char* stats_stage_name(int stage)
+{
+    return ((stage >= 0) && (stage < STATS_N_STAGE)) ? stats_stages[stage] : "?";
+}
+
+
+char* stats_counter_name(int counter)
+{
+    return ((counter >= 0) && (counter < STATS_N_COUNTER)) ? stats_counters[counter] : "?";
+}
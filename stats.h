@@ -0,0 +1,56 @@
+#ifndef STATS_H
+#define STATS_H 1
+
+#include <stdint.h>
+
+// Histogram resolution: 2^STATS_SUB_BITS buckets per octave of nanoseconds.
+#define STATS_SUB_BITS  4
+#define STATS_N_BUCKET  640
+
+#define STATS_MAGIC     "TRENDSTA"
+#define STATS_VERSION   1
+
+
+enum StatsStage {STATS_SYNC, STATS_SEARCH, STATS_SEND, STATS_DECISION, STATS_COPY, STATS_WRITE, STATS_LOOP,
+    STATS_N_STAGE};
+enum StatsCounter {STATS_LOOPS, STATS_BUFFERS, STATS_LOST, STATS_INVALID, STATS_SPIKES, STATS_SAVES,
+    STATS_N_COUNTER};
+
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;                   // in unit ns
+    uint64_t max;
+    uint64_t bucket[STATS_N_BUCKET];
+} stats_histogram_t;
+
+
+typedef struct {
+    char              magic[8];
+    uint32_t          version;
+    uint32_t          size;
+    int32_t           pid;
+    int32_t           host;
+    int64_t           start;        // unix time
+    uint32_t          sequence;     // odd while an update is in progress
+    uint32_t          reserved;
+    uint64_t          counter[STATS_N_COUNTER];
+    stats_histogram_t stage[STATS_N_STAGE];
+} stats_page_t;
+
+
+int stats_open(char* program, int host);
+void stats_close();
+
+uint64_t stats_clock();
+uint64_t stats_lap(int stage, uint64_t* t);
+void stats_record(int stage, uint64_t ns);
+void stats_count(int counter, uint64_t n);
+
+stats_page_t* stats_attach(char* name);
+int stats_snapshot(stats_page_t* page, stats_page_t* copy);
+double stats_quantile(stats_histogram_t* histogram, double q);
+char* stats_stage_name(int stage);
+char* stats_counter_name(int counter);
+
+#endif
@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include "synthdaq.h"
+#include "selector.h"
+#include "logger.h"
+
+//========================================================================================
+//
+//  Synthetic ADC stream for the emulated DMA of apexsim. Each sample is
+//
+//      baseline + gaussian noise + narrowband RFI + pulses
+//
+//  rounded and clipped to 8 bits. The noise is drawn from a table of the quantiles of the
+//  normal law, indexed by SYNTHDAQ_NOISE_BITS random bits, which truncates it around 4.9
+//  sigma. The random bits come from SYNTHDAQ_LANES independent xorshift128+ generators
+//  updated together, which the compiler turns into SIMD instructions. The RFI is a sine
+//  from a phase accumulator. Bipolar pulses, the derivative of a gaussian, are injected
+//  at the times of a Poisson process with uniform amplitudes.
+//
+//  Air showers are emulated as plane waves of isotropic directions, also at Poisson
+//  times. The antenna positions are recovered from the distances of the detector
+//  configuration, see selector_geometry, and the pulse of each antenna is shifted by its
+//  light travel time and cable delay. All antennas share the random sequence of the
+//  showers so that the pulses injected in separate processes are coincident.
+//
+//  The injected pulses are written to the truth file <data_dir>/A<host>.truth, with the
+//  index of their shower or -1 for isolated pulses. The options are given as a comma
+//  separated list of key=value, e.g. "sigma=10,rate=100,showers=5,rfi=27e6". The stream
+//  only depends on them and on the antenna, so that runs are reproducible.
+//
+//========================================================================================
+
+#define SYNTHDAQ_LANES 8
+#define SYNTHDAQ_RFI_BITS 12
+
+
+struct {
+    // Options.
+    double     baseline;
+    double     sigma;
+    double     pulse_rate;              // Hz
+    double     amplitude_min;
+    double     amplitude_max;
+    double     width;                   // samples
+    double     rfi_frequency;           // Hz
+    double     rfi_amplitude;
+    double     shower_rate;             // Hz
+    unsigned   seed;
+    int        antenna;
+
+    // Generator state.
+    uint64_t   s0[SYNTHDAQ_LANES];
+    uint64_t   s1[SYNTHDAQ_LANES];
+    uint64_t   pulse_state[2];
+    uint64_t   shower_state[2];
+    int8_t*    noise;
+    int16_t    rfi[1 << SYNTHDAQ_RFI_BITS];
+    uint32_t   rfi_phase;
+    uint32_t   rfi_step;
+    int16_t*   work;
+    long       work_size;
+
+    float*     shape;
+    int        half_width;
+    double     sample_rate;
+    double     next_pulse;
+    double     next_shower;
+    float      position[3];             // in unit sample
+    float      delay;
+    long long  shower_time;             // of the pending shower at this antenna
+    float      shower_amplitude;
+    long long  n_shower;
+    int        n_pending;
+    long long  pending_time[SYNTHDAQ_MAX_PENDING];
+    float      pending_amplitude[SYNTHDAQ_MAX_PENDING];
+    long long  n_pulse;
+
+    FILE*      truth;
+} synthdaq_ctl = {
+    128.0,
+    10.0,
+    100.0,
+    20.0,
+    100.0,
+    2.0,
+    0.0,
+    0.0,
+    0.0,
+    1
+};
+
+
+static inline uint64_t synthdaq_next(uint64_t* s0, uint64_t* s1)
+{
+    // xorshift128+
+    uint64_t x = *s0;
+    uint64_t y = *s1;
+    *s0 = y;
+    x ^= x << 23;
+    *s1 = x ^ y ^ (x >> 17) ^ (y >> 26);
+    return *s1+y;
+}
+
+
+static double synthdaq_uniform(uint64_t state[2])
+{
+    return ((synthdaq_next(&state[0], &state[1]) >> 11)+0.5)*(1.0/9007199254740992.0);
+}
+
+
+static double synthdaq_quantile(double p)
+{
+    // Inverse of the normal law by Newton's method, which converges monotonically from 0
+    // below the median.
+    if (p > 0.5)
+        return -synthdaq_quantile(1.0-p);
+
+    double x = 0.0;
+    for (int i = 0; i < 100; i++)
+    {
+        double dx = (0.5*erfc(-x/M_SQRT2)-p)/(exp(-0.5*x*x)/sqrt(2.0*M_PI));
+        x -= dx;
+        if (fabs(dx) < 1.0e-12)
+            break;
+    }
+
+    return x;
+}
+
+
+static int synthdaq_parse(char* options)
+{
+    char* copy = strdup(options);
+    char* save = NULL;
+    int   ret  = 0;
+
+    for (char* token = strtok_r(copy, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+    {
+        char   key[32];
+        double value;
+        if (sscanf(token, "%31[^=]=%lf", key, &value) != 2)
+        {
+            notify(ERROR, "Invalid synthetic DAQ option %s.", token);
+            ret = -1;
+        }
+        else if (strcmp(key, "baseline") == 0)
+            synthdaq_ctl.baseline = value;
+        else if (strcmp(key, "sigma") == 0)
+            synthdaq_ctl.sigma = value;
+        else if (strcmp(key, "rate") == 0)
+            synthdaq_ctl.pulse_rate = value;
+        else if (strcmp(key, "amin") == 0)
+            synthdaq_ctl.amplitude_min = value;
+        else if (strcmp(key, "amax") == 0)
+            synthdaq_ctl.amplitude_max = value;
+        else if (strcmp(key, "width") == 0)
+            synthdaq_ctl.width = value;
+        else if (strcmp(key, "rfi") == 0)
+            synthdaq_ctl.rfi_frequency = value;
+        else if (strcmp(key, "rfiamp") == 0)
+            synthdaq_ctl.rfi_amplitude = value;
+        else if (strcmp(key, "showers") == 0)
+            synthdaq_ctl.shower_rate = value;
+        else if (strcmp(key, "seed") == 0)
+            synthdaq_ctl.seed = (unsigned)value;
+        else
+        {
+            notify(ERROR, "Unknown synthetic DAQ option %s.", key);
+            ret = -1;
+        }
+    }
+    free(copy);
+
+    if ((synthdaq_ctl.sigma < 0.0) || (synthdaq_ctl.width <= 0.0) || (synthdaq_ctl.pulse_rate < 0.0) ||
+        (synthdaq_ctl.shower_rate < 0.0) ||
+        (synthdaq_ctl.amplitude_max < synthdaq_ctl.amplitude_min))
+    {
+        notify(ERROR, "Inconsistent synthetic DAQ options %s.", options);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+
+static void synthdaq_inject(long long t, float a, long long shower)
+{
+    if (t < 0)
+        return;
+    if (synthdaq_ctl.n_pending == SYNTHDAQ_MAX_PENDING)
+    {
+        notify(WARNING, "Too many overlapping synthetic pulses, dropping the one at %lld.", t);
+        return;
+    }
+    synthdaq_ctl.pending_time[synthdaq_ctl.n_pending]      = t;
+    synthdaq_ctl.pending_amplitude[synthdaq_ctl.n_pending] = a;
+    synthdaq_ctl.n_pending++;
+    synthdaq_ctl.n_pulse++;
+
+    if (synthdaq_ctl.truth != NULL)
+        fprintf(synthdaq_ctl.truth, "%lld %lld %lld %.2f %lld\n", t, t/APEXSIM_SIZE+1, t % APEXSIM_SIZE, a, shower);
+}
+
+
+static void synthdaq_next_shower()
+{
+    // Draw the next shower: reference time, direction and amplitude, and compute its
+    // arrival time at this antenna.
+    double T = synthdaq_ctl.next_shower;
+    synthdaq_ctl.next_shower -= synthdaq_ctl.sample_rate/synthdaq_ctl.shower_rate*log(synthdaq_uniform(synthdaq_ctl.shower_state));
+
+    double cos_theta = 2.0*synthdaq_uniform(synthdaq_ctl.shower_state)-1.0;
+    double sin_theta = sqrt(1.0-cos_theta*cos_theta);
+    double phi       = 2.0*M_PI*synthdaq_uniform(synthdaq_ctl.shower_state);
+    double u[3]      = {sin_theta*cos(phi), sin_theta*sin(phi), cos_theta};
+    synthdaq_ctl.shower_amplitude = synthdaq_ctl.amplitude_min+
+        (synthdaq_ctl.amplitude_max-synthdaq_ctl.amplitude_min)*synthdaq_uniform(synthdaq_ctl.shower_state);
+
+    double dt = synthdaq_ctl.delay;
+    for (int k = 0; k < 3; k++)
+        dt += u[k]*synthdaq_ctl.position[k];
+    synthdaq_ctl.shower_time = llrint(T+dt);
+}
+
+
+static void synthdaq_schedule(long long end)
+{
+    // Draw the isolated pulses peaking before end.
+    double period = synthdaq_ctl.sample_rate/synthdaq_ctl.pulse_rate;
+    while ((synthdaq_ctl.pulse_rate > 0.0) && (synthdaq_ctl.next_pulse < end))
+    {
+        long long t = (long long)synthdaq_ctl.next_pulse;
+        float a = synthdaq_ctl.amplitude_min+
+            (synthdaq_ctl.amplitude_max-synthdaq_ctl.amplitude_min)*synthdaq_uniform(synthdaq_ctl.pulse_state);
+        synthdaq_ctl.next_pulse -= period*log(synthdaq_uniform(synthdaq_ctl.pulse_state));
+        synthdaq_inject(t, a, -1);
+    }
+
+    // And the showers.
+    while ((synthdaq_ctl.shower_rate > 0.0) && (synthdaq_ctl.shower_time < end))
+    {
+        synthdaq_inject(synthdaq_ctl.shower_time, synthdaq_ctl.shower_amplitude, synthdaq_ctl.n_shower++);
+        synthdaq_next_shower();
+    }
+}
+
+
+static int synthdaq_fill(unsigned char* data, long n, long long position)
+{
+    if (n > synthdaq_ctl.work_size)
+    {
+        free(synthdaq_ctl.work);
+        synthdaq_ctl.work_size = n+3*SYNTHDAQ_LANES;
+        synthdaq_ctl.work      = malloc(synthdaq_ctl.work_size*sizeof(int16_t));
+        if (synthdaq_ctl.work == NULL)
+        {
+            notify(ERROR, "Could not allocate memory for the synthetic DAQ.");
+            synthdaq_ctl.work_size = 0;
+            return(-1);
+        }
+    }
+    int16_t* restrict w = synthdaq_ctl.work;
+
+
+    // Noise, three samples per random number and lane.
+    const int8_t* noise = synthdaq_ctl.noise;
+    const uint64_t mask = (1 << SYNTHDAQ_NOISE_BITS)-1;
+    for (long i = 0; i < n; i += 3*SYNTHDAQ_LANES)
+    {
+        uint64_t r[SYNTHDAQ_LANES];
+        for (int l = 0; l < SYNTHDAQ_LANES; l++)
+            r[l] = synthdaq_next(&synthdaq_ctl.s0[l], &synthdaq_ctl.s1[l]);
+        for (int l = 0; l < SYNTHDAQ_LANES; l++)
+        {
+            w[i+l]                  = noise[r[l] & mask];
+            w[i+l+SYNTHDAQ_LANES]   = noise[(r[l] >> SYNTHDAQ_NOISE_BITS) & mask];
+            w[i+l+2*SYNTHDAQ_LANES] = noise[(r[l] >> 2*SYNTHDAQ_NOISE_BITS) & mask];
+        }
+    }
+
+
+    // Narrowband RFI.
+    if (synthdaq_ctl.rfi_step != 0)
+    {
+        uint32_t phase = synthdaq_ctl.rfi_phase;
+        for (long i = 0; i < n; i++)
+        {
+            w[i]  += synthdaq_ctl.rfi[phase >> (32-SYNTHDAQ_RFI_BITS)];
+            phase += synthdaq_ctl.rfi_step;
+        }
+        synthdaq_ctl.rfi_phase = phase;
+    }
+
+
+    // Pulses overlapping the block. Those extending beyond it are kept for the next one.
+    const int h = synthdaq_ctl.half_width;
+    synthdaq_schedule(position+n+h);
+    int n_pending = 0;
+    for (int i = 0; i < synthdaq_ctl.n_pending; i++)
+    {
+        long long t = synthdaq_ctl.pending_time[i];
+        float     a = synthdaq_ctl.pending_amplitude[i];
+        long j0 = (t-h > position) ? t-h-position : 0;
+        long j1 = (t+h < position+n) ? t+h-position+1 : n;
+        for (long j = j0; j < j1; j++)
+            w[j] += lrintf(a*synthdaq_ctl.shape[position+j-t+h]);
+
+        if (t+h >= position+n)
+        {
+            synthdaq_ctl.pending_time[n_pending]      = t;
+            synthdaq_ctl.pending_amplitude[n_pending] = a;
+            n_pending++;
+        }
+    }
+    synthdaq_ctl.n_pending = n_pending;
+
+
+    // Baseline and 8 bit clipping.
+    const int baseline = lrint(synthdaq_ctl.baseline);
+    for (long i = 0; i < n; i++)
+    {
+        int x = w[i]+baseline;
+        data[i] = (x < 0) ? 0 : (x > 255) ? 255 : x;
+    }
+
+    // Keep the truth up to date with the buffers, should the process be killed.
+    if ((synthdaq_ctl.truth != NULL) && ((position+n) % APEXSIM_SIZE == 0))
+        fflush(synthdaq_ctl.truth);
+
+    return 0;
+}
+
+
+static void synthdaq_seed(uint64_t z, uint64_t* s0, uint64_t* s1)
+{
+    // splitmix64
+    uint64_t s[2];
+    for (int k = 0; k < 2; k++)
+    {
+        uint64_t x = z+(k+1)*0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+        s[k] = x ^ (x >> 31);
+    }
+    *s0 = s[0];
+    *s1 = s[1];
+}
+
+
+int synthdaq_init(char* data_dir, char* options, int antenna)
+{
+    if ((options != NULL) && (synthdaq_parse(options) < 0))
+        return -1;
+
+    // Default to the antenna of the host.
+    if (antenna < 0)
+    {
+        char hostname[8] = "u000";
+        gethostname(hostname, sizeof(hostname));
+        antenna = atoi(hostname+1)-ANTENNA_ID_OFFSET;
+    }
+    synthdaq_ctl.antenna = antenna;
+
+
+    // Seed the generators from the seed option, and the antenna but for the showers.
+    uint64_t z = 0x100000000ULL*synthdaq_ctl.seed+(uint32_t)antenna;
+    for (int l = 0; l < SYNTHDAQ_LANES; l++)
+        synthdaq_seed(z*(SYNTHDAQ_LANES+2)+l, &synthdaq_ctl.s0[l], &synthdaq_ctl.s1[l]);
+    synthdaq_seed(z*(SYNTHDAQ_LANES+2)+SYNTHDAQ_LANES, &synthdaq_ctl.pulse_state[0], &synthdaq_ctl.pulse_state[1]);
+    synthdaq_seed(~(uint64_t)synthdaq_ctl.seed, &synthdaq_ctl.shower_state[0], &synthdaq_ctl.shower_state[1]);
+
+
+    // Tables.
+    const int n_noise = 1 << SYNTHDAQ_NOISE_BITS;
+    synthdaq_ctl.noise = malloc(n_noise*sizeof(int8_t));
+    synthdaq_ctl.half_width = (int)ceil(6.0*synthdaq_ctl.width);
+    synthdaq_ctl.shape = malloc((2*synthdaq_ctl.half_width+1)*sizeof(float));
+    if ((synthdaq_ctl.noise == NULL) || (synthdaq_ctl.shape == NULL))
+    {
+        notify(ERROR, "Could not allocate memory for the synthetic DAQ.");
+        synthdaq_close();
+        return -1;
+    }
+
+    for (int i = 0; i < n_noise; i++)
+    {
+        long x = lrint(synthdaq_ctl.sigma*synthdaq_quantile((i+0.5)/n_noise));
+        synthdaq_ctl.noise[i] = (x < -127) ? -127 : (x > 127) ? 127 : x;
+    }
+
+    // Normalised so that the positive lobe peaks at 1, at the pulse time.
+    for (int j = -synthdaq_ctl.half_width; j <= synthdaq_ctl.half_width; j++)
+    {
+        double u = j/synthdaq_ctl.width-1.0;
+        synthdaq_ctl.shape[j+synthdaq_ctl.half_width] = -u*exp(0.5*(1.0-u*u));
+    }
+
+    synthdaq_ctl.sample_rate = (*apexsim_rate() > 0.0) ? *apexsim_rate() : APEXSIM_DEFAULT_RATE;
+    synthdaq_ctl.rfi_phase   = 0;
+    synthdaq_ctl.rfi_step    = (uint32_t)llrint(synthdaq_ctl.rfi_frequency/synthdaq_ctl.sample_rate*4294967296.0);
+    for (int i = 0; i < (1 << SYNTHDAQ_RFI_BITS); i++)
+        synthdaq_ctl.rfi[i] = lrint(synthdaq_ctl.rfi_amplitude*sin(2.0*M_PI*i/(1 << SYNTHDAQ_RFI_BITS)));
+
+    synthdaq_ctl.n_pending  = 0;
+    synthdaq_ctl.n_pulse    = 0;
+    synthdaq_ctl.next_pulse = 0.0;
+    if (synthdaq_ctl.pulse_rate > 0.0)
+        synthdaq_ctl.next_pulse = -synthdaq_ctl.sample_rate/synthdaq_ctl.pulse_rate*log(synthdaq_uniform(synthdaq_ctl.pulse_state));
+
+
+    // Geometry of the antenna, in unit sample, for the showers.
+    synthdaq_ctl.n_shower = 0;
+    if (synthdaq_ctl.shower_rate > 0.0)
+    {
+        float delay[MAX_ANTENNA];
+        float position[MAX_ANTENNA][3];
+        if ((antenna < 0) || (antenna >= MAX_ANTENNA) || (selector_geometry(delay, position) < 0))
+        {
+            notify(ERROR, "In synthdaq_init: no geometry for antenna %d.", antenna);
+            synthdaq_close();
+            return -1;
+        }
+        for (int k = 0; k < 3; k++)
+            synthdaq_ctl.position[k] = position[antenna][k]/CONSTANT_C0*synthdaq_ctl.sample_rate;
+        synthdaq_ctl.delay = (int)(delay[antenna]+0.49999);
+
+        synthdaq_ctl.next_shower = -synthdaq_ctl.sample_rate/synthdaq_ctl.shower_rate*
+            log(synthdaq_uniform(synthdaq_ctl.shower_state));
+        synthdaq_next_shower();
+    }
+
+
+    // Truth file, if the antenna is known (the host may not be named uNNN) and the data
+    // directory is writable.
+    synthdaq_ctl.truth = NULL;
+    if (antenna < 0)
+        notify(WARNING, "In synthdaq_init: invalid antenna %d, running without truth file.", antenna);
+    else
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/A%04d.truth", data_dir, antenna+ANTENNA_ID_OFFSET);
+        synthdaq_ctl.truth = fopen(path, "w");
+        if (synthdaq_ctl.truth == NULL)
+            notify(WARNING, "In synthdaq_init: couldn't create truth file %s, running without.", path);
+        else
+            fprintf(synthdaq_ctl.truth, "# sample irq offset amplitude shower\n");
+    }
+
+    notify(DEBUG, "Synthetic DAQ (antenna %d): baseline=%.1f, sigma=%.1f, pulses at %.1f Hz, showers at %.1f Hz, RFI at %.3g Hz.",
+        antenna, synthdaq_ctl.baseline, synthdaq_ctl.sigma, synthdaq_ctl.pulse_rate, synthdaq_ctl.shower_rate,
+        synthdaq_ctl.rfi_frequency);
+
+    return apexsim_start(synthdaq_fill);
+}
+
+
+int synthdaq_close()
+{
+    apexsim_close();
+
+    if (synthdaq_ctl.truth != NULL)
+    {
+        fclose(synthdaq_ctl.truth);
+        synthdaq_ctl.truth = NULL;
+        notify(DEBUG, "Synthetic DAQ: %lld pulses injected, %lld from showers.", synthdaq_ctl.n_pulse, synthdaq_ctl.n_shower);
+    }
+
+    free(synthdaq_ctl.noise);
+    free(synthdaq_ctl.shape);
+    free(synthdaq_ctl.work);
+    synthdaq_ctl.noise     = NULL;
+    synthdaq_ctl.shape     = NULL;
+    synthdaq_ctl.work      = NULL;
+    synthdaq_ctl.work_size = 0;
+
+    return(0);
+}
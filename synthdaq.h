@@ -0,0 +1,17 @@
+#ifndef SYNTHDAQ_H
+#define SYNTHDAQ_H 1
+
+#include "apexsim.h"
+
+
+// Resolution of the noise table, in bits of random index.
+#define SYNTHDAQ_NOISE_BITS 20
+
+// Maximum number of pulses overlapping a block of data.
+#define SYNTHDAQ_MAX_PENDING 1024
+
+
+int synthdaq_init(char* data_dir, char* options, int antenna);
+int synthdaq_close();
+
+#endif
@@ -0,0 +1,675 @@
+//======================================================================================
+//
+//  trigger-bench.c
+//
+//======================================================================================
+//
+//  End-to-end benchmark of online-trigger on a single machine. The array is emulated
+//  by as many MPI ranks as antennas, plus the master, using the Synth DAQ backend with
+//  plane wave showers injected according to the detector configuration. After the
+//  given duration the run is interrupted and the log, event and truth files are
+//  analysed for the throughput, the loop time distribution, the dead time and the
+//  trigger efficiency.
+//
+//  Options after -- are passed to online-trigger, e.g. the threshold, the detector
+//  configuration, --pipeline or --synthopts.
+//
+//======================================================================================
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#include "apexsim.h"
+#include "event_reader.h"
+#include "logger.h"
+#include "selector.h"
+
+
+#define BENCH_MAX_ARGS 256
+
+
+//========================================================================================
+//
+//  Subroutines prototypes.
+//
+//========================================================================================
+
+// Parse the input arguments.
+int parse_inputs(int argsc, char** argsv);
+
+// Show help text on usage.
+void print_usage(char* process);
+
+
+//========================================================================================
+//
+//  Settings and results.
+//
+//========================================================================================
+
+struct {
+    int     n_antenna;
+    double  duration;
+    int     runid;
+    int     multiplicity;
+    int     window;
+    int     analyse_only;
+    char*   dataloc;
+    char*   simopts;
+    char*   trigger;
+    char*   mpirun;
+    int     n_extra;
+    char**  extra;
+} bench_ctl = {
+    4,
+    10.0,
+    0,
+    2,
+    16,
+    0,
+    "/tmp/trigger-bench",
+    "/tmp/trigger-bench",
+    "./online-trigger",
+    "mpirun --oversubscribe",
+    0,
+    NULL
+};
+
+
+// One loop of an antenna, as logged by online-trigger.
+typedef struct {
+    double t0;
+    double dt[4];           // sync, search, decision wait, copy
+    int    irq_start;
+    int    irq_stop;
+} bench_loop_t;
+
+
+// One injected pulse.
+typedef struct {
+    int    irq;
+    int    offset;
+    float  amplitude;
+    long   shower;
+    int    found;
+} bench_pulse_t;
+
+
+// Per antenna data.
+typedef struct {
+    int            n_loop;
+    bench_loop_t*  loop;
+    int            irq_first;
+    int            n_irq;
+    char*          live;    // per irq since irq_first
+    int            n_pulse;
+    bench_pulse_t* pulse;
+    long           n_event;
+    long           n_fake;
+} bench_antenna_t;
+
+
+static int bench_compare(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y)-(x < y);
+}
+
+
+static double bench_quantile(double* x, int n, double q)
+{
+    if (n == 0)
+        return 0.0;
+    int i = (int)(q*(n-1)+0.5);
+    return x[i];
+}
+
+
+static void bench_path(char* path, int n, int antenna, char* filetag)
+{
+    int ihost = antenna+ANTENNA_ID_OFFSET;
+    snprintf(path, n, "%s/R%06d/R%06d_A%04d_%s", bench_ctl.dataloc, bench_ctl.runid, bench_ctl.runid,
+        ihost, filetag);
+}
+
+
+//========================================================================================
+//
+//  Run the array.
+//
+//========================================================================================
+
+static int bench_launch()
+{
+    // Build the command line: mpirun, the trigger and its options.
+    char* argv[BENCH_MAX_ARGS];
+    int   argc = 0;
+
+    char* mpirun = strdup(bench_ctl.mpirun);
+    char* save   = NULL;
+    for (char* token = strtok_r(mpirun, " ", &save); (token != NULL) && (argc < BENCH_MAX_ARGS-32);
+        token = strtok_r(NULL, " ", &save))
+        argv[argc++] = token;
+
+    char np[16], runid[32], mult[32], dataloc[256], simopts[256];
+    snprintf(np,      sizeof(np),      "%d", bench_ctl.n_antenna+1);
+    snprintf(runid,   sizeof(runid),   "--runid=%d", bench_ctl.runid);
+    snprintf(mult,    sizeof(mult),    "--multiplicity=%d", bench_ctl.multiplicity);
+    snprintf(dataloc, sizeof(dataloc), "--dataloc=%s", bench_ctl.dataloc);
+    snprintf(simopts, sizeof(simopts), "--simopts=%s", bench_ctl.simopts);
+    argv[argc++] = "-np";
+    argv[argc++] = np;
+    argv[argc++] = bench_ctl.trigger;
+    argv[argc++] = "--rankids";
+    argv[argc++] = "--daqtype=Synth";
+    argv[argc++] = runid;
+    argv[argc++] = mult;
+    argv[argc++] = dataloc;
+    argv[argc++] = simopts;
+    for (int i = 0; (i < bench_ctl.n_extra) && (argc < BENCH_MAX_ARGS-1); i++)
+        argv[argc++] = bench_ctl.extra[i];
+    argv[argc] = NULL;
+
+
+    // Run for the requested duration and interrupt.
+    mkdir(bench_ctl.simopts, 0755);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        notify(ERROR, "Couldn't fork the array processes.");
+        free(mpirun);
+        return(-1);
+    }
+    else if (pid == 0)
+    {
+        execvp(argv[0], argv);
+        notify(ERROR, "Couldn't run %s.", argv[0]);
+        _exit(127);
+    }
+
+    notify(INFO, "Running %d antennas for %.1f s.", bench_ctl.n_antenna, bench_ctl.duration);
+    int status;
+    double t = 0.0;
+    while ((t < bench_ctl.duration) && (waitpid(pid, &status, WNOHANG) == 0))
+    {
+        usleep(100000);
+        t += 0.1;
+    }
+    if (t >= bench_ctl.duration)
+    {
+        kill(pid, SIGINT);
+
+        // Give the processes some time for closing their files.
+        for (int i = 0; (i < 100) && (waitpid(pid, &status, WNOHANG) == 0); i++)
+            usleep(100000);
+        if (kill(pid, 0) == 0)
+        {
+            notify(WARNING, "The array processes did not stop, killing them.");
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+        }
+    }
+    else
+        notify(WARNING, "The array processes stopped before the end of the run.");
+
+    free(mpirun);
+    return(0);
+}
+
+
+//========================================================================================
+//
+//  Read the outputs.
+//
+//========================================================================================
+
+static int bench_read_log(int antenna, bench_antenna_t* a)
+{
+    char path[512];
+    bench_path(path, sizeof(path), antenna, "log.txt");
+    FILE* fid = fopen(path, "r");
+    if (fid == NULL)
+    {
+        notify(ERROR, "Couldn't open log file %s", path);
+        return(-1);
+    }
+
+    int size = 1024;
+    a->loop = malloc(size*sizeof(bench_loop_t));
+    char line[256];
+    while ((a->loop != NULL) && (fgets(line, sizeof(line), fid) != NULL))
+    {
+        bench_loop_t* l = a->loop+a->n_loop;
+        int iloop;
+        if (sscanf(line, "%lf %lf %lf %lf %lf %d %d %d", &l->t0, &l->dt[0], &l->dt[1], &l->dt[2], &l->dt[3],
+            &iloop, &l->irq_start, &l->irq_stop) != 8)
+            continue;
+
+        if (++a->n_loop == size)
+        {
+            size *= 2;
+            a->loop = realloc(a->loop, size*sizeof(bench_loop_t));
+        }
+    }
+    fclose(fid);
+    if (a->loop == NULL)
+    {
+        notify(ERROR, "Could not allocate memory for the log of antenna %d.", antenna);
+        return(-1);
+    }
+
+
+    // The run is interrupted and the events of the last loop may not have been written:
+    // drop it. Then map the buffers analysed with data integrity.
+    if (a->n_loop > 0)
+        a->n_loop--;
+    if (a->n_loop == 0)
+        return(0);
+    a->irq_first = a->loop[0].irq_start;
+    int irq_last = a->loop[a->n_loop-1].irq_start;
+    a->n_irq     = irq_last-a->irq_first+1;
+    a->live      = calloc(a->n_irq > 0 ? a->n_irq : 1, 1);
+    if (a->live == NULL)
+        return(-1);
+    for (int i = 0; i < a->n_loop; i++)
+    {
+        int j = a->loop[i].irq_start-a->irq_first;
+        if ((j >= 0) && (j < a->n_irq) && (a->loop[i].irq_stop == a->loop[i].irq_start))
+            a->live[j] = 1;
+    }
+
+    return(0);
+}
+
+
+static int bench_is_live(bench_antenna_t* a, int irq)
+{
+    int j = irq-a->irq_first;
+    return (j >= 0) && (j < a->n_irq) && a->live[j];
+}
+
+
+static int bench_read_truth(int antenna, bench_antenna_t* a)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/A%04d.truth", bench_ctl.simopts, antenna+ANTENNA_ID_OFFSET);
+    FILE* fid = fopen(path, "r");
+    if (fid == NULL)
+    {
+        notify(ERROR, "Couldn't open truth file %s", path);
+        return(-1);
+    }
+
+    int size = 1024;
+    a->pulse = malloc(size*sizeof(bench_pulse_t));
+    char line[256];
+    while ((a->pulse != NULL) && (fgets(line, sizeof(line), fid) != NULL))
+    {
+        bench_pulse_t* p = a->pulse+a->n_pulse;
+        long long t;
+        if ((line[0] == '#') ||
+            (sscanf(line, "%lld %d %d %f %ld", &t, &p->irq, &p->offset, &p->amplitude, &p->shower) != 5))
+            continue;
+        p->found = 0;
+
+        if (++a->n_pulse == size)
+        {
+            size *= 2;
+            a->pulse = realloc(a->pulse, size*sizeof(bench_pulse_t));
+        }
+    }
+    fclose(fid);
+
+    return (a->pulse == NULL) ? -1 : 0;
+}
+
+
+static int bench_read_events(int antenna, bench_antenna_t* a)
+{
+    // Match the recorded events to the injected pulses, both being in time order.
+    char path[512];
+    bench_path(path, sizeof(path), antenna, "event.bin");
+    er_file_t* file = er_open(path);
+    if (file == NULL)
+    {
+        notify(ERROR, "Couldn't open event file %s", path);
+        return(-1);
+    }
+
+    unsigned char* data = malloc(file->header.sample_size);
+    a->n_event = er_count(file);
+    int ip = 0;
+    for (long i = 0; (data != NULL) && (i < a->n_event); i++)
+    {
+        int info[EVT_INFO_SIZE];
+        if (er_read(file, i, info, data) < 0)
+            break;
+        int irq  = info[1];
+        int time = info[2]*SAMPLE_SIZE+info[3];
+
+        while ((ip < a->n_pulse) && ((a->pulse[ip].irq < irq) ||
+            ((a->pulse[ip].irq == irq) && (a->pulse[ip].offset < time-bench_ctl.window))))
+            ip++;
+
+        int matched = 0;
+        for (int jp = ip; (jp < a->n_pulse) && (a->pulse[jp].irq == irq) &&
+            (a->pulse[jp].offset <= time+bench_ctl.window); jp++)
+        {
+            a->pulse[jp].found = 1;
+            matched = 1;
+        }
+        if (!matched)
+            a->n_fake++;
+    }
+    free(data);
+    er_close(file);
+
+    return(0);
+}
+
+
+//========================================================================================
+//
+//  Report.
+//
+//========================================================================================
+
+static void bench_report(bench_antenna_t* antenna)
+{
+    const int n = bench_ctl.n_antenna;
+
+    // Throughput and dead time.
+    long n_loop = 0, n_live = 0, n_irq = 0;
+    double elapsed = 0.0;
+    for (int i = 0; i < n; i++)
+    {
+        bench_antenna_t* a = antenna+i;
+        n_loop += a->n_loop;
+        n_irq  += a->n_irq;
+        for (int j = 0; j < a->n_irq; j++)
+            n_live += a->live[j];
+        if (a->n_loop == 0)
+            continue;
+        bench_loop_t* last = a->loop+a->n_loop-1;
+        double t = last->t0+last->dt[0]+last->dt[1]+last->dt[2]+last->dt[3]-a->loop[0].t0;
+        if (t > elapsed)
+            elapsed = t;
+    }
+
+    printf("antennas         %d\n", n);
+    printf("loops            %ld\n", n_loop);
+    printf("buffers          %ld\n", n_irq);
+    printf("live_buffers     %ld\n", n_live);
+    printf("dead_time        %.4f\n", (n_irq > 0) ? 1.0-(double)n_live/n_irq : 0.0);
+    printf("elapsed          %.3f s\n", elapsed);
+    printf("throughput       %.1f MB/s per antenna\n",
+        (elapsed > 0.0) ? (double)n_live/n*APEXSIM_SIZE/elapsed*1.0e-06 : 0.0);
+
+
+    // Loop time distribution, per stage and in total.
+    double* x = malloc((n_loop > 0 ? n_loop : 1)*sizeof(double));
+    char* stage[5] = {"sync", "search", "decision", "copy", "loop"};
+    for (int k = 0; (x != NULL) && (k < 5); k++)
+    {
+        int m = 0;
+        for (int i = 0; i < n; i++) for (int j = 0; j < antenna[i].n_loop; j++)
+        {
+            double* dt = antenna[i].loop[j].dt;
+            x[m++] = (k < 4) ? dt[k] : dt[0]+dt[1]+dt[2]+dt[3];
+        }
+        qsort(x, m, sizeof(double), bench_compare);
+        printf("%-8s time    p50=%.4f p90=%.4f p99=%.4f max=%.4f s\n", stage[k],
+            bench_quantile(x, m, 0.5), bench_quantile(x, m, 0.9), bench_quantile(x, m, 0.99),
+            bench_quantile(x, m, 1.0));
+    }
+    free(x);
+
+
+    // Efficiency to the pulses of showers and to isolated pulses, in live buffers, and
+    // noise events.
+    long n_pulse[2] = {0, 0}, n_found[2] = {0, 0}, n_event = 0, n_fake = 0;
+    long n_shower = -1;
+    for (int i = 0; i < n; i++)
+    {
+        bench_antenna_t* a = antenna+i;
+        n_event += a->n_event;
+        n_fake  += a->n_fake;
+        for (int j = 0; j < a->n_pulse; j++)
+        {
+            bench_pulse_t* p = a->pulse+j;
+            if (p->shower > n_shower)
+                n_shower = p->shower;
+            if (!bench_is_live(a, p->irq))
+                continue;
+            int k = (p->shower >= 0) ? 0 : 1;
+            n_pulse[k]++;
+            n_found[k] += p->found;
+        }
+    }
+    n_shower++;
+
+    printf("events           %ld\n", n_event);
+    printf("noise_events     %ld\n", n_fake);
+    printf("pulse_efficiency %.4f (%ld/%ld shower pulses)\n",
+        (n_pulse[0] > 0) ? (double)n_found[0]/n_pulse[0] : 0.0, n_found[0], n_pulse[0]);
+    printf("accidentals      %.4f (%ld/%ld isolated pulses)\n",
+        (n_pulse[1] > 0) ? (double)n_found[1]/n_pulse[1] : 0.0, n_found[1], n_pulse[1]);
+
+
+    // A shower is triggerable when at least multiplicity antennas were live, and
+    // triggered when as many recorded it.
+    if (n_shower == 0)
+        return;
+    int* live  = calloc(n_shower, sizeof(int));
+    int* found = calloc(n_shower, sizeof(int));
+    float* amplitude = calloc(n_shower, sizeof(float));
+    if ((live == NULL) || (found == NULL) || (amplitude == NULL))
+    {
+        free(live);
+        free(found);
+        free(amplitude);
+        return;
+    }
+    float a_min = INFINITY, a_max = -INFINITY;
+    for (int i = 0; i < n; i++)
+    {
+        bench_antenna_t* a = antenna+i;
+        for (int j = 0; j < a->n_pulse; j++)
+        {
+            bench_pulse_t* p = a->pulse+j;
+            if ((p->shower < 0) || !bench_is_live(a, p->irq))
+                continue;
+            live[p->shower]++;
+            found[p->shower] += p->found;
+            amplitude[p->shower] = p->amplitude;
+            if (p->amplitude < a_min)
+                a_min = p->amplitude;
+            if (p->amplitude > a_max)
+                a_max = p->amplitude;
+        }
+    }
+
+    #define BENCH_N_BIN 5
+    long n_bin[BENCH_N_BIN] = {0}, n_bin_found[BENCH_N_BIN] = {0};
+    long n_triggerable = 0, n_triggered = 0;
+    for (long s = 0; s < n_shower; s++) if (live[s] >= bench_ctl.multiplicity)
+    {
+        int b = (a_max > a_min) ? (int)(BENCH_N_BIN*(amplitude[s]-a_min)/(a_max-a_min)) : 0;
+        if (b >= BENCH_N_BIN)
+            b = BENCH_N_BIN-1;
+        int triggered = (found[s] >= bench_ctl.multiplicity);
+        n_triggerable++;
+        n_triggered += triggered;
+        n_bin[b]++;
+        n_bin_found[b] += triggered;
+    }
+    printf("showers          %ld\n", n_shower);
+    printf("shower_eff       %.4f (%ld/%ld triggerable showers)\n",
+        (n_triggerable > 0) ? (double)n_triggered/n_triggerable : 0.0, n_triggered, n_triggerable);
+    for (int b = 0; b < BENCH_N_BIN; b++) if (n_bin[b] > 0)
+    {
+        printf("shower_eff_bin   amplitude=[%.1f, %.1f] %.4f (%ld/%ld)\n",
+            a_min+b*(a_max-a_min)/BENCH_N_BIN, a_min+(b+1)*(a_max-a_min)/BENCH_N_BIN,
+            (double)n_bin_found[b]/n_bin[b], n_bin_found[b], n_bin[b]);
+    }
+
+    free(live);
+    free(found);
+    free(amplitude);
+}
+
+
+//========================================================================================
+int main(int argsc, char *argsv[])
+//========================================================================================
+{
+    if (parse_inputs(argsc, argsv) < 0)
+        exit(0);
+
+    if (!bench_ctl.analyse_only && (bench_launch() < 0))
+        return -1;
+
+
+    // Read back the outputs of every antenna.
+    bench_antenna_t* antenna = calloc(bench_ctl.n_antenna, sizeof(bench_antenna_t));
+    if (antenna == NULL)
+        return -1;
+    int ret = 0;
+    for (int i = 0; (i < bench_ctl.n_antenna) && (ret == 0); i++)
+    {
+        if ((bench_read_log(i, antenna+i) < 0) || (bench_read_truth(i, antenna+i) < 0) ||
+            (bench_read_events(i, antenna+i) < 0))
+            ret = -1;
+    }
+
+    if (ret == 0)
+        bench_report(antenna);
+
+    for (int i = 0; i < bench_ctl.n_antenna; i++)
+    {
+        free(antenna[i].loop);
+        free(antenna[i].live);
+        free(antenna[i].pulse);
+    }
+    free(antenna);
+
+    return ret;
+}
+
+
+//================================================================
+int parse_inputs(int argsc, char** argsv)
+//================================================================
+//
+//  Parse the inputs arguments.
+//
+//================================================================
+{
+    char c;
+
+    // Parse the command line.
+    while (1)
+    {
+        static struct option long_options[] =
+        {
+            {"help",          no_argument,       0, 'h'},
+            {"antennas",      required_argument, 0, 'n'},
+            {"duration",      required_argument, 0, 't'},
+            {"runid",         required_argument, 0, 'r'},
+            {"multiplicity",  required_argument, 0, 'm'},
+            {"window",        required_argument, 0, 'w'},
+            {"dataloc",       required_argument, 0, 'L'},
+            {"simopts",       required_argument, 0, 'O'},
+            {"trigger",       required_argument, 0, 'x'},
+            {"mpirun",        required_argument, 0, 'p'},
+            {"analyse",       no_argument,       0, 'a'},
+            LOGGER_LONG_OPTIONS,
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        c = getopt_long(argsc, argsv, "hn:t:r:m:w:L:O:x:p:a" LOGGER_GETOPT_DESCRIPTOR, long_options, &option_index);
+
+        if (c == -1)
+            break;
+        else if (c == 'h')
+        {
+            print_usage(argsv[0]);
+            return(-1);
+        }
+        else if (c == 'n')
+            bench_ctl.n_antenna = atoi(optarg);
+        else if (c == 't')
+            bench_ctl.duration = atof(optarg);
+        else if (c == 'r')
+            bench_ctl.runid = atoi(optarg);
+        else if (c == 'm')
+            bench_ctl.multiplicity = atoi(optarg);
+        else if (c == 'w')
+            bench_ctl.window = atoi(optarg);
+        else if (c == 'L')
+            bench_ctl.dataloc = optarg;
+        else if (c == 'O')
+            bench_ctl.simopts = optarg;
+        else if (c == 'x')
+            bench_ctl.trigger = optarg;
+        else if (c == 'p')
+            bench_ctl.mpirun = optarg;
+        else if (c == 'a')
+            bench_ctl.analyse_only = 1;
+        else if (c == '?')
+        {
+            print_usage(argsv[0]);
+            return(-1);
+        }
+        else
+           logger_parse_option(c, optarg);
+    }
+
+    // The remaining arguments go to the trigger.
+    bench_ctl.n_extra = argsc-optind;
+    bench_ctl.extra   = argsv+optind;
+
+    if ((bench_ctl.n_antenna < 1) || (bench_ctl.n_antenna > MAX_ANTENNA) || (bench_ctl.multiplicity < 1))
+    {
+        print_usage(argsv[0]);
+        return(-1);
+    }
+    return(0);
+}
+
+
+//================================================================
+void print_usage(char* proccess)
+//================================================================
+//
+//  Show help text on usage.
+//
+//================================================================
+{
+    printf(
+        "Usage: %s (--antennas=[int]) (--duration=[float]) (--runid=[int]) (--multiplicity=[int])\n"
+        "    (--window=[int]) (--dataloc=[char*]) (--simopts=[char*]) (--trigger=[char*])\n"
+        "    (--mpirun=[char*]) (--analyse) %s -- [online-trigger options]\n"
+        "* antennas:        the number of emulated antennas. Defaults to 4.\n"
+        "* duration:        the duration of the run, in unit second. Defaults to 10 s.\n"
+        "* runid:           the run number of the data files. Defaults to 0.\n"
+        "* multiplicity:    the trigger multiplicity. Defaults to 2.\n"
+        "* window:          the tolerance for matching events to injected pulses, in samples.\n"
+        "                   Defaults to 16.\n"
+        "* dataloc:         where the trigger writes its data. Defaults to /tmp/trigger-bench.\n"
+        "* simopts:         where the synthetic DAQ writes the truth. Defaults to /tmp/trigger-bench.\n"
+        "* trigger:         the online-trigger executable. Defaults to ./online-trigger.\n"
+        "* mpirun:          the MPI launcher. Defaults to 'mpirun --oversubscribe'.\n"
+        "* analyse:         only analyse the files of a previous run.\n",
+        proccess, logger_usage_text()
+    );
+    printf(logger_help_text());
+}
@@ -0,0 +1,210 @@
+#include <string.h>
+#include "wire_protocol.h"
+
+//========================================================================================
+//
+//  Header layout, little endian: seq (4 bytes), irq (4 bytes), antenna (2 bytes), count
+//  (2 bytes).
+//
+//  Spike times are sent as the difference to the previous time, starting from 0, zigzag
+//  mapped and LEB128 encoded. Times are usually increasing and spaced by far less than
+//  2^21 samples, hence 1 to 3 bytes per spike instead of 4 or 8.
+//
+//  Hits, forwarded by the sub-masters, are pairs of an antenna index, LEB128 encoded, and
+//  a spike time encoded as above.
+//
+//  Decisions are sent as a bitmap, bit i%8 of byte i/8 standing for spike i.
+//
+//  Decoders return -1 on a malformed or truncated message.
+//
+//========================================================================================
+
+static void wp_put(unsigned char* p, unsigned int v, int n)
+{
+    for (int i = 0; i < n; i++)
+        p[i] = (v >> (8*i)) & 0xff;
+}
+
+
+static unsigned int wp_get(unsigned char* p, int n)
+{
+    unsigned int v = 0;
+    for (int i = 0; i < n; i++)
+        v |= (unsigned int)p[i] << (8*i);
+    return v;
+}
+
+
+static void wp_encode_header(wp_header_t* header, unsigned char* buffer)
+{
+    wp_put(buffer+0,  header->seq,     4);
+    wp_put(buffer+4,  header->irq,     4);
+    wp_put(buffer+8,  header->antenna, 2);
+    wp_put(buffer+10, header->count,   2);
+}
+
+
+static int wp_decode_header(unsigned char* buffer, int size, wp_header_t* header)
+{
+    if (size < WP_HEADER_SIZE)
+        return(-1);
+
+    header->seq     = (int)wp_get(buffer+0, 4);
+    header->irq     = (int)wp_get(buffer+4, 4);
+    header->antenna = (short)wp_get(buffer+8, 2);
+    header->count   = wp_get(buffer+10, 2);
+
+    return(0);
+}
+
+
+static unsigned char* wp_put_varint(unsigned char* p, unsigned int z)
+{
+    while (z >= 0x80)
+    {
+        *p++ = (z & 0x7f) | 0x80;
+        z >>= 7;
+    }
+    *p++ = z;
+
+    return p;
+}
+
+
+static unsigned char* wp_get_varint(unsigned char* p, unsigned char* end, unsigned int* z)
+{
+    *z = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+        if ((p == end) || (shift > 28))
+            return NULL;
+        *z |= (unsigned int)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            return p;
+    }
+}
+
+
+static inline unsigned int wp_zigzag(int delta)
+{
+    return ((unsigned int)delta << 1) ^ (unsigned int)(delta >> 31);
+}
+
+
+static inline int wp_unzigzag(unsigned int z)
+{
+    return (int)(z >> 1) ^ -(int)(z & 1);
+}
+
+
+int wp_encode_times(wp_header_t* header, int* time, unsigned char* buffer)
+{
+    if ((header->count < 0) || (header->count > WP_MAX_COUNT))
+        return(-1);
+
+    wp_encode_header(header, buffer);
+
+    unsigned char* p = buffer+WP_HEADER_SIZE;
+    int previous = 0;
+    for (int i = 0; i < header->count; i++)
+    {
+        p = wp_put_varint(p, wp_zigzag(time[i]-previous));
+        previous = time[i];
+    }
+
+    return p-buffer;
+}
+
+
+int wp_decode_times(unsigned char* buffer, int size, wp_header_t* header, int* time, int max_time)
+{
+    if ((wp_decode_header(buffer, size, header) < 0) || (header->count > max_time))
+        return(-1);
+
+    unsigned char* p   = buffer+WP_HEADER_SIZE;
+    unsigned char* end = buffer+size;
+    int previous = 0;
+    for (int i = 0; i < header->count; i++)
+    {
+        unsigned int z;
+        if ((p = wp_get_varint(p, end, &z)) == NULL)
+            return(-1);
+        previous += wp_unzigzag(z);
+        time[i] = previous;
+    }
+
+    return (p == end) ? 0 : -1;
+}
+
+
+int wp_encode_hits(wp_header_t* header, int* antenna, int* time, unsigned char* buffer)
+{
+    if ((header->count < 0) || (header->count > WP_MAX_COUNT))
+        return(-1);
+
+    wp_encode_header(header, buffer);
+
+    unsigned char* p = buffer+WP_HEADER_SIZE;
+    int previous = 0;
+    for (int i = 0; i < header->count; i++)
+    {
+        p = wp_put_varint(p, antenna[i] & 0xffff);
+        p = wp_put_varint(p, wp_zigzag(time[i]-previous));
+        previous = time[i];
+    }
+
+    return p-buffer;
+}
+
+
+int wp_decode_hits(unsigned char* buffer, int size, wp_header_t* header, int* antenna, int* time, int max_hit)
+{
+    if ((wp_decode_header(buffer, size, header) < 0) || (header->count > max_hit))
+        return(-1);
+
+    unsigned char* p   = buffer+WP_HEADER_SIZE;
+    unsigned char* end = buffer+size;
+    int previous = 0;
+    for (int i = 0; i < header->count; i++)
+    {
+        unsigned int a, z;
+        if (((p = wp_get_varint(p, end, &a)) == NULL) || (a > 0xffff) ||
+            ((p = wp_get_varint(p, end, &z)) == NULL))
+            return(-1);
+        antenna[i] = a;
+        previous  += wp_unzigzag(z);
+        time[i]    = previous;
+    }
+
+    return (p == end) ? 0 : -1;
+}
+
+
+int wp_encode_decisions(wp_header_t* header, char* decision, unsigned char* buffer)
+{
+    if ((header->count < 0) || (header->count > WP_MAX_COUNT))
+        return(-1);
+
+    wp_encode_header(header, buffer);
+
+    unsigned char* bitmap = buffer+WP_HEADER_SIZE;
+    memset(bitmap, 0x0, (header->count+7)/8);
+    for (int i = 0; i < header->count; i++) if (decision[i])
+        bitmap[i/8] |= 1 << (i%8);
+
+    return WP_DECISIONS_SIZE(header->count);
+}
+
+
+int wp_decode_decisions(unsigned char* buffer, int size, wp_header_t* header, char* decision, int max_decision)
+{
+    if ((wp_decode_header(buffer, size, header) < 0) || (header->count > max_decision) ||
+        (size != WP_DECISIONS_SIZE(header->count)))
+        return(-1);
+
+    unsigned char* bitmap = buffer+WP_HEADER_SIZE;
+    for (int i = 0; i < header->count; i++)
+        decision[i] = (bitmap[i/8] >> (i%8)) & 0x1;
+
+    return(0);
+}
@@ -0,0 +1,32 @@
+#ifndef WIRE_PROTOCOL_H
+#define WIRE_PROTOCOL_H 1
+
+// Messages exchanged between the trigger slaves and their master. A 12 bytes header is
+// followed either by the spike times, delta and varint encoded, by hits (antenna index and
+// spike time) or by a decision bitmap.
+
+#define WP_HEADER_SIZE 12
+#define WP_MAX_COUNT   65535
+
+// Upper bounds on the encoded sizes for n spikes.
+#define WP_TIMES_SIZE(n)     (WP_HEADER_SIZE+5*(n))
+#define WP_HITS_SIZE(n)      (WP_HEADER_SIZE+8*(n))
+#define WP_DECISIONS_SIZE(n) (WP_HEADER_SIZE+((n)+7)/8)
+
+
+typedef struct {
+    int seq;        // message sequence number of the sender
+    int irq;        // DMA buffer the spikes belong to
+    int antenna;
+    int count;      // number of spikes
+} wp_header_t;
+
+
+int wp_encode_times(wp_header_t* header, int* time, unsigned char* buffer);
+int wp_decode_times(unsigned char* buffer, int size, wp_header_t* header, int* time, int max_time);
+int wp_encode_hits(wp_header_t* header, int* antenna, int* time, unsigned char* buffer);
+int wp_decode_hits(unsigned char* buffer, int size, wp_header_t* header, int* antenna, int* time, int max_hit);
+int wp_encode_decisions(wp_header_t* header, char* decision, unsigned char* buffer);
+int wp_decode_decisions(unsigned char* buffer, int size, wp_header_t* header, char* decision, int max_decision);
+
+#endif
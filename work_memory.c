@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "work_memory.h"
+#include "logger.h"
+
+//========================================================================================
+//
+//  Allocation of the large working sets of the DAQ programs, zeroed and page aligned:
+//
+//  - WM_HUGE:  backed by huge pages, reserved ones (MAP_HUGETLB) or else transparent
+//              ones (MADV_HUGEPAGE), to cut the TLB misses when scanning whole buffers.
+//  - WM_LOCAL: bound to the NUMA node of the calling CPU.
+//  - WM_LOCK:  locked in memory.
+//
+//  All the pages are faulted in at allocation, not in the acquisition loop. Each
+//  property falls back silently, but locking which warns, since it needs the
+//  CAP_IPC_LOCK capability or a large enough RLIMIT_MEMLOCK.
+//
+//========================================================================================
+
+#define WM_HUGE_PAGE   (2*1024*1024)
+#define WM_MAX_BUFFER  64
+
+// Linux NUMA policy, from numaif.h which comes with libnuma.
+#define WM_MPOL_PREFERRED 1
+
+
+typedef struct {
+    void*  address;
+    size_t size;
+    int    locked;
+} wm_buffer_t;
+
+
+struct {
+    pthread_mutex_t mutex;
+    wm_buffer_t     buffer[WM_MAX_BUFFER];
+} wm_ctl = {
+    PTHREAD_MUTEX_INITIALIZER
+};
+
+
+static int wm_bind_local(void* address, size_t size)
+{
+    int node = -1;
+    unsigned int cpu;
+    if ((syscall(SYS_getcpu, &cpu, &node, NULL) != 0) || (node < 0))
+        return(-1);
+
+    unsigned long mask[4] = {0, 0, 0, 0};
+    if (node >= (int)(8*sizeof(mask)))
+        return(-1);
+    mask[node/(8*sizeof(long))] = 1UL << (node % (8*sizeof(long)));
+
+    if (syscall(SYS_mbind, address, size, WM_MPOL_PREFERRED, mask, 8*sizeof(mask), 0) != 0)
+        return(-1);
+
+    return node;
+}
+
+
+void* wm_alloc(size_t size, int flags)
+{
+    if (size == 0)
+        return NULL;
+
+
+    // Map huge pages if any are reserved, otherwise regular ones.
+    void* address = MAP_FAILED;
+    char* backing = "4kB pages";
+    size_t length = size;
+    if (flags & WM_HUGE)
+    {
+        length  = (size+WM_HUGE_PAGE-1)/WM_HUGE_PAGE*WM_HUGE_PAGE;
+        address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        backing = "huge pages";
+    }
+    if (address == MAP_FAILED)
+    {
+        address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (address == MAP_FAILED)
+        {
+            notify(ERROR, "Could not allocate %zu bytes of work memory.", size);
+            return NULL;
+        }
+        backing = "4kB pages";
+        if ((flags & WM_HUGE) && (madvise(address, length, MADV_HUGEPAGE) == 0))
+            backing = "transparent huge pages";
+    }
+
+
+    // Place the pages before they are faulted in.
+    int node = -1;
+    if (flags & WM_LOCAL)
+        node = wm_bind_local(address, length);
+
+    int locked = 0;
+    if (flags & WM_LOCK)
+    {
+        locked = (mlock(address, length) == 0);
+        if (!locked)
+            notify(WARNING, "Could not lock %zu bytes of work memory in RAM.", size);
+    }
+    if (!locked)
+    {
+        long page = sysconf(_SC_PAGESIZE);
+        for (size_t i = 0; i < length; i += page)
+            ((volatile unsigned char*)address)[i] = 0;
+    }
+
+
+    // Register the buffer for wm_free.
+    pthread_mutex_lock(&wm_ctl.mutex);
+    int i;
+    for (i = 0; (i < WM_MAX_BUFFER) && (wm_ctl.buffer[i].address != NULL); i++);
+    if (i < WM_MAX_BUFFER)
+        wm_ctl.buffer[i] = (wm_buffer_t){address, length, locked};
+    pthread_mutex_unlock(&wm_ctl.mutex);
+    if (i == WM_MAX_BUFFER)
+    {
+        notify(ERROR, "Too many work buffers, the maximum is %d.", WM_MAX_BUFFER);
+        if (locked)
+            munlock(address, length);
+        munmap(address, length);
+        return NULL;
+    }
+
+    notify(DEBUG, "Allocated %zu bytes of work memory on %s%s, node %d.", size, backing, locked ? ", locked" : "",
+        node);
+
+    return address;
+}
+
+
+void wm_free(void* buffer)
+{
+    if (buffer == NULL)
+        return;
+
+    pthread_mutex_lock(&wm_ctl.mutex);
+    int i;
+    for (i = 0; (i < WM_MAX_BUFFER) && (wm_ctl.buffer[i].address != buffer); i++);
+    wm_buffer_t b = {NULL, 0, 0};
+    if (i < WM_MAX_BUFFER)
+    {
+        b = wm_ctl.buffer[i];
+        wm_ctl.buffer[i].address = NULL;
+    }
+    pthread_mutex_unlock(&wm_ctl.mutex);
+
+    if (b.address == NULL)
+    {
+        notify(ERROR, "In wm_free: unknown work buffer %p.", buffer);
+        return;
+    }
+
+    if (b.locked)
+        munlock(b.address, b.size);
+    munmap(b.address, b.size);
+}
@@ -0,0 +1,13 @@
+#ifndef WORK_MEMORY_H
+#define WORK_MEMORY_H 1
+
+#include <stddef.h>
+
+
+// Properties requested for a work buffer, each one with a fallback.
+enum WmFlags {WM_HUGE=0x1, WM_LOCK=0x2, WM_LOCAL=0x4, WM_DEFAULT=0x7};
+
+void* wm_alloc(size_t size, int flags);
+void wm_free(void* buffer);
+
+#endif